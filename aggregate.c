@@ -0,0 +1,416 @@
+/*
+Copyright (c) 2026 by the rabeld contributors.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <signal.h>
+
+#include "babeld.h"
+#include "kernel.h"
+#include "util.h"
+#include "interface.h"
+#include "neighbour.h"
+#include "source.h"
+#include "route.h"
+#include "xroute.h"
+#include "message.h"
+#include "aggregate.h"
+
+/* How many times a sibling may be split when looking for its
+   components, so it may be tiled by up to 2^AGGREGATE_DEPTH routes. */
+#define AGGREGATE_DEPTH 4
+
+/* The route we would announce for this prefix, using the same rule as
+   flushupdates. */
+static int
+component(const unsigned char *prefix, unsigned char plen,
+          struct aggregate *c)
+{
+    struct xroute *xroute = find_xroute(prefix, plen, zeroes, 0);
+    struct babel_route *route = find_installed_route(prefix, plen, zeroes, 0);
+
+    if(xroute && (!route || xroute->metric <= kernel_metric)) {
+        memcpy(c->id, myid, 8);
+        c->seqno = myseqno;
+        c->metric = xroute->metric;
+        c->neigh = NULL;
+    } else if(route && route_metric(route) < INFINITY) {
+        memcpy(c->id, route->src->id, 8);
+        c->seqno = route->seqno;
+        c->metric = route_metric(route);
+        c->neigh = route->neigh;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int
+route_exists(const unsigned char *prefix, unsigned char plen)
+{
+    return find_xroute(prefix, plen, zeroes, 0) != NULL ||
+        find_installed_route(prefix, plen, zeroes, 0) != NULL;
+}
+
+/* Whether no route lies strictly between prefix/plen and the aggregate
+   of length aplen containing it. */
+static int
+inner_route(const unsigned char *prefix, unsigned char plen,
+            unsigned char aplen)
+{
+    unsigned char p[16];
+    int l;
+
+    for(l = plen - 1; l > aplen; l--) {
+        normalize_prefix(p, prefix, l);
+        if(route_exists(p, l))
+            return 0;
+    }
+    return 1;
+}
+
+/* Whether prefix is exactly tiled by components compatible with ref.
+   On success, ref->metric is raised to the largest component metric. */
+static int
+covered(const unsigned char *prefix, unsigned char plen,
+        struct aggregate *ref, int depth)
+{
+    struct aggregate c;
+    unsigned char half[16];
+
+    if(component(prefix, plen, &c)) {
+        if(memcmp(c.id, ref->id, 8) != 0 || c.seqno != ref->seqno ||
+           c.neigh != ref->neigh)
+            return 0;
+        ref->metric = MAX(ref->metric, c.metric);
+        return 1;
+    }
+
+    if(depth <= 0 || plen >= 128 || route_exists(prefix, plen))
+        return 0;
+
+    memcpy(half, prefix, 16);
+    if(!covered(half, plen + 1, ref, depth - 1))
+        return 0;
+    half[plen / 8] |= 0x80 >> (plen % 8);
+    return covered(half, plen + 1, ref, depth - 1);
+}
+
+/* Find the largest aggregate containing the route for prefix.  Returns 1
+   if there is one, 0 if the route should be announced on its own. */
+int
+find_aggregate(const unsigned char *prefix, unsigned char plen,
+               struct aggregate *agg)
+{
+    unsigned char parent[16];
+    struct aggregate tmp;
+    int v4 = plen >= 96 && v4mapped(prefix);
+
+    memset(agg, 0, sizeof(*agg));
+    if(!component(prefix, plen, agg))
+        return 0;
+    normalize_prefix(agg->prefix, prefix, plen);
+    agg->plen = plen;
+
+    while(agg->plen > (v4 ? 96 : 0)) {
+        unsigned char p = agg->plen - 1;
+        normalize_prefix(parent, agg->prefix, p);
+        /* Don't mix IPv6 and IPv4-mapped routes. */
+        if(!v4 && p <= 96 && in_prefix(v4prefix, parent, p))
+            break;
+        /* Don't hide a real route for the covering prefix. */
+        if(route_exists(parent, p))
+            break;
+        /* The sibling of the current aggregate. */
+        memcpy(tmp.prefix, agg->prefix, 16);
+        tmp.prefix[p / 8] ^= 0x80 >> (p % 8);
+        memcpy(tmp.id, agg->id, 8);
+        tmp.seqno = agg->seqno;
+        tmp.metric = agg->metric;
+        tmp.neigh = agg->neigh;
+        if(!covered(tmp.prefix, agg->plen, &tmp, AGGREGATE_DEPTH))
+            break;
+        memcpy(agg->prefix, parent, 16);
+        agg->plen = p;
+        agg->metric = tmp.metric;
+    }
+
+    return agg->plen < plen;
+}
+
+/* Aggregates use a new encoding, so we only send them on interfaces
+   where every neighbour told us it understands it. */
+int
+interface_aggregates(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    int n = 0;
+
+    if(!(ifp->flags & IF_AGGREGATE))
+        return 0;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        if(!neigh->aggregate)
+            return 0;
+        n++;
+    }
+    return n > 0;
+}
+
+/* Calls f on every component of the aggregate prefix/plen, that is on
+   every route strictly inside it that is not inside another such route,
+   until f returns non-zero.  Installed routes are found through the
+   destination index of the RIB; xroutes are few and are walked. */
+int
+aggregate_components(const unsigned char *prefix, unsigned char plen,
+                     int (*f)(const unsigned char *, unsigned char, void *),
+                     void *closure)
+{
+    struct babel_route **routes;
+    struct xroute_stream *xroutes;
+    int i, n, rc = 0;
+
+    n = installed_routes_from(zeroes, 0, prefix, plen, &routes);
+    for(i = 0; i < n; i++) {
+        struct source *src = routes[i]->src;
+        if(!inner_route(src->prefix, src->plen, plen))
+            continue;
+        rc = f(src->prefix, src->plen, closure);
+        if(rc)
+            return rc;
+    }
+
+    xroutes = xroute_stream();
+    if(xroutes == NULL)
+        return 0;
+    while(1) {
+        struct xroute *xroute = xroute_stream_next(xroutes);
+        if(xroute == NULL)
+            break;
+        if(xroute->src_plen != 0 || xroute->plen <= plen ||
+           !in_prefix(xroute->prefix, prefix, plen) ||
+           !inner_route(xroute->prefix, xroute->plen, plen) ||
+           find_installed_route(xroute->prefix, xroute->plen,
+                                zeroes, 0) != NULL)
+            continue;
+        rc = f(xroute->prefix, xroute->plen, closure);
+        if(rc)
+            break;
+    }
+    xroute_stream_done(xroutes);
+    return rc;
+}
+
+static int
+copy_component(const unsigned char *prefix, unsigned char plen,
+               void *closure)
+{
+    struct aggregate *c = closure;
+    memcpy(c->prefix, prefix, 16);
+    c->plen = plen;
+    return 1;
+}
+
+/* Any one component of prefix/plen.  They all share the router-id and
+   seqno of the aggregate, so a request for the aggregate can be handled
+   as a request for it. */
+int
+aggregate_component(const unsigned char *prefix, unsigned char plen,
+                    unsigned char *prefix_return, unsigned char *plen_return)
+{
+    struct aggregate c;
+
+    if(!aggregate_components(prefix, plen, copy_component, &c))
+        return 0;
+    memcpy(prefix_return, c.prefix, 16);
+    *plen_return = c.plen;
+    return 1;
+}
+
+/* Whether the route for prefix is one of the components of agg, rather
+   than outside it or nested within one of them. */
+int
+aggregate_hides(const struct aggregate *agg,
+                const unsigned char *prefix, unsigned char plen)
+{
+    return plen > agg->plen && in_prefix(prefix, agg->prefix, agg->plen) &&
+        inner_route(prefix, plen, agg->plen);
+}
+
+/* Announced aggregates are kept sorted by prefix then length.  Live
+   aggregates never overlap, so the one containing a prefix, if any, is
+   the last live one that doesn't sort after it. */
+static int
+aggregate_compare(const struct aggregate *a,
+                  const unsigned char *prefix, int plen)
+{
+    int i = memcmp(a->prefix, prefix, 16);
+    if(i != 0)
+        return i;
+    return (int)a->plen - plen;
+}
+
+/* The first position whose aggregate doesn't sort before prefix/plen. */
+static int
+aggregate_position(struct interface *ifp,
+                   const unsigned char *prefix, int plen)
+{
+    int p = 0, g = ifp->numaggregates;
+    while(p < g) {
+        int m = (p + g) / 2;
+        if(aggregate_compare(&ifp->aggregates[m], prefix, plen) < 0)
+            p = m + 1;
+        else
+            g = m;
+    }
+    return p;
+}
+
+/* With exact set, find the aggregate for prefix, withdrawn or not;
+   otherwise, find a live aggregate containing it. */
+struct aggregate *
+find_announced_aggregate(struct interface *ifp,
+                         const unsigned char *prefix, unsigned char plen,
+                         int exact)
+{
+    int i;
+
+    if(exact) {
+        i = aggregate_position(ifp, prefix, plen);
+        if(i < ifp->numaggregates &&
+           aggregate_compare(&ifp->aggregates[i], prefix, plen) == 0)
+            return &ifp->aggregates[i];
+        return NULL;
+    }
+
+    i = aggregate_position(ifp, prefix, plen + 1);
+    while(--i >= 0) {
+        struct aggregate *a = &ifp->aggregates[i];
+        if(a->withdrawn)
+            continue;
+        if(a->plen <= plen && in_prefix(prefix, a->prefix, a->plen))
+            return a;
+        break;
+    }
+    return NULL;
+}
+
+/* The first live aggregate strictly inside prefix/plen. */
+struct aggregate *
+find_announced_aggregate_within(struct interface *ifp,
+                                const unsigned char *prefix,
+                                unsigned char plen)
+{
+    int i;
+
+    for(i = aggregate_position(ifp, prefix, plen + 1);
+        i < ifp->numaggregates; i++) {
+        struct aggregate *a = &ifp->aggregates[i];
+        if(!in_prefix(a->prefix, prefix, plen))
+            break;
+        if(!a->withdrawn)
+            return a;
+    }
+    return NULL;
+}
+
+struct aggregate *
+announce_aggregate(struct interface *ifp, const struct aggregate *agg)
+{
+    struct aggregate *a;
+    struct source *src, *old = NULL;
+    int i;
+
+    src = find_source(agg->id, agg->prefix, agg->plen, zeroes, 0,
+                      1, agg->seqno);
+    if(src == NULL)
+        return NULL;
+
+    i = aggregate_position(ifp, agg->prefix, agg->plen);
+    if(i >= ifp->numaggregates ||
+       aggregate_compare(&ifp->aggregates[i], agg->prefix, agg->plen) != 0) {
+        if(ifp->numaggregates >= ifp->maxaggregates) {
+            struct aggregate *new_aggregates;
+            int n = ifp->maxaggregates < 1 ? 8 : 2 * ifp->maxaggregates;
+            new_aggregates = realloc(ifp->aggregates,
+                                     n * sizeof(struct aggregate));
+            if(new_aggregates == NULL) {
+                perror("realloc(aggregates)");
+                return NULL;
+            }
+            ifp->aggregates = new_aggregates;
+            ifp->maxaggregates = n;
+        }
+        if(i < ifp->numaggregates)
+            memmove(ifp->aggregates + i + 1, ifp->aggregates + i,
+                    (ifp->numaggregates - i) * sizeof(struct aggregate));
+        ifp->numaggregates++;
+    } else {
+        old = ifp->aggregates[i].src;
+    }
+    a = &ifp->aggregates[i];
+    *a = *agg;
+    a->withdrawn = 0;
+    a->src = retain_source(src);
+    if(old)
+        release_source(old);
+    return a;
+}
+
+void
+flush_announced_aggregate(struct interface *ifp, struct aggregate *agg)
+{
+    int i = agg - ifp->aggregates;
+
+    if(i < 0 || i >= ifp->numaggregates) {
+        fprintf(stderr, "Internal error: flushing unknown aggregate.\n");
+        return;
+    }
+
+    if(agg->src)
+        release_source(agg->src);
+    if(i < ifp->numaggregates - 1)
+        memmove(agg, agg + 1,
+                (ifp->numaggregates - i - 1) * sizeof(struct aggregate));
+    ifp->numaggregates--;
+    VALGRIND_MAKE_MEM_UNDEFINED(ifp->aggregates + ifp->numaggregates,
+                                sizeof(struct aggregate));
+}
+
+void
+flush_announced_aggregates(struct interface *ifp)
+{
+    int i;
+
+    for(i = 0; i < ifp->numaggregates; i++) {
+        if(ifp->aggregates[i].src)
+            release_source(ifp->aggregates[i].src);
+    }
+    free(ifp->aggregates);
+    ifp->aggregates = NULL;
+    ifp->numaggregates = ifp->maxaggregates = 0;
+}
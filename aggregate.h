@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2026 by the rabeld contributors.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+#ifndef _BABEL_AGGREGATE
+#define _BABEL_AGGREGATE
+
+/* An aggregate is a prefix exactly tiled by routes that share a router-id,
+   a seqno and a next hop (a neighbour, or ourselves for xroutes).  It
+   covers no address that its components don't, so announcing it in their
+   stead can never create a blackhole. */
+
+struct source;
+
+struct aggregate {
+    unsigned char prefix[16];
+    unsigned char id[8];
+    unsigned char plen;
+    unsigned char withdrawn;
+    unsigned short seqno;
+    unsigned short metric;
+    struct neighbour *neigh;    /* NULL for our own routes */
+    unsigned int stamp;
+    /* Held while announced, so that we keep a feasibility distance for
+       the aggregate like for any route we announce. */
+    struct source *src;
+};
+
+int find_aggregate(const unsigned char *prefix, unsigned char plen,
+                   struct aggregate *agg);
+int aggregate_components(const unsigned char *prefix, unsigned char plen,
+                         int (*f)(const unsigned char *, unsigned char,
+                                  void *),
+                         void *closure);
+int aggregate_component(const unsigned char *prefix, unsigned char plen,
+                        unsigned char *prefix_return,
+                        unsigned char *plen_return);
+int aggregate_hides(const struct aggregate *agg,
+                    const unsigned char *prefix, unsigned char plen);
+int interface_aggregates(struct interface *ifp);
+struct aggregate *find_announced_aggregate(struct interface *ifp,
+                                           const unsigned char *prefix,
+                                           unsigned char plen, int exact);
+struct aggregate *
+find_announced_aggregate_within(struct interface *ifp,
+                                const unsigned char *prefix,
+                                unsigned char plen);
+struct aggregate *announce_aggregate(struct interface *ifp,
+                                     const struct aggregate *agg);
+void flush_announced_aggregate(struct interface *ifp, struct aggregate *agg);
+void flush_announced_aggregates(struct interface *ifp);
+#endif
@@ -44,6 +44,7 @@ THE SOFTWARE.
 #include "util.h"
 #include "net.h"
 #include "kernel.h"
+#include "netlink_trace.h"
 #include "interface.h"
 #include "source.h"
 #include "neighbour.h"
@@ -54,6 +55,7 @@ THE SOFTWARE.
 #include "configuration.h"
 #include "local.h"
 #include "rule.h"
+#include "disambiguation.h"
 #include "version.h"
 
 struct timeval now;
@@ -65,6 +67,7 @@ int debug = 0;
 int link_detect = 0;
 int all_wireless = 0;
 int has_ipv6_subtrees = 0;
+int has_kernel_nexthops = 0;
 int default_wireless_hello_interval = -1;
 int default_wired_hello_interval = -1;
 int resend_delay = -1;
@@ -98,6 +101,7 @@ static int kernel_addr_changed = 0;
 struct timeval check_neighbours_timeout, check_interfaces_timeout;
 
 static volatile sig_atomic_t exiting = 0, dumping = 0, reopening = 0;
+static volatile sig_atomic_t reloading = 0;
 
 static int accept_local_connections(void);
 static void init_signals(void);
@@ -136,6 +140,10 @@ kernel_link_notify(struct kernel_link *link, void *closure)
     struct interface *ifp;
     FOR_ALL_INTERFACES(ifp) {
         if(strcmp(ifp->name, link->ifname) == 0) {
+            /* Fail over before check_interfaces flushes the routes. */
+            if(!link->up && if_up(ifp) && ifp->ifindex == link->ifindex &&
+               has_kernel_nexthops)
+                kernel_failover_nexthop(NULL, ifp->ifindex);
             kernel_link_changed = 1;
             return -1;
         }
@@ -146,19 +154,66 @@ kernel_link_notify(struct kernel_link *link, void *closure)
 static int
 kernel_rule_notify(struct kernel_rule *rule, void *closure)
 {
-    int i;
     if(martian_prefix(rule->src, rule->src_plen))
         return 0;
 
-    i = rule->priority - src_table_prio;
-
-    if(i < 0 || SRC_TABLE_NUM <= i)
+    if(!own_rule_priority(rule->priority))
         return 0;
 
     kernel_rules_changed = 1;
     return -1;
 }
 
+/* The kernel refused a route that we had queued, so it is not in the FIB.
+   Stop pretending it is installed; the next update will reinstall it.
+   A request for a conflict zone is not for any installed route. */
+static int
+kernel_route_failed(struct kernel_route_error *err, void *closure)
+{
+    struct babel_route *route;
+
+    if(err->operation == ROUTE_FLUSH ||
+       (err->operation == ROUTE_ADD && err->error == EEXIST))
+        return 0;
+
+    route = find_installed_route(err->route.prefix, err->route.plen,
+                                 err->route.src_prefix, err->route.src_plen);
+    if(route == NULL)
+        kzone_failed(&err->route);
+    else if(v6_equal(route->nexthop, err->route.gw) &&
+            route->neigh->ifp->ifindex == err->route.ifindex)
+        forget_installed_route(route);
+    return 0;
+}
+
+/* Whether a route of ours that kernel_check_fib found in table is one
+   that we have installed, for a destination or a conflict zone.  Our
+   source tables hold routes without a source prefix. */
+static int
+kernel_route_wanted(int table, struct kernel_route *route, void *closure)
+{
+    unsigned char src_prefix[16];
+    unsigned char src_plen;
+
+    if(route->src_plen > 0) {
+        memcpy(src_prefix, route->src_prefix, 16);
+        src_plen = route->src_plen;
+    } else if(!table_source(table, src_prefix, &src_plen)) {
+        memset(src_prefix, 0, 16);
+        src_plen = 0;
+    }
+
+    return find_installed_route(route->prefix, route->plen,
+                                src_prefix, src_plen) != NULL ||
+        kzone_installed(route->prefix, route->plen, src_prefix, src_plen);
+}
+
+static void
+kernel_reinstall_routes(void *closure)
+{
+    kreinstall_routes();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -167,9 +222,9 @@ main(int argc, char **argv)
     time_t expiry_time, source_expiry_time, kernel_dump_time;
     const char **config_files = NULL;
     int num_config_files = 0;
-    void *vrc;
     unsigned int seed;
     struct interface *ifp;
+    struct neighbour *neigh;
 
 //#ifdef HAVE_NEON
 //    n_ones = vld1_u32(const unsigned int *) ones;
@@ -191,6 +246,7 @@ main(int argc, char **argv)
     protocol_port = 6696;
     change_smoothing_half_life(4);
     has_ipv6_subtrees = kernel_has_ipv6_subtrees();
+    has_kernel_nexthops = kernel_has_nexthops();
 
     while(1) {
         opt = getopt(argc, argv,
@@ -451,6 +507,8 @@ main(int argc, char **argv)
         fprintf(stderr, "kernel_setup failed.\n");
         goto fail_pid;
     }
+    kernel_route_callback(kernel_route_failed, NULL);
+    kernel_fib_callback(kernel_route_wanted, kernel_reinstall_routes, NULL);
 
     rc = kernel_setup_socket(1);
     if(rc < 0) {
@@ -466,9 +524,10 @@ main(int argc, char **argv)
     }
 
     for(i = optind; i < argc; i++) {
-        vrc = add_interface(argv[i], NULL);
-        if(vrc == NULL)
+        ifp = add_interface(argv[i], NULL);
+        if(ifp == NULL)
             goto fail;
+        ifp->flags |= IF_CMDLINE;
     }
 
     if(interfaces == NULL) {
@@ -616,7 +675,10 @@ main(int argc, char **argv)
     majortimeout = 0;
     while(1) {
         struct timeval tv;
-        fd_set readfds;
+        fd_set readfds, writefds;
+
+        /* Program the route changes of the last iteration in one go. */
+        kernel_flush_routes();
 
         gettime(&now);
 	alarm(2);
@@ -634,8 +696,14 @@ main(int argc, char **argv)
             timeval_min(&tv, &ifp->update_timeout);
             timeval_min(&tv, &ifp->update_flush_timeout);
         }
+        FOR_ALL_NEIGHBOURS(neigh) {
+            if(neigh->unicast_hello && if_up(neigh->ifp))
+                timeval_min(&tv, &neigh->unicast_hello_timeout);
+        }
         timeval_min(&tv, &unicast_flush_timeout);
+        timeval_min(&tv, &local_batch_timeout);
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
         if(timeval_compare(&tv, &now) > 0) {
             int maxfd = 0;
             timeval_minus(&tv, &tv, &now);
@@ -653,15 +721,18 @@ main(int argc, char **argv)
             }
             for(i = 0; i < num_local_sockets; i++) {
                 FD_SET(local_sockets[i].fd, &readfds);
+                if(local_sockets[i].outlen > 0 || local_sockets[i].resync)
+                    FD_SET(local_sockets[i].fd, &writefds);
                 maxfd = MAX(maxfd, local_sockets[i].fd);
             }
 	    check_major_timeout(2,"Timeout processing setup");
 	    alarm(0);
-interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+interrupted: rc = select(maxfd + 1, &readfds, &writefds, NULL, &tv);
             if(rc < 0) {
                 if(errno == EINTR) goto interrupted;
                 rc = 0;
                 FD_ZERO(&readfds);
+                FD_ZERO(&writefds);
             }
         }
 
@@ -677,7 +748,18 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
             filter.addr = kernel_addr_notify;
             filter.link = kernel_link_notify;
             filter.rule = kernel_rule_notify;
-            kernel_callback(&filter);
+            rc = kernel_callback(&filter);
+            if(rc > 0) {
+                /* The kernel dropped notifications, resynchronise. */
+                if(rc & CHANGE_LINK)
+                    kernel_link_changed = 1;
+                if(rc & CHANGE_ROUTE)
+                    kernel_routes_changed = 1;
+                if(rc & CHANGE_ADDR)
+                    kernel_addr_changed = 1;
+                if(rc & CHANGE_RULE)
+                    kernel_rules_changed = 1;
+            }
         }
 
         if(FD_ISSET(protocol_socket, &readfds)) {
@@ -709,6 +791,14 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
 
         i = 0;
         while(i < num_local_sockets) {
+            if(FD_ISSET(local_sockets[i].fd, &writefds)) {
+                rc = local_flush(&local_sockets[i]);
+                if(rc < 0) {
+                    perror("write(local_socket)");
+                    local_socket_destroy(i);
+                    continue;
+                }
+            }
             if(FD_ISSET(local_sockets[i].fd, &readfds)) {
                 rc = local_read(&local_sockets[i]);
                 if(rc <= 0) {
@@ -735,6 +825,13 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
             reopening = 0;
         }
 
+        if(reloading) {
+            rc = reload_config();
+            if(rc < 0)
+                fprintf(stderr, "Warning: couldn't reload configuration.\n");
+            reloading = 0;
+        }
+
         if(kernel_link_changed || kernel_addr_changed) {
             check_interfaces();
             kernel_link_changed = 0;
@@ -743,6 +840,7 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
 	
         if(kernel_routes_changed || kernel_addr_changed ||
            kernel_rules_changed || now.tv_sec >= kernel_dump_time) {
+            trace_timer(TRACE_TIMER_KERNEL_DUMP, 0);
             rc = check_xroutes(1);
             if(rc < 0)
                 fprintf(stderr, "Warning: couldn't check exported routes.\n");
@@ -762,13 +860,19 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
 
         if(timeval_compare(&check_neighbours_timeout, &now) < 0) {
             int msecs;
+            trace_timer(TRACE_TIMER_NEIGHBOURS, 0);
             msecs = check_neighbours();
             /* Multiply by 3/2 to allow neighbours to expire. */
             msecs = MAX(3 * msecs / 2, 10);
             schedule_neighbours_check(msecs, 1);
         }
 
+        if(local_batch_timeout.tv_sec != 0 &&
+           timeval_compare(&local_batch_timeout, &now) <= 0)
+            local_notify_batch();
+
         if(timeval_compare(&check_interfaces_timeout, &now) < 0) {
+            trace_timer(TRACE_TIMER_INTERFACES, 0);
             check_interfaces();
             schedule_interfaces_check(30000, 1);
         }
@@ -777,6 +881,7 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
             "Timeout: Interface checking took too long");
 
         if(now.tv_sec >= expiry_time) {
+            trace_timer(TRACE_TIMER_EXPIRY, 0);
             expire_routes();
             expire_resend();
             expiry_time = now.tv_sec + roughly(30);
@@ -786,6 +891,7 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
             "Timeout: Route expiry/resend took too long");
 
         if(now.tv_sec >= source_expiry_time) {
+            trace_timer(TRACE_TIMER_SOURCES, 0);
             expire_sources();
             source_expiry_time = now.tv_sec + roughly(300);
         }
@@ -793,19 +899,34 @@ interrupted: rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
                 continue;
-            if(timeval_compare(&now, &ifp->hello_timeout) >= 0)
+            if(timeval_compare(&now, &ifp->hello_timeout) >= 0) {
+                trace_timer(TRACE_TIMER_HELLO, ifp->ifindex);
                 send_hello(ifp);
-            if(timeval_compare(&now, &ifp->update_timeout) >= 0)
+            }
+            if(timeval_compare(&now, &ifp->update_timeout) >= 0) {
+                trace_timer(TRACE_TIMER_UPDATE, ifp->ifindex);
                 send_update(ifp, 0, NULL, 0, NULL, 0);
-            if(timeval_compare(&now, &ifp->update_flush_timeout) >= 0)
+            }
+            if(timeval_compare(&now, &ifp->update_flush_timeout) >= 0) {
+                trace_timer(TRACE_TIMER_FLUSH, ifp->ifindex);
                 flushupdates(ifp);
+            }
+        }
+        FOR_ALL_NEIGHBOURS(neigh) {
+            if(neigh->unicast_hello && if_up(neigh->ifp) &&
+               timeval_compare(&now, &neigh->unicast_hello_timeout) >= 0) {
+                trace_timer(TRACE_TIMER_UNICAST_HELLO, neigh->ifp->ifindex);
+                send_unicast_hello(neigh);
+            }
         }
 	check_major_timeout(2,
             "Timeout: send_hello send_update, flushupdates took too long");
 
         if(resend_time.tv_sec != 0) {
-            if(timeval_compare(&now, &resend_time) >= 0)
+            if(timeval_compare(&now, &resend_time) >= 0) {
+                trace_timer(TRACE_TIMER_RESEND, 0);
                 do_resend();
+            }
         }
 
 	check_major_timeout(2,
@@ -1042,6 +1163,12 @@ sigreopening(int signo)
     reopening = 1;
 }
 
+static void
+sigreload(int signo)
+{
+    reloading = 1;
+}
+
 static void
 sigalarm(int signo)
 {
@@ -1061,7 +1188,7 @@ init_signals(void)
     sigaction(SIGTERM, &sa, NULL);
 
     sigemptyset(&ss);
-    sa.sa_handler = sigexit;
+    sa.sa_handler = sigreload;
     sa.sa_mask = ss;
     sa.sa_flags = 0;
     sigaction(SIGHUP, &sa, NULL);
@@ -1205,6 +1332,8 @@ dump_tables(FILE *out)
         route_stream_done(routes);
     }
 
+    kernel_print_stats(out);
+
     fflush(out);
 }
 
@@ -96,6 +96,7 @@ extern const char *logfile, *pidfile, *state_file;
 extern int link_detect;
 extern int all_wireless;
 extern int has_ipv6_subtrees;
+extern int has_kernel_nexthops;
 extern volatile sig_atomic_t majortimeout;
 extern unsigned char myid[8];
 extern int have_id;
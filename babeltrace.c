@@ -0,0 +1,245 @@
+/*
+Copyright (c) 2026 by the rabeld contributors.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Decode the trace written by babeld into a shell script of ip route
+   commands, with packets and timers as comments.  Interface indices are
+   resolved on the machine that decodes the trace. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#define TRACE_DECODER
+#include "netlink_trace.h"
+
+/* From kernel.h. */
+#define ROUTE_FLUSH 0
+#define ROUTE_ADD 1
+#define ROUTE_MODIFY 2
+
+static const unsigned char v4prefix[12] =
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+static int
+v4mapped(const unsigned char *address)
+{
+    return memcmp(address, v4prefix, 12) == 0;
+}
+
+static const char *
+format_address(const unsigned char *address)
+{
+    static char buf[4][INET6_ADDRSTRLEN];
+    static int i = 0;
+    i = (i + 1) % 4;
+    if(v4mapped(address))
+        inet_ntop(AF_INET, address + 12, buf[i], INET6_ADDRSTRLEN);
+    else
+        inet_ntop(AF_INET6, address, buf[i], INET6_ADDRSTRLEN);
+    return buf[i];
+}
+
+static const char *
+format_prefix(const unsigned char *prefix, int plen)
+{
+    static char buf[4][INET6_ADDRSTRLEN + 4];
+    static int i = 0;
+    i = (i + 1) % 4;
+    snprintf(buf[i], sizeof(buf[i]), "%s/%d", format_address(prefix),
+             v4mapped(prefix) ? plen - 96 : plen);
+    return buf[i];
+}
+
+static const char *
+format_ifindex(int ifindex)
+{
+    static char buf[2][IF_NAMESIZE + 8];
+    static int i = 0;
+    i = (i + 1) % 2;
+    if(if_indextoname(ifindex, buf[i]) == NULL)
+        snprintf(buf[i], sizeof(buf[i]), "if%d", ifindex);
+    return buf[i];
+}
+
+static const char *
+timer_name(int kind)
+{
+    switch(kind) {
+    case TRACE_TIMER_NEIGHBOURS: return "neighbours";
+    case TRACE_TIMER_INTERFACES: return "interfaces";
+    case TRACE_TIMER_EXPIRY: return "expiry";
+    case TRACE_TIMER_SOURCES: return "sources";
+    case TRACE_TIMER_HELLO: return "hello";
+    case TRACE_TIMER_UPDATE: return "update";
+    case TRACE_TIMER_FLUSH: return "flush";
+    case TRACE_TIMER_UNICAST_HELLO: return "unicast-hello";
+    case TRACE_TIMER_RESEND: return "resend";
+    case TRACE_TIMER_KERNEL_DUMP: return "kernel-dump";
+    default: return "???";
+    }
+}
+
+static void
+print_route(const struct trace_record *record)
+{
+    int ipv4 = v4mapped(record->u.route.dest);
+
+    /* Both ADD and MODIFY are sent with NLM_F_REPLACE. */
+    printf("ip %s route %s %s%s",
+           ipv4 ? "-4" : "-6",
+           record->op == ROUTE_FLUSH ? "del" : "replace",
+           record->u.route.unreachable ? "unreachable " : "",
+           format_prefix(record->u.route.dest, record->plen));
+    if(record->src_plen > 0 && !ipv4)
+        printf(" from %s",
+               format_prefix(record->u.route.src, record->src_plen));
+    printf(" table %d metric %d proto babel",
+           record->u.route.table, record->u.route.priority);
+    if(!record->u.route.unreachable && record->op != ROUTE_FLUSH)
+        printf(" via %s dev %s",
+               format_address(record->u.route.gate),
+               format_ifindex(record->u.route.ifindex));
+    printf(" # %u.%06u", record->sec, record->usec);
+    if(record->u.route.seqno != 0)
+        printf(" seq %u", record->u.route.seqno);
+    printf("\n");
+}
+
+static void
+print_record(const struct trace_record *record)
+{
+    switch(record->type) {
+    case TRACE_ROUTE:
+        print_route(record);
+        break;
+    case TRACE_ROUTE_STATUS:
+        /* An elided request has no seqno, and follows its route. */
+        if(record->u.status.rc == 1) {
+            printf("#  unchanged\n");
+            break;
+        }
+        printf("# %u.%06u seq %u ", record->sec, record->usec,
+               record->u.status.seqno);
+        if(record->u.status.rc < 0)
+            printf("failed: %s\n", strerror(record->u.status.error));
+        else if(record->u.status.rc == 2)
+            printf("unknown, ACK lost\n");
+        else
+            printf("ok\n");
+        break;
+    case TRACE_PACKET_IN:
+    case TRACE_PACKET_OUT:
+        printf("# %u.%06u packet %s %s %s dev %s len %d\n",
+               record->sec, record->usec,
+               record->type == TRACE_PACKET_IN ? "in" : "out",
+               record->type == TRACE_PACKET_IN ? "from" : "to",
+               format_address(record->u.packet.address),
+               format_ifindex(record->u.packet.ifindex),
+               record->u.packet.len);
+        break;
+    case TRACE_TIMER:
+        printf("# %u.%06u timer %s", record->sec, record->usec,
+               timer_name(record->op));
+        if(record->u.timer.ifindex > 0)
+            printf(" dev %s", format_ifindex(record->u.timer.ifindex));
+        printf("\n");
+        break;
+    default:
+        printf("# unknown record type %d\n", record->type);
+        break;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct trace_header *ring;
+    const struct trace_record *records;
+    struct trace_record *copy;
+    struct stat st;
+    uint64_t head, first, i;
+    uint32_t n;
+    int fd;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: babeltrace file\n");
+        exit(1);
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        exit(1);
+    }
+
+    if(st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: truncated trace.\n", argv[1]);
+        exit(1);
+    }
+
+    ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(ring == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    n = ring->records;
+    if(memcmp(ring->magic, TRACE_MAGIC, sizeof(ring->magic)) != 0 ||
+       ring->record_size != sizeof(struct trace_record) ||
+       n == 0 || (n & (n - 1)) != 0 ||
+       st.st_size < sizeof(struct trace_header) +
+       (off_t)n * sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a babeld trace.\n", argv[1]);
+        exit(1);
+    }
+    records = (const struct trace_record*)(ring + 1);
+
+    copy = malloc(n * sizeof(struct trace_record));
+    if(copy == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* babeld may still be writing: copy the ring, then drop the records
+       that were overwritten while we were copying. */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    memcpy(copy, records, n * sizeof(struct trace_record));
+    /* The slot after the last record may be half written. */
+    first = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+    first = first > n ? first - n : 0;
+
+    if(first > 0)
+        printf("# %llu earlier records overwritten\n",
+               (unsigned long long)first);
+    for(i = first; i < head; i++)
+        print_record(&copy[i & (n - 1)]);
+
+    return 0;
+}
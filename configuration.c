@@ -23,6 +23,7 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <signal.h>
@@ -36,10 +37,16 @@ THE SOFTWARE.
 #include "babeld.h"
 #include "util.h"
 #include "interface.h"
+#include "source.h"
+#include "neighbour.h"
 #include "route.h"
 #include "kernel.h"
+#include "xroute.h"
+#include "message.h"
 #include "configuration.h"
 #include "rule.h"
+#include "local.h"
+#include "netlink_trace.h"
 
 struct filter *input_filters = NULL;
 struct filter *output_filters = NULL;
@@ -53,6 +60,19 @@ struct interface_conf *interface_confs = NULL;
 
 int config_finalised = 0;
 
+/* Set while reload_config parses the configuration files and the -C
+   statements again, which were remembered the first time round. */
+static int config_reloading = 0;
+static char **config_files = NULL;
+static int num_config_files = 0;
+static char **config_strings = NULL;
+static int num_config_strings = 0;
+
+/* The options with side effects are only applied once a reload has
+   parsed successfully; -1 means not given. */
+static int reload_trace = -1;
+static int reload_half_life = -1;
+
 /* This file implements a recursive descent parser with one character
    lookahead.  The looked-ahead character is returned from most
    functions.
@@ -322,6 +342,86 @@ get_interface_type(int c, int *type_r, gnc_t gnc, void *closure)
     return c;
 }
 
+static int
+get_overflow_policy(int c, int *policy_r, gnc_t gnc, void *closure)
+{
+    char *t;
+    int i;
+    c = getword(c, &t, gnc, closure);
+    if(c < -1)
+        return c;
+    if(strcmp(t, "drop") == 0) {
+        i = LOCAL_OVERFLOW_DROP;
+    } else if(strcmp(t, "resync") == 0) {
+        i = LOCAL_OVERFLOW_RESYNC;
+    } else if(strcmp(t, "disconnect") == 0) {
+        i = LOCAL_OVERFLOW_DISCONNECT;
+    } else {
+        free(t);
+        return -2;
+    }
+    free(t);
+    *policy_r = i;
+    return c;
+}
+
+/* monitor [interface] [neighbour] [xroute] [route] [prefix p]... [if name] */
+static int
+parse_monitor(int c, gnc_t gnc, void *closure, struct local_filter *filter)
+{
+    char *token;
+
+    free(filter->ifname);
+    memset(filter, 0, sizeof(*filter));
+
+    while(1) {
+        c = skip_whitespace(c, gnc, closure);
+        if(c < 0 || c == '\n' || c == '#')
+            break;
+        c = getword(c, &token, gnc, closure);
+        if(c < -1)
+            return -2;
+
+        if(strcmp(token, "interface") == 0) {
+            filter->types |= 1 << EVENT_INTERFACE;
+        } else if(strcmp(token, "neighbour") == 0) {
+            filter->types |= 1 << EVENT_NEIGHBOUR;
+        } else if(strcmp(token, "xroute") == 0) {
+            filter->types |= 1 << EVENT_XROUTE;
+        } else if(strcmp(token, "route") == 0) {
+            filter->types |= 1 << EVENT_ROUTE;
+        } else if(strcmp(token, "prefix") == 0) {
+            unsigned char *prefix = NULL, plen;
+            int af;
+            if(filter->numprefixes >= LOCAL_MAX_PREFIXES)
+                goto error;
+            c = getnet(c, &prefix, &plen, &af, gnc, closure);
+            if(c < -1)
+                goto error;
+            memcpy(filter->prefixes[filter->numprefixes], prefix, 16);
+            filter->plens[filter->numprefixes] = plen;
+            filter->numprefixes++;
+            free(prefix);
+        } else if(strcmp(token, "if") == 0) {
+            char *interface;
+            c = getstring(c, &interface, gnc, closure);
+            if(c < -1)
+                goto error;
+            free(filter->ifname);
+            filter->ifname = interface;
+        } else {
+            goto error;
+        }
+        free(token);
+    }
+    return c;
+
+ error:
+    free(token);
+    free(filter->ifname);
+    memset(filter, 0, sizeof(*filter));
+    return -2;
+}
 
 static int
 parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
@@ -547,6 +647,31 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
             if(c < -1)
                 goto error;
             if_conf->faraway = v;
+        } else if(strcmp(token, "fast-failure") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->fast_failure = v;
+        } else if(strcmp(token, "unicast-hello") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->unicast_hello = v;
+        } else if(strcmp(token, "aggregate") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->aggregate = v;
+        } else if(strcmp(token, "unicast-threshold") == 0) {
+            int threshold;
+            c = getint(c, &threshold, gnc, closure);
+            if(c < -1 || threshold < 0 || threshold > 0xFFFF)
+                goto error;
+            /* 0 means "never", which is different from unset. */
+            if_conf->unicast_threshold = threshold > 0 ? threshold : -1;
         } else if(strcmp(token, "link-quality") == 0) {
             int v;
             c = getbool(c, &v, gnc, closure);
@@ -653,9 +778,12 @@ parse_ifconf(int c, gnc_t gnc, void *closure,
     return -2;
 }
 
+static void filters_changed(void);
+
 static void
 add_filter(struct filter *filter, struct filter **filters)
 {
+    filters_changed();
     if(*filters == NULL) {
         filter->next = NULL;
         *filters = filter;
@@ -690,6 +818,10 @@ merge_ifconf(struct interface_conf *dest,
     MERGE(split_horizon);
     MERGE(lq);
     MERGE(faraway);
+    MERGE(fast_failure);
+    MERGE(unicast_hello);
+    MERGE(aggregate);
+    MERGE(unicast_threshold);
     MERGE(channel);
     MERGE(enable_timestamps);
     MERGE(rtt_decay);
@@ -725,29 +857,37 @@ add_ifconf(struct interface_conf *if_conf, struct interface_conf **if_confs)
     }
 
  done:
-    if(config_finalised)
+    if(config_finalised && !config_reloading)
         add_interface(if_conf->ifname, if_conf);
 }
 
+static void
+free_ifconf(struct interface_conf *if_conf)
+{
+    free(if_conf->ifname);
+    free(if_conf);
+}
+
 void
 flush_ifconf(struct interface_conf *if_conf)
 {
     if(if_conf == interface_confs) {
         interface_confs = if_conf->next;
-        free(if_conf);
+        free_ifconf(if_conf);
         return;
     } else {
         struct interface_conf *prev = interface_confs;
         while(prev) {
             if(prev->next == if_conf) {
                 prev->next = if_conf->next;
-                free(if_conf);
+                free_ifconf(if_conf);
                 return;
             }
             prev = prev->next;
         }
     }
-    fprintf(stderr, "Warning: attempting to free nonexistent ifconf.\n");
+    /* finalise_config hands the configuration over to the interface. */
+    free_ifconf(if_conf);
 }
 
 static int
@@ -755,15 +895,23 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
 {
     /* These are the only options that are allowed at runtime, either
        because they require no special setup or because there is special
-       case code for them. */
+       case code for them.  The others are ignored when reloading. */
     if(config_finalised) {
         if(strcmp(token, "keep-unfeasible") != 0 &&
            strcmp(token, "link-detect") != 0 &&
            strcmp(token, "log-file") != 0 &&
+           strcmp(token, "trace") != 0 &&
+           strcmp(token, "trace-file") != 0 &&
            strcmp(token, "diversity") != 0 &&
            strcmp(token, "diversity-factor") != 0 &&
-           strcmp(token, "smoothing-half-life") != 0)
+           strcmp(token, "local-overflow") != 0 &&
+           strcmp(token, "local-buffer-size") != 0 &&
+           strcmp(token, "monitor-batch-interval") != 0 &&
+           strcmp(token, "smoothing-half-life") != 0) {
+            if(config_reloading)
+                return skip_to_eol(c, gnc, closure);
             goto error;
+        }
     }
 
     if(strcmp(token, "protocol-port") == 0 ||
@@ -806,6 +954,10 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
               strcmp(token, "daemonise") == 0 ||
               strcmp(token, "skip-kernel-setup") == 0 ||
               strcmp(token, "ipv6-subtrees") == 0 ||
+              strcmp(token, "kernel-nexthops") == 0 ||
+              strcmp(token, "fast-reroute") == 0 ||
+              strcmp(token, "kernel-expiry") == 0 ||
+              strcmp(token, "trace") == 0 ||
               strcmp(token, "reflect-kernel-metric") == 0) {
         int b;
         c = getbool(c, &b, gnc, closure);
@@ -824,7 +976,20 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
             skip_kernel_setup = b;
         else if(strcmp(token, "ipv6-subtrees") == 0)
             has_ipv6_subtrees = b;
-        else if(strcmp(token, "reflect-kernel-metric") == 0)
+        else if(strcmp(token, "kernel-nexthops") == 0)
+            has_kernel_nexthops = b;
+        else if(strcmp(token, "fast-reroute") == 0)
+            fast_reroute = b;
+        else if(strcmp(token, "kernel-expiry") == 0)
+            kernel_expiry = b;
+        else if(strcmp(token, "trace") == 0) {
+            if(config_reloading)
+                reload_trace = b;
+            else if(!b)
+                trace_stop();
+            else if(!trace_running() && trace_start(trace_file) < 0)
+                perror("trace_start");
+        } else if(strcmp(token, "reflect-kernel-metric") == 0)
             reflect_kernel_metric = b;
         else
             abort();
@@ -838,6 +1003,7 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
     } else if(strcmp(token, "state-file") == 0 ||
               strcmp(token, "log-file") == 0 ||
               strcmp(token, "pid-file") == 0 ||
+              strcmp(token, "trace-file") == 0 ||
               strcmp(token, "local-path") == 0 ||
               strcmp(token, "local-path-readwrite") == 0) {
         char *file;
@@ -848,10 +1014,17 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
             state_file = file;
         else if(strcmp(token, "log-file") == 0) {
             logfile = file;
-            if(config_finalised)
+            if(config_finalised && !config_reloading)
                 reopen_logfile();
         } else if(strcmp(token, "pid-file") == 0)
             pidfile = file;
+        else if(strcmp(token, "trace-file") == 0) {
+            int changed = strcmp(file, trace_file) != 0;
+            trace_file = file;
+            if(changed && !config_reloading && trace_running() &&
+               trace_start(trace_file) < 0)
+                perror("trace_start");
+        }
         else if(strcmp(token, "local-path") == 0) {
             local_server_port = -1;
             free(local_server_path);
@@ -891,24 +1064,65 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         if(c < -1 || f < 0 || f > 256)
             goto error;
         diversity_factor = f;
+    } else if(strcmp(token, "multipath") == 0) {
+        int n;
+        c = getint(c, &n, gnc, closure);
+        if(c < -1 || n < 1 || n > KERNEL_MAX_MULTIPATH)
+            goto error;
+        multipath_max = n;
+    } else if(strcmp(token, "multipath-tolerance") == 0) {
+        int t;
+        c = getint(c, &t, gnc, closure);
+        if(c < -1 || t < 0 || t > 100)
+            goto error;
+        multipath_tolerance = t;
     } else if(strcmp(token, "smoothing-half-life") == 0) {
         int h;
         c = getint(c, &h, gnc, closure);
         if(c < -1 || h < 0)
             goto error;
-        change_smoothing_half_life(h);
+        if(config_reloading)
+            reload_half_life = h;
+        else
+            change_smoothing_half_life(h);
     } else if(strcmp(token, "first-table-number") == 0) {
         int n;
         c = getint(c, &n, gnc, closure);
-        if(c < -1 || n <= 0 || n + SRC_TABLE_NUM >= 254)
+        if(c < -1 || n <= 0 || n + src_table_num >= 254)
             goto error;
         src_table_idx = n;
     } else if(strcmp(token, "first-rule-priority") == 0) {
         int n;
         c = getint(c, &n, gnc, closure);
-        if(c < -1 || n <= 0 || n + SRC_TABLE_NUM >= 32765)
+        if(c < -1 || n <= 0 ||
+           n + src_table_num * RULE_PRIORITY_GAP >= 32765)
             goto error;
         src_table_prio = n;
+    } else if(strcmp(token, "source-table-count") == 0) {
+        int n;
+        c = getint(c, &n, gnc, closure);
+        if(c < -1 || n <= 0 || src_table_idx + n >= 254 ||
+           src_table_prio + n * RULE_PRIORITY_GAP >= 32765)
+            goto error;
+        src_table_num = n;
+    } else if(strcmp(token, "local-overflow") == 0) {
+        int p;
+        c = get_overflow_policy(c, &p, gnc, closure);
+        if(c < -1)
+            goto error;
+        local_overflow = p;
+    } else if(strcmp(token, "local-buffer-size") == 0) {
+        int n;
+        c = getint(c, &n, gnc, closure);
+        if(c < -1 || n < 4096)
+            goto error;
+        local_buffer_size = n;
+    } else if(strcmp(token, "monitor-batch-interval") == 0) {
+        int interval;
+        c = getthousands(c, &interval, gnc, closure);
+        if(c < -1 || interval < 0)
+            goto error;
+        local_batch_interval = interval;
     } else if(strcmp(token, "router-id") == 0) {
         unsigned char *id = NULL;
         c = getid(c, &id, gnc, closure);
@@ -998,6 +1212,9 @@ parse_config_line(int c, gnc_t gnc, void *closure,
             goto fail;
         *action_return = CONFIG_ACTION_DUMP;
     } else if(strcmp(token, "monitor") == 0) {
+        c = parse_monitor(c, gnc, closure, &local_monitor_request);
+        if(c < -1)
+            goto fail;
         c = skip_eol(c, gnc, closure);
         if(c < -1 || !action_return)
             goto fail;
@@ -1007,7 +1224,12 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         if(c < -1 || !action_return)
             goto fail;
         *action_return = CONFIG_ACTION_UNMONITOR;
-    } else if(config_finalised && !local_server_write) {
+    } else if(strcmp(token, "binary") == 0) {
+        c = skip_eol(c, gnc, closure);
+        if(c < -1 || !action_return)
+            goto fail;
+        *action_return = CONFIG_ACTION_BINARY;
+    } else if(config_finalised && !config_reloading && !local_server_write) {
         /* The remaining directives are only allowed in read-write mode. */
         c = skip_to_eol(c, gnc, closure);
         if(c < -1 || !action_return)
@@ -1017,7 +1239,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         goto fail;
     } else if(strcmp(token, "in") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -1025,7 +1247,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &input_filters);
     } else if(strcmp(token, "out") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -1033,7 +1255,7 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &output_filters);
     } else if(strcmp(token, "redistribute") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
@@ -1041,11 +1263,12 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         add_filter(filter, &redistribute_filters);
     } else if(strcmp(token, "install") == 0) {
         struct filter *filter;
-        if(config_finalised)
+        if(config_finalised && !config_reloading)
             goto fail;
         c = parse_filter(c, gnc, closure, &filter);
         if(c < -1)
             goto fail;
+        add_filter(filter, &install_filters);
     } else if(strcmp(token, "interface") == 0) {
         struct interface_conf *if_conf;
         c = parse_ifconf(c, gnc, closure, &if_conf);
@@ -1064,6 +1287,22 @@ parse_config_line(int c, gnc_t gnc, void *closure,
                          if_conf, default_interface_conf);
             free(if_conf);
         }
+    } else if(strcmp(token, "check-fib") == 0) {
+        int rc;
+        c = skip_eol(c, gnc, closure);
+        if(c < -1)
+            goto fail;
+        rc = kernel_check_fib();
+        if(rc != 0) {
+            if(action_return)
+                *action_return = CONFIG_ACTION_NO;
+            if(message_return) {
+                if(rc < 0)
+                    *message_return = "Couldn't check kernel routes";
+                else
+                    *message_return = "Repaired kernel routes";
+            }
+        }
     } else if(strcmp(token, "flush") == 0) {
         char *token2;
         c = skip_whitespace(c, gnc, closure);
@@ -1101,6 +1340,21 @@ parse_config_line(int c, gnc_t gnc, void *closure,
         if(c < -1 || !action_return)
             goto fail;
         reopen_logfile();
+    } else if(strcmp(token, "reload") == 0) {
+        int rc;
+        c = skip_eol(c, gnc, closure);
+        if(c < -1 || !action_return)
+            goto fail;
+        rc = reload_config();
+        if(rc <= 0) {
+            *action_return = CONFIG_ACTION_NO;
+            if(message_return) {
+                if(rc < 0)
+                    *message_return = "Couldn't reload configuration";
+                else
+                    *message_return = "No configuration file";
+            }
+        }
     } else {
         c = parse_option(c, gnc, closure, token);
         if(c < -1)
@@ -1142,13 +1396,27 @@ parse_config_from_file(const char *filename, int *line_return)
         return -1;
     }
 
+    if(!config_finalised) {
+        char **new_files =
+            realloc(config_files, (num_config_files + 1) * sizeof(char*));
+        if(new_files != NULL) {
+            config_files = new_files;
+            config_files[num_config_files] = strdup(filename);
+            if(config_files[num_config_files] != NULL)
+                num_config_files++;
+        }
+    }
+
     c = gnc_file(&s);
-    if(c < 0)
+    if(c < 0) {
+        fclose(s.f);
         return 0;
+    }
 
     while(1) {
         c = parse_config_line(c, (gnc_t)gnc_file, &s, NULL, NULL);
         if(c < -1) {
+            fclose(s.f);
             *line_return = s.line;
             return -1;
         }
@@ -1186,12 +1454,28 @@ parse_config_from_string(char *string, int n, const char **message_return)
         return -1;
 
     c = parse_config_line(c, (gnc_t)gnc_buf, &s, &action, &message);
-    if(c == -1) {
-        if(message_return)
-            *message_return = message;
-        return action;
-    } else
+    if(c != -1)
         return -1;
+
+    /* Statements given with -C, which reload_config replays. */
+    if(!config_finalised) {
+        char **new_strings =
+            realloc(config_strings,
+                    (num_config_strings + 1) * sizeof(char*));
+        if(new_strings != NULL) {
+            config_strings = new_strings;
+            config_strings[num_config_strings] = malloc(n + 1);
+            if(config_strings[num_config_strings] != NULL) {
+                memcpy(config_strings[num_config_strings], string, n);
+                config_strings[num_config_strings][n] = '\0';
+                num_config_strings++;
+            }
+        }
+    }
+
+    if(message_return)
+        *message_return = message;
+    return action;
 }
 
 static void
@@ -1211,6 +1495,7 @@ renumber_filters()
     renumber_filter(output_filters);
     renumber_filter(redistribute_filters);
     renumber_filter(install_filters);
+    filters_changed();
 }
 
 static int
@@ -1279,27 +1564,328 @@ filter_match(struct filter *f, const unsigned char *id,
     return 1;
 }
 
+/* Filter lists are compiled by finalise_config into a binary trie over
+   the destination prefix.  A filter hangs off the node for its prefix
+   (the root if it has none), so the filters that may match a prefix are
+   those on its path down the trie.  Each node keeps its filters in list
+   order, and the first match is the lowest-ranked of the nodes' first
+   matches. */
+
+#define FILTER_AF_INET 1
+#define FILTER_AF_INET6 2
+
+struct filter_entry {
+    struct filter *filter;
+    int rank;                   /* position in the list */
+    int proto;
+    unsigned char af;           /* FILTER_AF_* that may match */
+};
+
+struct filter_node {
+    struct filter_node *child[2];
+    struct filter_entry *entries;
+    int numentries, maxentries;
+};
+
+static struct filter_node *input_trie = NULL;
+static struct filter_node *output_trie = NULL;
+static struct filter_node *redistribute_trie = NULL;
+static struct filter_node *install_trie = NULL;
+
+static int
+prefix_bit(const unsigned char *prefix, int i)
+{
+    return (prefix[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static void
+free_filter_trie(struct filter_node *node)
+{
+    if(node == NULL)
+        return;
+    free_filter_trie(node->child[0]);
+    free_filter_trie(node->child[1]);
+    free(node->entries);
+    free(node);
+}
+
 static int
-do_filter(struct filter *f, const unsigned char *id,
+add_filter_entry(struct filter_node *root, struct filter *f, int rank)
+{
+    struct filter_node *node = root;
+    struct filter_entry *entry;
+    int i;
+
+    if(f->prefix) {
+        for(i = 0; i < f->plen; i++) {
+            int b = prefix_bit(f->prefix, i);
+            if(node->child[b] == NULL) {
+                node->child[b] = calloc(1, sizeof(struct filter_node));
+                if(node->child[b] == NULL)
+                    return -1;
+            }
+            node = node->child[b];
+        }
+    }
+
+    if(node->numentries >= node->maxentries) {
+        int n = node->maxentries < 1 ? 4 : 2 * node->maxentries;
+        struct filter_entry *new_entries =
+            realloc(node->entries, n * sizeof(struct filter_entry));
+        if(new_entries == NULL)
+            return -1;
+        node->entries = new_entries;
+        node->maxentries = n;
+    }
+    entry = &node->entries[node->numentries++];
+    entry->filter = f;
+    entry->rank = rank;
+    entry->proto = f->proto;
+    entry->af = f->af == AF_INET ? FILTER_AF_INET :
+        f->af == AF_INET6 ? FILTER_AF_INET6 :
+        FILTER_AF_INET | FILTER_AF_INET6;
+    return 0;
+}
+
+static struct filter_node *
+compile_filter(struct filter *f)
+{
+    struct filter_node *root;
+    int rank = 0, rc;
+
+    root = calloc(1, sizeof(struct filter_node));
+    if(root == NULL)
+        return NULL;
+
+    while(f) {
+        rc = add_filter_entry(root, f, rank++);
+        if(rc < 0) {
+            free_filter_trie(root);
+            return NULL;
+        }
+        f = f->next;
+    }
+    return root;
+}
+
+static int
+compile_filters(void)
+{
+    struct filter_node **tries[4] =
+        { &input_trie, &output_trie, &redistribute_trie, &install_trie };
+    struct filter *filters[4] =
+        { input_filters, output_filters, redistribute_filters,
+          install_filters };
+    struct filter_node *new[4];
+    int i, j;
+
+    filters_changed();
+    for(i = 0; i < 4; i++) {
+        new[i] = compile_filter(filters[i]);
+        if(new[i] == NULL) {
+            perror("compile_filter");
+            for(j = 0; j < i; j++)
+                free_filter_trie(new[j]);
+            break;
+        }
+    }
+
+    /* The old tries may point at filters that are about to be freed.
+       Without a trie, do_filter walks the lists, which is slow but
+       correct. */
+    for(j = 0; j < 4; j++) {
+        free_filter_trie(*tries[j]);
+        *tries[j] = i < 4 ? NULL : new[j];
+    }
+    return i < 4 ? -1 : 1;
+}
+
+static struct filter *
+trie_match(struct filter_node *node, const unsigned char *id,
+           const unsigned char *prefix, unsigned short plen,
+           const unsigned char *src_prefix, unsigned short src_plen,
+           const unsigned char *neigh, unsigned int ifindex, int proto)
+{
+    struct filter *best = NULL;
+    int best_rank = INT_MAX;
+    int af = plen >= 96 && v4mapped(prefix) ?
+        FILTER_AF_INET : FILTER_AF_INET6;
+    int depth = 0, i;
+
+    while(node) {
+        for(i = 0; i < node->numentries; i++) {
+            struct filter_entry *entry = &node->entries[i];
+            if(entry->rank >= best_rank)
+                break;
+            if(!(entry->af & af))
+                continue;
+            if(entry->proto && entry->proto != proto)
+                continue;
+            if(filter_match(entry->filter, id, prefix, plen,
+                            src_prefix, src_plen, neigh, ifindex, proto)) {
+                best = entry->filter;
+                best_rank = entry->rank;
+                break;
+            }
+        }
+        if(depth >= plen || depth >= 128)
+            break;
+        node = node->child[prefix_bit(prefix, depth)];
+        depth++;
+    }
+    return best;
+}
+
+/* The result of the last lookup with given arguments, in a direct-mapped
+   table.  Entries from an older generation of the filters are stale; the
+   generation is bumped whenever a filter list or an interface index
+   changes.  A list is identified by its head: two lists with the same
+   head are both empty, and have the same results. */
+
+#define FILTER_CACHE_SIZE 4096  /* a power of two */
+
+struct filter_key {
+    const struct filter *list;
+    unsigned char id[8];
+    unsigned char prefix[16];
+    unsigned char src_prefix[16];
+    unsigned char neigh[16];
+    unsigned int ifindex;
+    int proto;
+    unsigned char plen, src_plen;
+    unsigned char has_id, has_src, has_neigh;
+};
+
+struct filter_cache_entry {
+    struct filter_key key;
+    unsigned int generation;
+    struct filter *match;
+};
+
+static struct filter_cache_entry *filter_cache = NULL;
+static unsigned int filter_generation = 1;
+
+static void
+filters_changed(void)
+{
+    filter_generation++;
+    if(filter_generation == 0) {
+        /* Don't mistake entries from 2^32 generations ago for fresh. */
+        if(filter_cache)
+            memset(filter_cache, 0,
+                   FILTER_CACHE_SIZE * sizeof(struct filter_cache_entry));
+        filter_generation = 1;
+    }
+}
+
+static unsigned int
+filter_hash(const struct filter_key *key)
+{
+    const unsigned char *p = (const unsigned char*)key;
+    unsigned int h = 2166136261U;
+    int i;
+
+    for(i = 0; i < sizeof(*key); i++)
+        h = (h ^ p[i]) * 16777619U;
+    return h;
+}
+
+static struct filter_cache_entry *
+filter_cache_slot(struct filter_key *key, struct filter *list,
+                  const unsigned char *id,
+                  const unsigned char *prefix, unsigned short plen,
+                  const unsigned char *src_prefix, unsigned short src_plen,
+                  const unsigned char *neigh, unsigned int ifindex, int proto)
+{
+    if(filter_cache == NULL) {
+        filter_cache = calloc(FILTER_CACHE_SIZE,
+                              sizeof(struct filter_cache_entry));
+        if(filter_cache == NULL)
+            return NULL;
+    }
+
+    /* Clear the padding too, since we hash and compare the bytes. */
+    memset(key, 0, sizeof(*key));
+    key->list = list;
+    if(id) {
+        memcpy(key->id, id, 8);
+        key->has_id = 1;
+    }
+    memcpy(key->prefix, prefix, 16);
+    key->plen = plen;
+    if(src_prefix) {
+        memcpy(key->src_prefix, src_prefix, 16);
+        key->src_plen = src_plen;
+        key->has_src = 1;
+    }
+    if(neigh) {
+        memcpy(key->neigh, neigh, 16);
+        key->has_neigh = 1;
+    }
+    key->ifindex = ifindex;
+    key->proto = proto;
+
+    return &filter_cache[filter_hash(key) & (FILTER_CACHE_SIZE - 1)];
+}
+
+static struct filter *
+list_match(struct filter *f, const unsigned char *id,
+           const unsigned char *prefix, unsigned short plen,
+           const unsigned char *src_prefix, unsigned short src_plen,
+           const unsigned char *neigh, unsigned int ifindex, int proto)
+{
+    while(f) {
+        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                        neigh, ifindex, proto))
+            break;
+        f = f->next;
+    }
+    return f;
+}
+
+static int
+do_filter(struct filter *f, struct filter_node *trie, const unsigned char *id,
           const unsigned char *prefix, unsigned short plen,
           const unsigned char *src_prefix, unsigned short src_plen,
           const unsigned char *neigh, unsigned int ifindex, int proto,
           struct filter_result *result)
 {
+    struct filter_key key;
+    struct filter_cache_entry *entry = NULL;
+
     if(result)
         memset(result, 0, sizeof(struct filter_result));
 
-    while(f) {
-        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
-                        neigh, ifindex, proto)) {
-            if(result)
-                memcpy(result, &f->action, sizeof(struct filter_result));
-            return f->action.add_metric;
+    if(prefix) {
+        entry = filter_cache_slot(&key, f, id, prefix, plen,
+                                  src_prefix, src_plen, neigh, ifindex, proto);
+        if(entry && entry->generation == filter_generation &&
+           memcmp(&entry->key, &key, sizeof(key)) == 0) {
+            f = entry->match;
+            goto done;
         }
-        f = f->next;
     }
 
-    return -1;
+    if(trie && prefix) {
+        f = trie_match(trie, id, prefix, plen, src_prefix, src_plen,
+                       neigh, ifindex, proto);
+    } else {
+        f = list_match(f, id, prefix, plen, src_prefix, src_plen,
+                       neigh, ifindex, proto);
+    }
+
+    if(entry) {
+        entry->key = key;
+        entry->generation = filter_generation;
+        entry->match = f;
+    }
+
+ done:
+    if(f == NULL)
+        return -1;
+    if(result)
+        memcpy(result, &f->action, sizeof(struct filter_result));
+    return f->action.add_metric;
 }
 
 int
@@ -1309,7 +1895,7 @@ input_filter(const unsigned char *id,
              const unsigned char *neigh, unsigned int ifindex)
 {
     int res;
-    res = do_filter(input_filters, id, prefix, plen,
+    res = do_filter(input_filters, input_trie, id, prefix, plen,
                     src_prefix, src_plen, neigh, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
@@ -1323,7 +1909,7 @@ output_filter(const unsigned char *id,
               unsigned int ifindex)
 {
     int res;
-    res = do_filter(output_filters, id, prefix, plen,
+    res = do_filter(output_filters, output_trie, id, prefix, plen,
                     src_prefix, src_plen, NULL, ifindex, 0, NULL);
     if(res < 0)
         res = 0;
@@ -1337,8 +1923,9 @@ redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     struct filter_result *result)
 {
     int res;
-    res = do_filter(redistribute_filters, NULL, prefix, plen,
-                    src_prefix, src_plen, NULL, ifindex, proto, result);
+    res = do_filter(redistribute_filters, redistribute_trie, NULL,
+                    prefix, plen, src_prefix, src_plen, NULL, ifindex, proto,
+                    result);
     if(res < 0)
         res = INFINITY;
     return res;
@@ -1350,15 +1937,16 @@ install_filter(const unsigned char *prefix, unsigned short plen,
                struct filter_result *result)
 {
     int res;
-    res = do_filter(install_filters, NULL, prefix, plen,
+    res = do_filter(install_filters, install_trie, NULL, prefix, plen,
                     src_prefix, src_plen, NULL, 0, 0, result);
     if(res < 0)
         res = INFINITY;
     return res;
 }
 
-int
-finalise_config()
+/* Local routes are redistributed unless the configuration says otherwise. */
+static int
+add_local_filter(void)
 {
     struct filter *filter = calloc(1, sizeof(struct filter));
     if(filter == NULL)
@@ -1368,6 +1956,17 @@ finalise_config()
     filter->plen_le = 128;
     filter->src_plen_le = 128;
     add_filter(filter, &redistribute_filters);
+    return 1;
+}
+
+int
+finalise_config()
+{
+    if(add_local_filter() < 0)
+        return -1;
+
+    if(compile_filters() < 0)
+        return -1;
 
     while(interface_confs) {
         struct interface_conf *if_conf;
@@ -1388,3 +1987,545 @@ finalise_config()
 
     return 1;
 }
+
+static int
+bytes_equal(const unsigned char *a, const unsigned char *b, int len)
+{
+    if(a == NULL || b == NULL)
+        return a == b;
+    return memcmp(a, b, len) == 0;
+}
+
+static int
+filter_equal(const struct filter *a, const struct filter *b)
+{
+    if((a->ifname == NULL) != (b->ifname == NULL) ||
+       (a->ifname && strcmp(a->ifname, b->ifname) != 0))
+        return 0;
+    return a->af == b->af &&
+        bytes_equal(a->id, b->id, 8) &&
+        bytes_equal(a->prefix, b->prefix, 16) && a->plen == b->plen &&
+        bytes_equal(a->src_prefix, b->src_prefix, 16) &&
+        a->src_plen == b->src_plen &&
+        a->plen_ge == b->plen_ge && a->plen_le == b->plen_le &&
+        a->src_plen_ge == b->src_plen_ge && a->src_plen_le == b->src_plen_le &&
+        a->proto == b->proto &&
+        bytes_equal(a->neigh, b->neigh, 16) &&
+        a->action.add_metric == b->action.add_metric &&
+        a->action.table == b->action.table &&
+        bytes_equal(a->action.src_prefix, b->action.src_prefix, 16) &&
+        a->action.src_plen == b->action.src_plen;
+}
+
+static int
+filter_list_equal(const struct filter *a, const struct filter *b)
+{
+    while(a && b) {
+        if(!filter_equal(a, b))
+            return 0;
+        a = a->next;
+        b = b->next;
+    }
+    return a == NULL && b == NULL;
+}
+
+static void
+free_filters(struct filter *f)
+{
+    while(f) {
+        struct filter *next = f->next;
+        free(f->ifname);
+        free(f->id);
+        free(f->prefix);
+        free(f->src_prefix);
+        free(f->neigh);
+        free(f->action.src_prefix);
+        free(f);
+        f = next;
+    }
+}
+
+static int
+ifconf_equal(const struct interface_conf *a, const struct interface_conf *b)
+{
+    if(a == NULL || b == NULL)
+        return a == b;
+
+#define SAME(field) (a->field == b->field)
+    return SAME(hello_interval) && SAME(update_interval) && SAME(cost) &&
+        SAME(type) && SAME(split_horizon) && SAME(lq) && SAME(faraway) &&
+        SAME(fast_failure) && SAME(unicast_hello) && SAME(aggregate) &&
+        SAME(channel) && SAME(unicast_threshold) &&
+        SAME(enable_timestamps) && SAME(rtt_decay) && SAME(rtt_min) &&
+        SAME(rtt_max) && SAME(max_rtt_penalty);
+#undef SAME
+}
+
+/* Take an interface down, and let check_interfaces bring it back up with
+   its new configuration. */
+static void
+bounce_interface(struct interface *ifp)
+{
+    if(if_up(ifp))
+        interface_up(ifp, 0);
+}
+
+static void
+reload_interfaces(struct interface_conf *confs,
+                  struct interface_conf *default_conf)
+{
+    struct interface_conf *old_default = default_interface_conf;
+    struct interface_conf *conf, **confp;
+    struct interface *ifp, *next;
+    int default_changed;
+
+    for(conf = confs; conf; conf = conf->next)
+        if(default_conf)
+            merge_ifconf(conf, conf, default_conf);
+
+    default_changed = !ifconf_equal(old_default, default_conf);
+    if(!default_changed) {
+        free(default_conf);
+        default_conf = old_default;
+    }
+    default_interface_conf = default_conf;
+
+    for(ifp = interfaces; ifp; ifp = next) {
+        int shared, changed;
+        next = ifp->next;
+
+        /* An interface without a configuration of its own shares the
+           default one, which it must not free. */
+        shared = ifp->conf == NULL || ifp->conf == old_default;
+
+        for(confp = &confs; *confp; confp = &(*confp)->next)
+            if(strcmp((*confp)->ifname, ifp->name) == 0)
+                break;
+        conf = *confp;
+        if(conf == NULL) {
+            if(!(ifp->flags & IF_CMDLINE)) {
+                flush_interface(ifp->name);
+            } else if(!shared || default_changed) {
+                if(!shared)
+                    flush_ifconf(ifp->conf);
+                ifp->conf = default_conf;
+                bounce_interface(ifp);
+            }
+            continue;
+        }
+        *confp = conf->next;
+        conf->next = NULL;
+
+        changed = !ifconf_equal(ifp->conf, conf);
+        if(shared) {
+            ifp->conf = conf;
+        } else if(!changed) {
+            free_ifconf(conf);
+        } else {
+            flush_ifconf(ifp->conf);
+            ifp->conf = conf;
+        }
+        if(changed)
+            bounce_interface(ifp);
+    }
+
+    while(confs) {
+        conf = confs;
+        confs = confs->next;
+        conf->next = NULL;
+        if(add_interface(conf->ifname, conf) == NULL)
+            fprintf(stderr, "Couldn't add interface %s.\n", conf->ifname);
+    }
+
+    if(default_changed)
+        free(old_default);
+
+    check_interfaces();
+}
+
+static int
+filter_add_metric(const struct filter *f)
+{
+    return f ? f->action.add_metric : 0;
+}
+
+/* Announce a route again on the interfaces where the output filters
+   changed their mind about it.  An update that is now denied is never
+   sent, so the neighbours get an explicit retraction instead. */
+static void
+refilter_route(struct filter *old, const unsigned char *id,
+               const unsigned char *prefix, unsigned char plen,
+               const unsigned char *src_prefix, unsigned char src_plen,
+               unsigned short seqno)
+{
+    struct interface *ifp;
+    int add_metric, old_metric;
+
+    FOR_ALL_INTERFACES(ifp) {
+        if(!if_up(ifp))
+            continue;
+        add_metric = output_filter(id, prefix, plen, src_prefix, src_plen,
+                                   ifp->ifindex);
+        old_metric = filter_add_metric(list_match(old, id, prefix, plen,
+                                                  src_prefix, src_plen,
+                                                  NULL, ifp->ifindex, 0));
+        if(add_metric == old_metric)
+            continue;
+        if(add_metric >= INFINITY) {
+            if(old_metric < INFINITY)
+                send_filtered_retraction(ifp, id, prefix, plen,
+                                         src_prefix, src_plen, seqno);
+        } else {
+            send_update(ifp, 0, prefix, plen, src_prefix, src_plen);
+        }
+    }
+}
+
+static void
+refilter_output(struct filter *old)
+{
+    struct route_stream *routes;
+    struct xroute_stream *xroutes;
+    struct babel_route *route;
+    struct xroute *xroute;
+
+    routes = route_stream(ROUTE_INSTALLED);
+    if(routes) {
+        while((route = route_stream_next(routes))) {
+            const struct source *src = route->src;
+            refilter_route(old, src->id, src->prefix, src->plen,
+                           src->src_prefix, src->src_plen, route->seqno);
+        }
+        route_stream_done(routes);
+    }
+
+    xroutes = xroute_stream();
+    if(xroutes) {
+        while((xroute = xroute_stream_next(xroutes)))
+            refilter_route(old, myid, xroute->prefix, xroute->plen,
+                           xroute->src_prefix, xroute->src_plen, myseqno);
+        xroute_stream_done(xroutes);
+    }
+}
+
+/* Recompute the metric of the routes whose input filter verdict
+   changed. */
+static void
+refilter_input(void)
+{
+    struct route_stream *routes;
+    struct babel_route *route;
+    int add_metric;
+
+    routes = route_stream(ROUTE_ALL);
+    if(routes == NULL)
+        return;
+    while((route = route_stream_next(routes))) {
+        const struct source *src = route->src;
+        add_metric = input_filter(src->id, src->prefix, src->plen,
+                                  src->src_prefix, src->src_plen,
+                                  route->neigh->address,
+                                  route->neigh->ifp->ifindex);
+        if(add_metric != route->add_metric)
+            update_route_metric(route);
+    }
+    route_stream_done(routes);
+}
+
+/* Ask for the routes that the old input filters dropped on arrival and
+   the new ones accept.  Filters that both lists start with decide the
+   same, so only the prefixes named by the filters after them can have
+   gone from denied to allowed.  An old filter that names no prefix and
+   denied, or a new one that allows, may have let in anything, and the
+   whole table is asked for. */
+static void
+request_unfiltered(struct interface *ifp, struct filter *old)
+{
+    struct filter *lists[2] = { old, input_filters };
+    const unsigned char *src_prefix;
+    struct filter *f;
+    int i;
+
+    while(lists[0] && lists[1] && filter_equal(lists[0], lists[1])) {
+        lists[0] = lists[0]->next;
+        lists[1] = lists[1]->next;
+    }
+
+    for(i = 0; i < 2; i++) {
+        for(f = lists[i]; f; f = f->next) {
+            if(f->ifname && f->ifindex != ifp->ifindex)
+                continue;
+            if(f->prefix == NULL &&
+               (i == 0) == (f->action.add_metric >= INFINITY)) {
+                send_request(ifp, NULL, 0, NULL, 0);
+                return;
+            }
+        }
+    }
+
+    for(i = 0; i < 2; i++) {
+        for(f = lists[i]; f; f = f->next) {
+            if(f->prefix == NULL ||
+               (f->ifname && f->ifindex != ifp->ifindex))
+                continue;
+            src_prefix = f->src_prefix ? f->src_prefix : zeroes;
+            if(filter_add_metric(list_match(old, f->id, f->prefix, f->plen,
+                                            src_prefix, f->src_plen,
+                                            f->neigh, ifp->ifindex,
+                                            0)) < INFINITY)
+                continue;
+            if(input_filter(f->id, f->prefix, f->plen,
+                            src_prefix, f->src_plen,
+                            f->neigh, ifp->ifindex) >= INFINITY)
+                continue;
+            send_request(ifp, f->prefix, f->plen, src_prefix, f->src_plen);
+        }
+    }
+}
+
+/* The installed routes that the new install filters put in a different
+   table.  They must be removed while the old filters still say where
+   they are. */
+static int
+moved_routes(struct filter *new, struct babel_route ***routes_return)
+{
+    struct route_stream *routes;
+    struct babel_route *route, **moved = NULL;
+    struct filter_result result;
+    struct filter *f;
+    int n = 0, max = 0;
+
+    routes = route_stream(ROUTE_INSTALLED);
+    if(routes == NULL)
+        return -1;
+    while((route = route_stream_next(routes))) {
+        const struct source *src = route->src;
+        install_filter(src->prefix, src->plen, src->src_prefix, src->src_plen,
+                       &result);
+        f = list_match(new, NULL, src->prefix, src->plen,
+                       src->src_prefix, src->src_plen, NULL, 0, 0);
+        if(result.table == (f ? f->action.table : 0))
+            continue;
+        if(n >= max) {
+            int new_max = max < 1 ? 8 : 2 * max;
+            struct babel_route **new_moved =
+                realloc(moved, new_max * sizeof(struct babel_route*));
+            if(new_moved == NULL)
+                break;
+            moved = new_moved;
+            max = new_max;
+        }
+        moved[n++] = route;
+    }
+    route_stream_done(routes);
+
+    *routes_return = moved;
+    return n;
+}
+
+static void
+reload_filters(struct filter *new[4])
+{
+    struct filter **lists[4] =
+        { &input_filters, &output_filters, &redistribute_filters,
+          &install_filters };
+    struct filter *old[4] = { NULL, NULL, NULL, NULL };
+    struct babel_route **moved = NULL;
+    struct interface *ifp;
+    int i, n = 0, changed = 0;
+
+    for(i = 0; i < 4; i++) {
+        if(filter_list_equal(*lists[i], new[i])) {
+            free_filters(new[i]);
+            new[i] = NULL;
+        } else {
+            changed = 1;
+        }
+    }
+    if(!changed)
+        return;
+
+    if(new[3]) {
+        n = moved_routes(new[3], &moved);
+        for(i = 0; i < n; i++)
+            uninstall_route(moved[i]);
+    }
+
+    for(i = 0; i < 4; i++) {
+        if(new[i]) {
+            old[i] = *lists[i];
+            *lists[i] = new[i];
+        }
+    }
+    if(compile_filters() < 0)
+        fprintf(stderr, "Warning: couldn't compile filters.\n");
+
+    for(i = 0; i < n; i++) {
+        if(!moved[i]->installed)
+            install_route(moved[i]);
+    }
+    free(moved);
+
+    if(new[0]) {
+        refilter_input();
+        FOR_ALL_INTERFACES(ifp) {
+            if(if_up(ifp))
+                request_unfiltered(ifp, old[0]);
+        }
+    }
+
+    if(new[1])
+        refilter_output(old[1]);
+
+    if(new[2])
+        check_xroutes(1);
+
+    for(i = 0; i < 4; i++)
+        free_filters(old[i]);
+}
+
+/* The options that may be changed at runtime, saved so that a failed
+   reload can put them back. */
+struct runtime_options {
+    int keep_unfeasible, link_detect;
+    int diversity_kind, diversity_factor;
+    int local_overflow, local_buffer_size, local_batch_interval;
+    const char *logfile, *trace_file;
+};
+
+static void
+save_runtime_options(struct runtime_options *o)
+{
+    o->keep_unfeasible = keep_unfeasible;
+    o->link_detect = link_detect;
+    o->diversity_kind = diversity_kind;
+    o->diversity_factor = diversity_factor;
+    o->local_overflow = local_overflow;
+    o->local_buffer_size = local_buffer_size;
+    o->local_batch_interval = local_batch_interval;
+    o->logfile = logfile;
+    o->trace_file = trace_file;
+}
+
+static void
+restore_runtime_options(const struct runtime_options *o)
+{
+    keep_unfeasible = o->keep_unfeasible;
+    link_detect = o->link_detect;
+    diversity_kind = o->diversity_kind;
+    diversity_factor = o->diversity_factor;
+    local_overflow = o->local_overflow;
+    local_buffer_size = o->local_buffer_size;
+    local_batch_interval = o->local_batch_interval;
+    if(logfile != o->logfile)
+        free((char*)logfile);
+    logfile = o->logfile;
+    if(trace_file != o->trace_file)
+        free((char*)trace_file);
+    trace_file = o->trace_file;
+}
+
+/* Apply the side effects that parse_option defers while reloading. */
+static void
+apply_runtime_options(const struct runtime_options *o)
+{
+    int trace;
+
+    if(logfile != o->logfile &&
+       (logfile == NULL || o->logfile == NULL ||
+        strcmp(logfile, o->logfile) != 0))
+        reopen_logfile();
+
+    trace = reload_trace >= 0 ? reload_trace : trace_running();
+    if(!trace)
+        trace_stop();
+    else if((!trace_running() || strcmp(trace_file, o->trace_file) != 0) &&
+            trace_start(trace_file) < 0)
+        perror("trace_start");
+
+    if(reload_half_life >= 0)
+        change_smoothing_half_life(reload_half_life);
+}
+
+/* Parse the -C statements and the configuration files again, and apply
+   what changed: filters, interfaces and the options that may be changed
+   at runtime.  Nothing is changed if parsing fails.  Returns 0 if there
+   is no configuration. */
+int
+reload_config(void)
+{
+    struct filter **lists[4] =
+        { &input_filters, &output_filters, &redistribute_filters,
+          &install_filters };
+    struct filter *saved[4], *new[4];
+    struct interface_conf *saved_confs = interface_confs;
+    struct interface_conf *saved_default = default_interface_conf;
+    struct interface_conf *confs, *default_conf;
+    struct runtime_options options;
+    int i, rc = 1, line;
+
+    if(num_config_files == 0 && num_config_strings == 0)
+        return 0;
+
+    for(i = 0; i < 4; i++) {
+        saved[i] = *lists[i];
+        *lists[i] = NULL;
+    }
+    interface_confs = NULL;
+    default_interface_conf = NULL;
+    save_runtime_options(&options);
+    reload_trace = -1;
+    reload_half_life = -1;
+
+    config_reloading = 1;
+    for(i = 0; i < num_config_strings; i++) {
+        rc = parse_config_from_string(config_strings[i],
+                                      strlen(config_strings[i]), NULL);
+        if(rc < 0) {
+            fprintf(stderr,
+                    "Couldn't reload configuration statement \"%s\".\n",
+                    config_strings[i]);
+            break;
+        }
+    }
+    for(i = 0; rc >= 0 && i < num_config_files; i++) {
+        rc = parse_config_from_file(config_files[i], &line);
+        if(rc < 0) {
+            fprintf(stderr,
+                    "Couldn't reload configuration from file %s "
+                    "(error at line %d).\n",
+                    config_files[i], line);
+            break;
+        }
+    }
+    if(rc >= 0)
+        rc = add_local_filter();
+    config_reloading = 0;
+
+    for(i = 0; i < 4; i++) {
+        new[i] = *lists[i];
+        *lists[i] = saved[i];
+    }
+    confs = interface_confs;
+    default_conf = default_interface_conf;
+    interface_confs = saved_confs;
+    default_interface_conf = saved_default;
+
+    if(rc < 0) {
+        for(i = 0; i < 4; i++)
+            free_filters(new[i]);
+        while(confs) {
+            struct interface_conf *next = confs->next;
+            free_ifconf(confs);
+            confs = next;
+        }
+        free(default_conf);
+        restore_runtime_options(&options);
+        return -1;
+    }
+
+    apply_runtime_options(&options);
+    reload_interfaces(confs, default_conf);
+    reload_filters(new);
+    return 1;
+}
@@ -33,6 +33,7 @@ THE SOFTWARE.
 #define CONFIG_ACTION_DUMP_ROUTES 7
 #define CONFIG_ACTION_DUMP_INTERFACES 8
 #define CONFIG_ACTION_DUMP_ME 9
+#define CONFIG_ACTION_BINARY 10
 
 struct filter_result {
     unsigned char *src_prefix;
@@ -58,7 +59,7 @@ struct filter {
     unsigned char *neigh;
     struct filter *next;
     struct filter_result action;
-} CACHEALIGN;
+} CACHELINE_ALIGN;
 
 extern struct interface_conf *default_interface_conf;
 
@@ -84,4 +85,5 @@ int install_filter(const unsigned char *prefix, unsigned short plen,
                    const unsigned char *src_prefix, unsigned short src_plen,
                    struct filter_result *result);
 int finalise_config(void);
+int reload_config(void);
 #endif
@@ -131,80 +131,237 @@ inter(const struct babel_route *rt, const struct babel_route *rt1,
     return zone;
 }
 
+/* The length of the shortest prefix that contains prefix/plen and that
+   prefix_cmp doesn't consider disjoint from it. */
 static int
-zone_equal(const struct zone *z1, const struct zone *z2)
+first_ancestor(const unsigned char *prefix, unsigned char plen)
 {
-    return z1 && z2 && z1->dst_plen == z2->dst_plen &&
-        v6_equal(z1->dst_prefix, z2->dst_prefix) &&
-        z1->src_plen == z2->src_plen &&
-        v6_equal(z1->src_prefix, z2->src_prefix) ;
+    return v4mapped(prefix) && plen >= 96 ? 96 : 0;
 }
 
-static const struct babel_route *
-min_conflict(const struct zone *zone, const struct babel_route *rt)
+/* Two conflicting routes have nested destinations and sources, in
+   opposite directions, and their intersection has the destination of one
+   and the source of the other.  Hence, the installed routes whose
+   conflicts may yield a zone are the routes to its destination from an
+   ancestor of its source, and conversely: at most one per ancestor, found
+   by exact lookups. */
+struct zone_routes {
+    const struct babel_route *routes[2 * 129];
+    int n_to;                   /* routes[0..n_to) go to the destination */
+    int n;
+};
+
+static void
+zone_routes(const struct zone *zone, struct zone_routes *zr)
 {
-    struct babel_route *rt1 = NULL;
-    const struct babel_route *min = NULL;
-    struct route_stream *stream = NULL;
-    struct zone curr_zone;
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
-        return NULL;
+    unsigned char prefix[16];
+    struct babel_route *rt;
+    int plen;
+
+    zr->n = zr->n_to = 0;
+    /* Both the destination and the source of a conflict zone come from
+       the more specific of two prefixes. */
+    if(zone->dst_plen == 0 || zone->src_plen == 0)
+        return;
+
+    for(plen = first_ancestor(zone->src_prefix, zone->src_plen);
+        plen < zone->src_plen; plen++) {
+        normalize_prefix(prefix, zone->src_prefix, plen);
+        rt = find_installed_route(zone->dst_prefix, zone->dst_plen,
+                                  prefix, plen);
+        if(rt)
+            zr->routes[zr->n++] = rt;
     }
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
-        __builtin_prefetch(rt1->src,0,1);
-        __builtin_prefetch(rt->src,0,1);
-
-        if(!(conflicts(rt, rt1) &&
-             zone_equal(inter(rt, rt1, &curr_zone), zone)))
-             continue;
-        min = min_route(rt1, min);
+    zr->n_to = zr->n;
+    for(plen = first_ancestor(zone->dst_prefix, zone->dst_plen);
+        plen < zone->dst_plen; plen++) {
+        normalize_prefix(prefix, zone->dst_prefix, plen);
+        rt = find_installed_route(prefix, plen,
+                                  zone->src_prefix, zone->src_plen);
+        if(rt)
+            zr->routes[zr->n++] = rt;
     }
-    route_stream_done(stream);
-    return min;
 }
 
+/* Any route to the destination of a zone conflicts with any route from
+   its source, and wins: the kernel route for the zone is the most
+   specific of the former, provided there is at least one of the latter. */
 static const struct babel_route *
-conflict_solution(const struct babel_route *rt)
+compute_solution(const struct zone *zone)
 {
-    const struct babel_route *rt1 = NULL, *rt2 = NULL;
-    struct route_stream *stream1 = NULL;
-    struct route_stream *stream2 = NULL;
-    const struct babel_route *min = NULL; /* == solution */
-    struct zone zone;
-    struct zone tmp;
-    /* Having a conflict requires at least one specific route. */
-    stream1 = route_stream(ROUTE_SS_INSTALLED);
-    if(!stream1) {
+    const struct babel_route *min = NULL;
+    struct zone_routes zr;
+    int i;
+
+    zone_routes(zone, &zr);
+    if(zr.n_to == 0 || zr.n_to == zr.n)
         return NULL;
+    for(i = 0; i < zr.n_to; i++)
+        min = min_route(zr.routes[i], min);
+    return min;
+}
+
+/* The conflict zones that we have installed in the kernel, and the route
+   that each is installed with, sorted by destination then source.  A
+   change to a route only visits the zones it conflicts in, and only has
+   to compute a solution again when it was the one installed. */
+struct zone_solution {
+    unsigned char dst_prefix[16];
+    unsigned char src_prefix[16];
+    unsigned char dst_plen;
+    unsigned char src_plen;
+    unsigned int stamp;
+    const struct babel_route *route;
+};
+
+static struct zone_solution *solutions = NULL;
+static int numsolutions = 0, maxsolutions = 0;
+static unsigned int solution_stamp = 0;
+
+static int
+solution_compare(const struct zone *zone, const struct zone_solution *zs)
+{
+    int rc;
+
+    rc = memcmp(zone->dst_prefix, zs->dst_prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(zone->dst_plen != zs->dst_plen)
+        return zone->dst_plen < zs->dst_plen ? -1 : 1;
+    rc = memcmp(zone->src_prefix, zs->src_prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(zone->src_plen != zs->src_plen)
+        return zone->src_plen < zs->src_plen ? -1 : 1;
+    return 0;
+}
+
+static int
+solution_position(const struct zone *zone, int *found_return)
+{
+    int p, m, g, c;
+
+    *found_return = 0;
+    p = 0;
+    g = numsolutions - 1;
+    while(p <= g) {
+        m = (p + g) / 2;
+        c = solution_compare(zone, &solutions[m]);
+        if(c == 0) {
+            *found_return = 1;
+            return m;
+        } else if(c < 0) {
+            g = m - 1;
+        } else {
+            p = m + 1;
+        }
     }
-    while(1) {
-        rt1 = route_stream_next(stream1);
-        if(rt1 == NULL) break;
-
-        stream2 = route_stream(ROUTE_INSTALLED);
-        if(!stream2) {
-            route_stream_done(stream1);
-            fprintf(stderr, "Couldn't allocate route stream.\n");
-            return NULL;
+    return p;
+}
+
+static struct zone_solution *
+find_solution(const struct zone *zone)
+{
+    int i, found;
+
+    i = solution_position(zone, &found);
+    return found ? &solutions[i] : NULL;
+}
+
+static struct zone_solution *
+set_solution(const struct zone *zone, const struct babel_route *route)
+{
+    struct zone_solution *zs;
+    int i, found;
+
+    i = solution_position(zone, &found);
+    if(!found) {
+        if(numsolutions >= maxsolutions) {
+            int n = maxsolutions < 1 ? 8 : 2 * maxsolutions;
+            struct zone_solution *new_solutions =
+                realloc(solutions, n * sizeof(struct zone_solution));
+            if(new_solutions == NULL) {
+                perror("malloc(zone_solution)");
+                return NULL;
+            }
+            solutions = new_solutions;
+            maxsolutions = n;
         }
+        if(i < numsolutions)
+            memmove(solutions + i + 1, solutions + i,
+                    (numsolutions - i) * sizeof(struct zone_solution));
+        numsolutions++;
+        zs = &solutions[i];
+        memcpy(zs->dst_prefix, zone->dst_prefix, 16);
+        memcpy(zs->src_prefix, zone->src_prefix, 16);
+        zs->dst_plen = zone->dst_plen;
+        zs->src_plen = zone->src_plen;
+        zs->stamp = 0;
+    }
+    zs = &solutions[i];
+    zs->route = route;
+    return zs;
+}
 
-        while(1) {
-            rt2 = route_stream_next(stream2);
-            if(rt2 == NULL) break;
-            if(!(conflicts(rt1, rt2) &&
-                 zone_equal(inter(rt1, rt2, &tmp), to_zone(rt, &zone)) &&
-                 rt_cmp(rt1, rt2) < 0))
-                continue;
-            min = min_route(rt1, min);
+static void
+remove_solution(struct zone_solution *zs)
+{
+    int i = zs - solutions;
+
+    if(i < numsolutions - 1)
+        memmove(solutions + i, solutions + i + 1,
+                (numsolutions - i - 1) * sizeof(struct zone_solution));
+    numsolutions--;
+}
+
+/* The installed routes that conflict with rt: those to an ancestor of its
+   destination from inside its source, and those from an ancestor of its
+   source to inside its destination.  Each is a range of the index of
+   installed routes.  The array is reused by the next call. */
+static int
+find_conflicts(const struct babel_route *rt,
+               const struct babel_route ***conflicts_return)
+{
+    static const struct babel_route **buf = NULL;
+    static int size = 0;
+    const struct source *src = rt->src;
+    unsigned char prefix[16];
+    struct babel_route **routes;
+    int dst, plen, n, i, count = 0;
+
+    for(dst = 1; dst >= 0; dst--) {
+        const unsigned char *p = dst ? src->prefix : src->src_prefix;
+        int max = dst ? src->plen : src->src_plen;
+        for(plen = first_ancestor(p, max); plen < max; plen++) {
+            normalize_prefix(prefix, p, plen);
+            if(dst)
+                n = installed_routes_to(prefix, plen,
+                                        src->src_prefix, src->src_plen,
+                                        &routes);
+            else
+                n = installed_routes_from(prefix, plen,
+                                          src->prefix, src->plen, &routes);
+            for(i = 0; i < n; i++) {
+                if(!conflicts(rt, routes[i]))
+                    continue;
+                if(count >= size) {
+                    int new_size = size < 1 ? 8 : 2 * size;
+                    const struct babel_route **new_buf =
+                        realloc(buf, new_size * sizeof(*buf));
+                    if(new_buf == NULL) {
+                        perror("malloc(conflicts)");
+                        goto done;
+                    }
+                    buf = new_buf;
+                    size = new_size;
+                }
+                buf[count++] = routes[i];
+            }
         }
-        route_stream_done(stream2);
     }
-    route_stream_done(stream1);
-    return min;
+ done:
+    *conflicts_return = buf;
+    return count;
 }
 
 static int
@@ -215,16 +372,68 @@ is_installed(struct zone *zone)
                              zone->src_prefix, zone->src_plen) != NULL;
 }
 
+/* A route's backup and multipath next hops only cover its own prefix,
+   not the zones in which it is installed to resolve conflicts: these
+   are computed among the routes to that prefix alone. */
+static int
+zone_is_route(const struct zone *zone, const struct babel_route *route)
+{
+    return zone->dst_plen == route->src->plen &&
+        zone->src_plen == route->src->src_plen &&
+        v6_equal(zone->dst_prefix, route->src->prefix) &&
+        v6_equal(zone->src_prefix, route->src->src_prefix);
+}
+
+static const unsigned char *
+zone_backup(const struct zone *zone, const struct babel_route *route,
+            int *ifindex_return)
+{
+    *ifindex_return = 0;
+    if(route->backup == NULL || !zone_is_route(zone, route))
+        return NULL;
+    *ifindex_return = route->backup->neigh->ifp->ifindex;
+    return route->backup->nexthop;
+}
+
+static int
+zone_multipath(const struct zone *zone, const struct babel_route *route,
+               const struct kernel_multipath **paths_return)
+{
+    *paths_return = NULL;
+    if(route->multipath_len <= 1 || !zone_is_route(zone, route))
+        return 0;
+    *paths_return = route->multipath;
+    return route->multipath_len;
+}
+
+/* Routes installed in their own zone may be given a lifetime in the
+   kernel; conflict resolution routes are shared, and never expire. */
+static int
+zone_expires(const struct zone *zone, const struct babel_route *route)
+{
+    if(!zone_is_route(zone, route))
+        return 0;
+    return route_kernel_lifetime(route);
+}
+
 static int
 add_route(const struct zone *zone, const struct babel_route *route)
 {
     int table = find_table(zone->dst_prefix, zone->dst_plen,
                            zone->src_prefix, zone->src_plen);
+    const unsigned char *backup;
+    const struct kernel_multipath *paths;
+    int backup_ifindex, numpaths;
+
+    backup = zone_backup(zone, route, &backup_ifindex);
+    numpaths = zone_multipath(zone, route, &paths);
     return kernel_route(ROUTE_ADD, table, zone->dst_prefix, zone->dst_plen,
                         zone->src_prefix, zone->src_plen,
                         route->nexthop,
                         route->neigh->ifp->ifindex,
-                        metric_to_kernel(route_metric(route)), NULL, 0, 0, 0);
+                        metric_to_kernel(route_metric(route)), NULL, 0, 0, 0,
+                        backup, backup_ifindex, paths, numpaths,
+                        zone_expires(zone, route));
 }
 
 static int
@@ -236,7 +445,8 @@ del_route(const struct zone *zone, const struct babel_route *route)
                         zone->src_prefix, zone->src_plen,
                         route->nexthop,
                         route->neigh->ifp->ifindex,
-                        metric_to_kernel(route_metric(route)), NULL, 0, 0, 0);
+                        metric_to_kernel(route_metric(route)), NULL, 0, 0, 0,
+                        NULL, 0, NULL, 0, 0);
 }
 
 static int
@@ -245,12 +455,20 @@ chg_route(const struct zone *zone, const struct babel_route *old,
 {
     int table = find_table(zone->dst_prefix, zone->dst_plen,
                            zone->src_prefix, zone->src_plen);
+    const unsigned char *backup;
+    const struct kernel_multipath *paths;
+    int backup_ifindex, numpaths;
+
+    backup = zone_backup(zone, new, &backup_ifindex);
+    numpaths = zone_multipath(zone, new, &paths);
     return kernel_route(ROUTE_MODIFY, table, zone->dst_prefix, zone->dst_plen,
                         zone->src_prefix, zone->src_plen,
                         old->nexthop, old->neigh->ifp->ifindex,
                         metric_to_kernel(route_metric(old)),
                         new->nexthop, new->neigh->ifp->ifindex,
-                        metric_to_kernel(route_metric(new)), table);
+                        metric_to_kernel(route_metric(new)), table,
+                        backup, backup_ifindex, paths, numpaths,
+                        zone_expires(zone, new));
 }
 
 static int
@@ -259,12 +477,20 @@ chg_route_metric(const struct zone *zone, const struct babel_route *route,
 {
     int table = find_table(zone->dst_prefix, zone->dst_plen,
                            zone->src_prefix, zone->src_plen);
+    const unsigned char *backup;
+    const struct kernel_multipath *paths;
+    int backup_ifindex, numpaths;
+
+    backup = zone_backup(zone, route, &backup_ifindex);
+    numpaths = zone_multipath(zone, route, &paths);
     return kernel_route(ROUTE_MODIFY, table, zone->dst_prefix, zone->dst_plen,
                         zone->src_prefix, zone->src_plen,
                         route->nexthop, route->neigh->ifp->ifindex,
                         old_metric,
                         route->nexthop, route->neigh->ifp->ifindex,
-                        new_metric, table);
+                        new_metric, table,
+                        backup, backup_ifindex, paths, numpaths,
+                        zone_expires(zone, route));
 }
 
 int
@@ -274,7 +500,9 @@ kinstall_route(const struct babel_route *route)
     struct zone zone;
     const struct babel_route *rt1 = NULL;
     const struct babel_route *rt2 = NULL;
-    struct route_stream *stream = NULL;
+    const struct babel_route **conflicting;
+    struct zone_solution *zs;
+    int i, n;
     int v4 = v4mapped(route->nexthop);
 
     debugf("install_route(%s from %s)\n",
@@ -287,36 +515,40 @@ kinstall_route(const struct babel_route *route)
         goto end;
     }
 
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
-        return -1;
-    }
-    /* Install source-specific conflicting routes */
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
+    /* Non conflicting case.  This goes first, so that the conflict zones
+       are only solved with route once the kernel has taken it; a failure
+       leaves them alone. */
+    to_zone(route, &zone);
+    zs = find_solution(&zone);
+    if(zs == NULL)
+        rc = add_route(&zone, route);
+    else
+        rc = chg_route(&zone, zs->route, route);
+    if(rc < 0 && errno != EEXIST)
+        goto end;
+    if(zs != NULL)
+        remove_solution(zs);
 
+    /* Install source-specific conflicting routes */
+    n = find_conflicts(route, &conflicting);
+    for(i = 0; i < n; i++) {
+        rt1 = conflicting[i];
         inter(route, rt1, &zone);
-        if(!(conflicts(route, rt1) &&
-             !is_installed(&zone) &&
-             rt_cmp(rt1, min_conflict(&zone, route)) == 0))
+        if(is_installed(&zone))
             continue;
-        rt2 = min_conflict(&zone, rt1);
-        if(rt2 == NULL)
-            add_route(&zone, min_route(route, rt1));
-        else if(rt_cmp(route, rt2) < 0 && rt_cmp(route, rt1) < 0)
-            chg_route(&zone, rt2, route);
+        zs = find_solution(&zone);
+        if(zs == NULL) {
+            rt2 = min_route(route, rt1);
+            if(add_route(&zone, rt2) >= 0)
+                set_solution(&zone, rt2);
+        } else {
+            rt2 = min_route(min_route(route, rt1), zs->route);
+            if(rt2 != zs->route && chg_route(&zone, zs->route, rt2) >= 0)
+                zs->route = rt2;
+        }
     }
-    route_stream_done(stream);
+    return 0;
 
-    /* Non conflicting case */
-    to_zone(route, &zone);
-    rt1 = conflict_solution(route);
-    if(rt1 == NULL)
-        rc = add_route(&zone, route);
-    else
-        rc = chg_route(&zone, rt1, route);
  end:
     if(rc < 0) {
         int save = errno;
@@ -333,7 +565,9 @@ kuninstall_route(const struct babel_route *route)
     int rc;
     struct zone zone;
     const struct babel_route *rt1 = NULL, *rt2 = NULL;
-    struct route_stream *stream = NULL;
+    const struct babel_route **conflicting;
+    struct zone_solution *zs;
+    int i, n;
     int v4 = v4mapped(route->nexthop);
 
     debugf("uninstall_route(%s from %s)\n",
@@ -347,36 +581,39 @@ kuninstall_route(const struct babel_route *route)
         return rc;
     }
     /* Remove the route, or change if the route was solving a conflict. */
-    rt1 = conflict_solution(route);
-    if(rt1 == NULL)
+    rt1 = compute_solution(&zone);
+    if(rt1 == NULL) {
         rc = del_route(&zone, route);
-    else
+    } else {
         rc = chg_route(&zone, route, rt1);
+        set_solution(&zone, rt1);
+    }
     if(rc < 0)
         perror("kernel_route(FLUSH)");
 
-    /* Remove source-specific conflicting routes */
-    stream = route_stream(ROUTE_INSTALLED);
-    if(!stream) {
-        fprintf(stderr, "Couldn't allocate route stream.\n");
-        return -1;
-    }
-    while(1) {
-        rt1 = route_stream_next(stream);
-        if(rt1 == NULL) break;
-
+    /* Remove source-specific conflicting routes.  Only the zones that
+       were installed with this route, or where it was on the losing side
+       and may have been the last one there, need a new solution. */
+    solution_stamp++;
+    n = find_conflicts(route, &conflicting);
+    for(i = 0; i < n; i++) {
+        rt1 = conflicting[i];
         inter(route, rt1, &zone);
-        if(!(conflicts(route, rt1) &&
-             !is_installed(&zone) &&
-             rt_cmp(rt1, min_conflict(&zone, route)) == 0))
+        zs = find_solution(&zone);
+        if(zs == NULL || zs->stamp == solution_stamp)
+            continue;
+        zs->stamp = solution_stamp;
+        if(zs->route != route && route->src->plen == zone.dst_plen)
             continue;
-        rt2 = min_conflict(&zone, rt1);
-        if(rt2 == NULL)
-            del_route(&zone, min_route(route, rt1));
-        else if(rt_cmp(route, rt2) < 0 && rt_cmp(route, rt1) < 0)
-            chg_route(&zone, route, rt2);
+        rt2 = compute_solution(&zone);
+        if(rt2 == NULL) {
+            del_route(&zone, zs->route);
+            remove_solution(zs);
+        } else if(rt2 != zs->route) {
+            chg_route(&zone, zs->route, rt2);
+            zs->route = rt2;
+        }
     }
-    route_stream_done(stream);
 
     return rc;
 }
@@ -386,8 +623,10 @@ kswitch_routes(const struct babel_route *old, const struct babel_route *new)
 {
     int rc;
     struct zone zone;
-    struct babel_route *rt1 = NULL;
-    struct route_stream *stream = NULL;
+    const struct babel_route *rt1 = NULL;
+    const struct babel_route **conflicting;
+    struct zone_solution *zs;
+    int i, n;
 
     debugf("switch_routes(%s from %s)\n",
            format_prefix(old->src->prefix, old->src->plen),
@@ -401,30 +640,36 @@ kswitch_routes(const struct babel_route *old, const struct babel_route *new)
 
     /* Remove source-specific conflicting routes */
     if(!kernel_disambiguate(v4mapped(old->nexthop))) {
-        stream = route_stream(ROUTE_INSTALLED);
-        if(!stream) {
-            fprintf(stderr, "Couldn't allocate route stream.\n");
-            return -1;
-        }
-        while(1) {
-            rt1 = route_stream_next(stream);
-            if(rt1 == NULL) break;
-
+        n = find_conflicts(old, &conflicting);
+        for(i = 0; i < n; i++) {
+            rt1 = conflicting[i];
             inter(old, rt1, &zone);
-            if(!(conflicts(old, rt1) &&
-                 !is_installed(&zone) &&
-                 rt_cmp(rt1, min_conflict(&zone, old)) == 0 &&
-                 rt_cmp(old, rt1) < 0 &&
-                 rt_cmp(old, min_conflict(&zone, rt1)) == 0))
+            zs = find_solution(&zone);
+            if(zs == NULL || zs->route != old)
                 continue;
             chg_route(&zone, old, new);
+            zs->route = new;
         }
-        route_stream_done(stream);
     }
 
     return rc;
 }
 
+/* Reprogram the kernel route of route in its own zone, which gives it a
+   fresh lifetime. */
+int
+krefresh_route(const struct babel_route *route)
+{
+    int rc;
+    struct zone zone;
+
+    to_zone(route, &zone);
+    rc = chg_route(&zone, route, route);
+    if(rc < 0)
+        perror("kernel_route(MODIFY refresh)");
+    return rc;
+}
+
 int
 kchange_route_metric(const struct babel_route *route,
                      unsigned refmetric, unsigned cost, unsigned add)
@@ -432,8 +677,10 @@ kchange_route_metric(const struct babel_route *route,
     int old_metric = metric_to_kernel(route_metric(route));
     int new_metric = metric_to_kernel(MIN(refmetric + cost + add, INFINITY));
     int rc;
-    struct babel_route *rt1 = NULL;
-    struct route_stream *stream = NULL;
+    const struct babel_route *rt1 = NULL;
+    const struct babel_route **conflicting;
+    struct zone_solution *zs;
+    int i, n;
     struct zone zone;
 
     debugf("change_route_metric(%s from %s, %d -> %d)\n",
@@ -448,27 +695,116 @@ kchange_route_metric(const struct babel_route *route,
     }
 
     if(!kernel_disambiguate(v4mapped(route->nexthop))) {
-        stream = route_stream(ROUTE_INSTALLED);
-        if(!stream) {
-            fprintf(stderr, "Couldn't allocate route stream.\n");
-            return -1;
-        }
-
-        while(1) {
-            rt1 = route_stream_next(stream);
-            if(rt1 == NULL) break;
-
+        /* A zone shows up once for each route that route conflicts
+           with in it; the stamp makes us visit it just once. */
+        solution_stamp++;
+        n = find_conflicts(route, &conflicting);
+        for(i = 0; i < n; i++) {
+            rt1 = conflicting[i];
             inter(route, rt1, &zone);
-            if(!(conflicts(route, rt1) &&
-                 !is_installed(&zone) &&
-                 rt_cmp(rt1, min_conflict(&zone, route)) == 0 &&
-                 rt_cmp(route, rt1) < 0 &&
-                 rt_cmp(route, min_conflict(&zone, rt1)) == 0))
+            zs = find_solution(&zone);
+            if(zs == NULL || zs->route != route ||
+               zs->stamp == solution_stamp)
                 continue;
+            zs->stamp = solution_stamp;
             chg_route_metric(&zone, route, old_metric, new_metric);
         }
-        route_stream_done(stream);
     }
 
     return rc;
 }
+
+/* Whether a conflict zone is installed in the kernel. */
+int
+kzone_installed(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen)
+{
+    struct zone zone;
+
+    zone.dst_prefix = prefix;
+    zone.dst_plen = plen;
+    zone.src_prefix = src_prefix;
+    zone.src_plen = src_plen;
+    return find_solution(&zone) != NULL;
+}
+
+/* Program every installed route and conflict zone again.  The kernel
+   layer doesn't send the requests that would change nothing. */
+void
+kreinstall_routes(void)
+{
+    struct route_stream *routes;
+    struct babel_route *route;
+    struct zone zone;
+    int i;
+
+    routes = route_stream(ROUTE_INSTALLED);
+    if(routes == NULL) {
+        perror("route_stream");
+        return;
+    }
+    while(1) {
+        route = route_stream_next(routes);
+        if(route == NULL)
+            break;
+        to_zone(route, &zone);
+        chg_route(&zone, route, route);
+    }
+    route_stream_done(routes);
+
+    for(i = 0; i < numsolutions; i++) {
+        zone.dst_prefix = solutions[i].dst_prefix;
+        zone.dst_plen = solutions[i].dst_plen;
+        zone.src_prefix = solutions[i].src_prefix;
+        zone.src_plen = solutions[i].src_plen;
+        chg_route(&zone, solutions[i].route, solutions[i].route);
+    }
+}
+
+/* The kernel refused route, which is no longer installed; forget the
+   zones that it was installed in, since we don't know their state, and
+   delete whatever they hold so that the next solution can be added. */
+void
+kforget_route(const struct babel_route *route)
+{
+    const struct babel_route **conflicting;
+    struct zone_solution *zs;
+    struct zone zone;
+    int i, n;
+
+    if(kernel_disambiguate(v4mapped(route->nexthop)))
+        return;
+
+    n = find_conflicts(route, &conflicting);
+    for(i = 0; i < n; i++) {
+        inter(route, conflicting[i], &zone);
+        zs = find_solution(&zone);
+        if(zs != NULL && zs->route == route) {
+            del_route(&zone, route);
+            remove_solution(zs);
+        }
+    }
+}
+
+/* The kernel refused a request for a conflict zone.  Its solution was
+   recorded when the request was queued, and the zone now holds the
+   previous route or none: delete it, and forget the zone until a
+   conflicting route changes. */
+void
+kzone_failed(const struct kernel_route *route)
+{
+    struct zone_solution *zs;
+    struct zone zone;
+
+    zone.dst_prefix = route->prefix;
+    zone.dst_plen = route->plen;
+    zone.src_prefix = route->src_prefix;
+    zone.src_plen = route->src_plen;
+    zs = find_solution(&zone);
+    if(zs == NULL || !v6_equal(zs->route->nexthop, route->gw) ||
+       zs->route->neigh->ifp->ifindex != route->ifindex)
+        return;
+
+    del_route(&zone, zs->route);
+    remove_solution(zs);
+}
@@ -25,6 +25,12 @@ THE SOFTWARE.
 int kinstall_route(const struct babel_route *route);
 int kuninstall_route(const struct babel_route *route);
 int kswitch_routes(const struct babel_route *old, const struct babel_route *new);
+int krefresh_route(const struct babel_route *route);
 int kchange_route_metric(const struct babel_route *route,
                          unsigned refmetric, unsigned cost, unsigned add);
+void kforget_route(const struct babel_route *route);
+void kzone_failed(const struct kernel_route *route);
+int kzone_installed(const unsigned char *prefix, unsigned char plen,
+                    const unsigned char *src_prefix, unsigned char src_plen);
+void kreinstall_routes(void);
 #endif
@@ -43,6 +43,7 @@ THE SOFTWARE.
 #include "configuration.h"
 #include "local.h"
 #include "xroute.h"
+#include "aggregate.h"
 
 struct interface *interfaces = NULL;
 
@@ -123,8 +124,6 @@ flush_interface(char *ifname)
     if(ifp->conf != NULL && ifp->conf != default_interface_conf)
         flush_ifconf(ifp->conf);
 
-    local_notify_interface(ifp, LOCAL_FLUSH);
-
     free(ifp);
 
     return 1;
@@ -424,6 +423,35 @@ interface_up(struct interface *ifp, int up)
         if(IF_CONF(ifp, faraway) == CONFIG_YES)
             ifp->flags |= IF_FARAWAY;
 
+        if(IF_CONF(ifp, fast_failure) == CONFIG_YES)
+            ifp->flags |= IF_FAST_FAILURE;
+        else
+            ifp->flags &= ~IF_FAST_FAILURE;
+
+        if(IF_CONF(ifp, unicast_threshold) > 0)
+            ifp->unicast_threshold = IF_CONF(ifp, unicast_threshold);
+        else if(IF_CONF(ifp, unicast_threshold) < 0)
+            ifp->unicast_threshold = 0;
+        else if(type == IF_TYPE_WIRELESS)
+            ifp->unicast_threshold = 4;
+        else
+            ifp->unicast_threshold = 0;
+        ifp->transport = IF_TRANSPORT_MULTICAST;
+        ifp->transport_reason = TRANSPORT_STARTUP;
+        ifp->transport_time.tv_sec = 0;
+        ifp->transport_time.tv_usec = 0;
+        check_interface_transport(ifp);
+
+        if(IF_CONF(ifp, aggregate) == CONFIG_YES)
+            ifp->flags |= IF_AGGREGATE;
+        else
+            ifp->flags &= ~IF_AGGREGATE;
+
+        if(IF_CONF(ifp, unicast_hello) == CONFIG_YES)
+            ifp->flags |= IF_UNICAST_HELLO;
+        else
+            ifp->flags &= ~IF_UNICAST_HELLO;
+
         if(IF_CONF(ifp, hello_interval) > 0)
             ifp->hello_interval = IF_CONF(ifp, hello_interval);
         else if(type == IF_TYPE_WIRELESS)
@@ -516,6 +544,7 @@ interface_up(struct interface *ifp, int up)
             free(ifp->buffered_updates);
         ifp->buffered_updates = NULL;
         ifp->sendbuf = NULL;
+        flush_announced_aggregates(ifp);
         if(ifp->ifindex > 0) {
             memset(&mreq, 0, sizeof(mreq));
             memcpy(&mreq.ipv6mr_multiaddr, protocol_group, 16);
@@ -543,6 +572,84 @@ interface_up(struct interface *ifp, int up)
     return -1;
 }
 
+static const char *
+transport_reason_name(enum transport_reason reason)
+{
+    switch(reason) {
+    case TRANSPORT_STARTUP: return "startup";
+    case TRANSPORT_DISABLED: return "disabled";
+    case TRANSPORT_MANY_NEIGHBOURS: return "many-neighbours";
+    case TRANSPORT_FEW_NEIGHBOURS: return "few-neighbours";
+    default: return "unknown";
+    }
+}
+
+/* On links where multicast is slow (wireless), it is cheaper to send
+   a copy of each packet to every neighbour as long as there are only a
+   few of them.  Once we have switched to multicast because there were
+   too many neighbours, unicast is only used again when the count drops
+   two below the threshold, and no switch happens less than an update
+   interval after the previous one, to avoid flapping. */
+int
+check_interface_transport(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    int n = 0, transport;
+    enum transport_reason reason;
+
+    if(ifp->unicast_threshold <= 0) {
+        transport = IF_TRANSPORT_MULTICAST;
+        reason = TRANSPORT_DISABLED;
+    } else {
+        FOR_ALL_NEIGHBOURS(neigh) {
+            if(neigh->ifp == ifp)
+                n++;
+        }
+        if(n >= ifp->unicast_threshold) {
+            transport = IF_TRANSPORT_MULTICAST;
+            reason = TRANSPORT_MANY_NEIGHBOURS;
+        } else if(ifp->transport == IF_TRANSPORT_MULTICAST &&
+                  n >= ifp->unicast_threshold - 1 &&
+                  ifp->transport_reason == TRANSPORT_MANY_NEIGHBOURS) {
+            return 0;
+        } else {
+            transport = IF_TRANSPORT_UNICAST;
+            reason = TRANSPORT_FEW_NEIGHBOURS;
+        }
+    }
+
+    if(transport == ifp->transport) {
+        ifp->transport_reason = reason;
+        return 0;
+    }
+
+    if(reason != TRANSPORT_DISABLED &&
+       timeval_minus_msec(&now, &ifp->transport_time) < ifp->update_interval)
+        return 0;
+
+    debugf("Switching %s to %s (%d neighbours, %s).\n", ifp->name,
+           transport == IF_TRANSPORT_UNICAST ? "unicast" : "multicast",
+           n, transport_reason_name(reason));
+    flushbuf(ifp);
+    ifp->transport = transport;
+    ifp->transport_reason = reason;
+    ifp->transport_time = now;
+    local_notify_interface(ifp, LOCAL_CHANGE);
+    return 1;
+}
+
+const char *
+interface_transport(struct interface *ifp)
+{
+    return ifp->transport == IF_TRANSPORT_UNICAST ? "unicast" : "multicast";
+}
+
+const char *
+interface_transport_reason(struct interface *ifp)
+{
+    return transport_reason_name(ifp->transport_reason);
+}
+
 int
 interface_ll_address(struct interface *ifp, const unsigned char *address)
 {
@@ -21,6 +21,8 @@ THE SOFTWARE.
 */
 #ifndef _BABEL_INTERFACE
 #define _BABEL_INTERFACE
+struct aggregate;
+
 struct buffered_update {
     unsigned char id[8];
     unsigned char prefix[16];
@@ -47,7 +49,11 @@ struct interface_conf {
     char split_horizon;
     char lq;
     char faraway;
+    char fast_failure;
+    char unicast_hello;
+    char aggregate;
     int channel;
+    int unicast_threshold;
     int enable_timestamps;
     unsigned int rtt_decay;
     unsigned int rtt_min;
@@ -72,6 +78,26 @@ struct interface_conf {
 #define IF_FARAWAY (1 << 4)
 /* Send timestamps in Hello and IHU. */
 #define IF_TIMESTAMPS (1 << 5)
+/* Probe silent neighbours at an accelerated rate. */
+#define IF_FAST_FAILURE (1 << 6)
+/* Use unicast Hellos with neighbours that understand them. */
+#define IF_UNICAST_HELLO (1 << 7)
+/* Announce aggregates to neighbours that understand them. */
+#define IF_AGGREGATE (1 << 8)
+/* Given on the command line, kept when the configuration drops it. */
+#define IF_CMDLINE (1 << 9)
+
+/* How packets sent to the interface buffer reach the neighbours. */
+#define IF_TRANSPORT_MULTICAST 0
+#define IF_TRANSPORT_UNICAST 1
+
+/* Why the current transport was chosen. */
+enum transport_reason {
+    TRANSPORT_STARTUP = 0,
+    TRANSPORT_DISABLED,
+    TRANSPORT_MANY_NEIGHBOURS,
+    TRANSPORT_FEW_NEIGHBOURS
+};
 
 /* Only INTERFERING can appear on the wire. */
 #define IF_CHANNEL_UNKNOWN 0
@@ -122,6 +148,15 @@ struct interface {
     unsigned int rtt_min;
     unsigned int rtt_max;
     unsigned int max_rtt_penalty;
+    /* Use unicast with fewer neighbours than this, 0 to never do it. */
+    int unicast_threshold;
+    int transport;
+    enum transport_reason transport_reason;
+    struct timeval transport_time;
+    /* Aggregates announced on this interface, see aggregate.c. */
+    struct aggregate *aggregates;
+    int numaggregates;
+    int maxaggregates;
 };
 
 #define IF_CONF(_ifp, _field) \
@@ -145,4 +180,7 @@ void set_timeout(struct timeval *timeout, int msecs);
 int interface_up(struct interface *ifp, int up);
 int interface_ll_address(struct interface *ifp, const unsigned char *address);
 void check_interfaces(void);
+int check_interface_transport(struct interface *ifp);
+const char *interface_transport(struct interface *ifp);
+const char *interface_transport_reason(struct interface *ifp);
 #endif
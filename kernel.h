@@ -21,6 +21,7 @@ THE SOFTWARE.
 */
 #ifndef _BABEL_KERNEL
 #define _BABEL_KERNEL
+#include <stdio.h>
 #include <netinet/in.h>
 #include "babeld.h"
 
@@ -49,6 +50,8 @@ struct kernel_addr {
 
 struct kernel_link {
     char *ifname;
+    int ifindex;
+    int up;                     /* operational, as per link_detect */
 };
 
 struct kernel_rule {
@@ -68,12 +71,32 @@ struct kernel_filter {
     void *link_closure;
     int (*rule)(struct kernel_rule *, void *);
     void *rule_closure;
+    /* If non-zero, only dump the addresses of this interface. */
+    int ifindex;
+};
+
+/* One next hop of a multipath route; the kernel splits the traffic in
+   proportion to the weights. */
+#define KERNEL_MAX_MULTIPATH 8
+
+struct kernel_multipath {
+    unsigned char gate[16];
+    unsigned int ifindex;
+    int weight;
 };
 
 #define ROUTE_FLUSH 0
 #define ROUTE_ADD 1
 #define ROUTE_MODIFY 2
 
+/* A queued route operation that the kernel refused. */
+struct kernel_route_error {
+    int operation;
+    int table;
+    int error;
+    struct kernel_route route;
+};
+
 #define CHANGE_LINK  (1 << 0)
 #define CHANGE_ROUTE (1 << 1)
 #define CHANGE_ADDR  (1 << 2)
@@ -102,17 +125,34 @@ int kernel_route(int operation, int table,
                  const unsigned char *src, unsigned short src_plen,
                  const unsigned char *gate, int ifindex, unsigned int metric,
                  const unsigned char *newgate, int newifindex,
-                 unsigned int newmetric, int newtable);
+                 unsigned int newmetric, int newtable,
+                 const unsigned char *backup, int backup_ifindex,
+                 const struct kernel_multipath *paths, int numpaths,
+                 int expires);
+int kernel_flush_routes(void);
+int kernel_check_fib(void);
+void kernel_route_callback(int (*failed)(struct kernel_route_error *, void *),
+                           void *closure);
+/* How kernel_check_fib consults the RIB: wanted says whether it has
+   installed a route of ours found in table, reinstall has it program
+   all of its routes again. */
+void kernel_fib_callback(int (*wanted)(int, struct kernel_route *, void *),
+                         void (*reinstall)(void *), void *closure);
 int kernel_dump(int operation, struct kernel_filter *filter);
 int kernel_callback(struct kernel_filter *filter);
+void kernel_print_stats(FILE *out);
 int if_eui64(char *ifname, int ifindex, unsigned char *eui);
 int gettime(struct timeval *tv);
 int read_random_bytes(void *buf, int len);
 int kernel_older_than(const char *sysname, int version, int sub_version);
 int kernel_has_ipv6_subtrees(void);
+int kernel_has_nexthops(void);
+int kernel_flush_nexthop(const unsigned char *gate, int ifindex);
+int kernel_failover_nexthop(const unsigned char *gate, int ifindex);
 int add_rule(int prio, const unsigned char *src_prefix, int src_plen,
              int table);
-int flush_rule(int prio, int family);
-int change_rule(int new_prio, int old_prio, const unsigned char *src, int plen,
-                int table);
+int flush_rule(int prio, const unsigned char *src_prefix, int src_plen,
+               int table);
+int change_rules(const struct kernel_rule *old, const struct kernel_rule *new,
+                 int n);
 #endif
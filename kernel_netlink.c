@@ -42,6 +42,7 @@ THE SOFTWARE.
 #include <linux/rtnetlink.h>
 #include <linux/if_bridge.h>
 #include <linux/fib_rules.h>
+#include <linux/nexthop.h>
 #include <linux/filter.h>
 #include <net/if_arp.h>
 #include <sched.h>
@@ -50,7 +51,10 @@ THE SOFTWARE.
 #include "kernel.h"
 #include "util.h"
 #include "interface.h"
+#include "route.h"
+#include "rule.h"
 #include "configuration.h"
+#include "netlink_trace.h"
 
 // enum only exported by linux 4.10+
 
@@ -103,6 +107,10 @@ int num_old_if = 0;
 
 static int dgram_socket = -1;
 
+/* Whether the kernel filters dumps by the header of the request (Linux
+   4.20 and later), instead of ignoring it. */
+static int nl_strict = 0;
+
 #ifndef ARPHRD_ETHER
 #warning ARPHRD_ETHER not defined, we might not support exotic link layers
 #define ARPHRD_ETHER 1
@@ -110,6 +118,12 @@ static int dgram_socket = -1;
 #endif
 
 static int filter_netlink(struct nlmsghdr *nh, struct kernel_filter *filter);
+static int fib_ack(struct nlmsghdr *nh);
+static struct rtattr *nexthop_rta(struct nlmsghdr *nh, int type,
+                                  const void *data, int len);
+static void nexthop_hold(unsigned int id);
+static void nexthop_release(unsigned int id);
+static void nexthop_failed(unsigned int id, int error);
 
 
 /* Determine an interface's hardware address, in modified EUI-64 format */
@@ -229,8 +243,17 @@ struct netlink {
     int sock;
     struct sockaddr_nl sockaddr;
     socklen_t socklen;
+    /* The receive buffer, kept across reads and grown as needed. */
+    char *buf;
+    int bufsize;
+    /* Statistics. */
+    unsigned long messages, bytes, overruns;
+    unsigned long last_messages;
+    time_t last_time;
 };
 
+#define NETLINK_MIN_BUFSIZE (32 * 1024)
+
 static struct netlink nl_command = { 0, -1, {0}, 0 };
 static struct netlink nl_listen = { 0, -1, {0}, 0 };
 static int nl_setup = 0;
@@ -279,6 +302,16 @@ netlink_socket(struct netlink *nl, uint32_t groups)
          perror("setsockopt(SO_SNDBUF)");
         }
 
+#ifdef NETLINK_GET_STRICT_CHK
+    /* Only the command socket sends dump requests. */
+    if(groups == 0) {
+        int one = 1;
+        rc = setsockopt(nl->sock, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+                        &one, sizeof(one));
+        nl_strict = (rc >= 0);
+    }
+#endif
+
     rc = bind(nl->sock, (struct sockaddr *)&nl->sockaddr, nl->socklen);
     if(rc < 0)
         goto fail;
@@ -299,6 +332,57 @@ netlink_socket(struct netlink *nl, uint32_t groups)
     }
 }
 
+/* Receive one datagram into nl->buf.  Its size is found out first, so
+   that the buffer can grow instead of truncating it.  Returns its length,
+   or -1 with errno set; the socket is non-blocking. */
+static int
+netlink_recv(struct netlink *nl, struct msghdr *msg)
+{
+    struct iovec iov;
+    int len;
+
+    do {
+        len = recv(nl->sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    } while(len < 0 && errno == EINTR);
+    if(len < 0)
+        goto fail;
+
+    if(nl->buf == NULL || len > nl->bufsize) {
+        int size = MAX(nl->bufsize, NETLINK_MIN_BUFSIZE);
+        char *new_buf;
+        while(size < len)
+            size *= 2;
+        new_buf = realloc(nl->buf, size);
+        if(new_buf == NULL)
+            return -1;
+        kdebugf("netlink_recv: %d byte buffer.\n", size);
+        nl->buf = new_buf;
+        nl->bufsize = size;
+    }
+
+    iov.iov_base = nl->buf;
+    iov.iov_len = nl->bufsize;
+    msg->msg_iov = &iov;
+    msg->msg_iovlen = 1;
+
+    do {
+        len = recvmsg(nl->sock, msg, 0);
+    } while(len < 0 && errno == EINTR);
+    msg->msg_iov = NULL;
+    msg->msg_iovlen = 0;
+    if(len < 0)
+        goto fail;
+
+    nl->messages++;
+    nl->bytes += len;
+    return len;
+
+ fail:
+    if(errno == ENOBUFS)
+        nl->overruns++;
+    return -1;
+}
+
 static int
 netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
              struct kernel_filter *filter)
@@ -310,123 +394,1191 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
     /*  from 'nl_command' while reading 'nl_listen'                          */
 
     /* Return code :                                       */
+    /* -2 : receive buffer overrun, messages were lost     */
     /* -1 : error                                          */
     /*  0 : success                                        */
 
     int err;
     struct msghdr msg;
     struct sockaddr_nl nladdr;
-    struct iovec iov;
     struct nlmsghdr *nh;
     int len;
     int done = 0;
     int skip = 0;
+    int waits = 0;
+
+    do {
+        memset(&nladdr, 0, sizeof(nladdr));
+        nladdr.nl_family = AF_NETLINK;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &nladdr;
+        msg.msg_namelen = sizeof(nladdr);
+
+        len = netlink_recv(nl, &msg);
+
+        if(len < 0 && errno == EAGAIN) {
+            /* Notifications are read when the socket is readable, so
+               there is nothing left; answers may take a little while. */
+            if(!answer)
+                return 0;
+            if(waits++ < 5 && wait_for_fd(0, nl->sock, 200) >= 0)
+                continue;
+        }
+
+        if(len < 0) {
+            if(errno == ENOBUFS) {
+                /* The kernel dropped messages for us.  A dump in progress
+                   is lost, notifications must be made up for by dumping
+                   again; tell the caller. */
+                fprintf(stderr, "netlink_read: receive buffer overrun.\n");
+                errno = ENOBUFS;
+                return -2;
+            }
+            perror("netlink_read: recvmsg()");
+            return -1;
+        } else if(len == 0) {
+            fprintf(stderr, "netlink_read: EOF\n");
+            goto socket_error;
+        } else if(msg.msg_namelen != nl->socklen) {
+            fprintf(stderr,
+                    "netlink_read: unexpected sender address length (%d)\n",
+                    msg.msg_namelen);
+            goto socket_error;
+        } else if(nladdr.nl_pid != 0) {
+            kdebugf("netlink_read: message not sent by kernel.\n");
+            return -1;
+        }
+
+        kdebugf("Netlink message: ");
+
+        for(nh = (struct nlmsghdr *)nl->buf;
+            NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+            kdebugf("%s{seq:%d}", (nh->nlmsg_flags & NLM_F_MULTI) ? "[multi] " : "",
+                    nh->nlmsg_seq);
+            if(!answer)
+                done = 1;
+            if(nl_ignore && nh->nlmsg_pid == nl_ignore->sockaddr.nl_pid) {
+                fprintf(stderr,"Message from self - we should not see this more than twice - ever\n");
+		kdebugf("(ignore), ");
+                continue;
+            } else if(answer && nl == &nl_command &&
+                      nh->nlmsg_seq != nl->seqno && fib_ack(nh)) {
+                kdebugf("(route ACK %d), ", nh->nlmsg_seq);
+                continue;
+            } else if(answer && (nh->nlmsg_pid != nl->sockaddr.nl_pid ||
+                                 nh->nlmsg_seq != nl->seqno)) {
+                kdebugf("(wrong seqno %d %d /pid %d %d), ",
+                        nh->nlmsg_seq, nl->seqno,
+                        nh->nlmsg_pid, nl->sockaddr.nl_pid);
+                continue;
+            } else if(nh->nlmsg_type == NLMSG_DONE) {
+                kdebugf("(done)\n");
+                done = 1;
+                break;
+            } else if(nh->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nh);
+                if(err->error == 0) {
+                    kdebugf("(ACK)\n");
+                    return 0;
+                } else {
+                    kdebugf("netlink_read: %s\n", strerror(-err->error));
+                    errno = -err->error;
+                    return -1;
+                }
+            } else if(skip) {
+                kdebugf("(skip)");
+            } if(filter) {
+                kdebugf("(msg -> \"");
+                err = filter_netlink(nh, filter);
+                kdebugf("\" %d), ", err);
+                if(err < 0) skip = 1;
+                continue;
+            }
+            kdebugf(", ");
+        }
+        kdebugf("\n");
+
+    } while(!done);
+
+    return 0;
+
+ socket_error:
+    close(nl->sock);
+    nl->sock = -1;
+    errno = EIO;
+    return -1;
+}
+
+/* The shadow FIB: every route that we have asked the kernel for, indexed
+   by (table, destination, source), together with the request itself.  A
+   request identical to the one that installed a route would not change
+   anything, and is not sent.  Deletions are always sent.
+
+   The shadow forgets routes when in doubt, but it can hold routes that
+   the kernel dropped without telling us: when a link goes down, the
+   kernel deletes the IPv4 routes through it, and the nexthop objects on
+   it, without RTM_DELROUTE.  So the routes through a link are forgotten
+   when it goes down, and notifications that were lost cause the kernel
+   tables to be checked by kernel_check_fib, which can also be requested
+   from the local interface.  Since the shadow forgets, it cannot say
+   which routes are strays: that is for the RIB to decide. */
+
+struct fib_shadow {
+    int table;
+    unsigned char prefix[16];
+    unsigned char src_prefix[16];
+    unsigned char plen;
+    unsigned char src_plen;
+    unsigned char seen;
+    int priority;
+    unsigned int nexthop;       /* the nexthop object it uses, or 0 */
+    int len;
+    struct rtmsg *request;      /* followed by its attributes */
+};
+
+static struct fib_shadow *shadow = NULL;
+static int numshadow = 0, maxshadow = 0;
+
+/* Our routes found in the kernel but not in the shadow. */
+static struct fib_shadow *strays = NULL;
+static int numstrays = 0, maxstrays = 0;
+static int fib_checking = 0;
+
+static void
+shadow_key(struct fib_shadow *key, int table,
+           const unsigned char *dest, unsigned short plen,
+           const unsigned char *src, unsigned short src_plen)
+{
+    memset(key, 0, sizeof(*key));
+    key->table = table;
+    memcpy(key->prefix, dest, 16);
+    key->plen = plen;
+    if(src_plen > 0)
+        memcpy(key->src_prefix, src, 16);
+    key->src_plen = src_plen;
+}
+
+static int
+shadow_compare(const struct fib_shadow *a, const struct fib_shadow *b)
+{
+    int rc;
+
+    if(a->table != b->table)
+        return a->table < b->table ? -1 : 1;
+    rc = memcmp(a->prefix, b->prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(a->plen != b->plen)
+        return a->plen < b->plen ? -1 : 1;
+    rc = memcmp(a->src_prefix, b->src_prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(a->src_plen != b->src_plen)
+        return a->src_plen < b->src_plen ? -1 : 1;
+    return 0;
+}
+
+/* Performs binary search, returns -1 in case of failure.  In the latter
+   case, new_return is the place where to insert the new element. */
+static int
+find_shadow(const struct fib_shadow *key, int *new_return)
+{
+    int p = 0, g = numshadow - 1, m, c;
+
+    while(p <= g) {
+        m = (p + g) / 2;
+        c = shadow_compare(key, &shadow[m]);
+        if(c == 0)
+            return m;
+        else if(c < 0)
+            g = m - 1;
+        else
+            p = m + 1;
+    }
+
+    if(new_return)
+        *new_return = p;
+    return -1;
+}
+
+static void
+drop_shadow(int i)
+{
+    nexthop_release(shadow[i].nexthop);
+    free(shadow[i].request);
+    if(i < numshadow - 1)
+        memmove(shadow + i, shadow + i + 1,
+                (numshadow - i - 1) * sizeof(struct fib_shadow));
+    numshadow--;
+}
+
+/* Returns 1 if rtm is the request that installed the route already,
+   otherwise records it and returns 0. */
+static int
+shadow_update(const struct fib_shadow *key, int priority,
+              unsigned int nexthop, const struct rtmsg *rtm, int len)
+{
+    struct rtmsg *request;
+    int i, n = 0;
+
+    i = find_shadow(key, &n);
+    if(i >= 0 && shadow[i].len == len &&
+       memcmp(shadow[i].request, rtm, len) == 0)
+        return 1;
+
+    request = malloc(len);
+    if(request == NULL) {
+        /* Better forget the route than remember it wrong. */
+        if(i >= 0)
+            drop_shadow(i);
+        return 0;
+    }
+    memcpy(request, rtm, len);
+    /* Take the new reference first, the nexthop may well be the same. */
+    nexthop_hold(nexthop);
+
+    if(i < 0) {
+        if(numshadow >= maxshadow) {
+            struct fib_shadow *new_shadow;
+            int m = maxshadow < 1 ? 8 : 2 * maxshadow;
+            new_shadow = realloc(shadow, m * sizeof(struct fib_shadow));
+            if(new_shadow == NULL) {
+                nexthop_release(nexthop);
+                free(request);
+                return 0;
+            }
+            shadow = new_shadow;
+            maxshadow = m;
+        }
+        if(n < numshadow)
+            memmove(shadow + n + 1, shadow + n,
+                    (numshadow - n) * sizeof(struct fib_shadow));
+        numshadow++;
+        i = n;
+        shadow[i] = *key;
+    } else {
+        nexthop_release(shadow[i].nexthop);
+        free(shadow[i].request);
+    }
+
+    shadow[i].priority = priority;
+    shadow[i].nexthop = nexthop;
+    shadow[i].len = len;
+    shadow[i].request = request;
+    shadow[i].seen = 0;
+    return 0;
+}
+
+/* A priority of -1 matches any route. */
+static void
+shadow_forget(const struct fib_shadow *key, int priority)
+{
+    int i = find_shadow(key, NULL);
+    if(i >= 0 && (priority < 0 || shadow[i].priority == priority))
+        drop_shadow(i);
+}
+
+static void
+shadow_forget_route(int table, const struct kernel_route *route)
+{
+    struct fib_shadow key;
+    int ipv4 = v4mapped(route->prefix);
+    shadow_key(&key, table, route->prefix, route->plen, route->src_prefix,
+               kernel_disambiguate(ipv4) ? route->src_plen : 0);
+    shadow_forget(&key, -1);
+}
+
+/* Deleting a nexthop object deletes the routes that use it. */
+static void
+shadow_forget_nexthop(unsigned int id)
+{
+    int i = 0;
+
+    while(i < numshadow) {
+        if(shadow[i].nexthop == id)
+            drop_shadow(i);
+        else
+            i++;
+    }
+}
+
+static void
+flush_shadow(void)
+{
+    int i;
+
+    for(i = 0; i < numshadow; i++) {
+        nexthop_release(shadow[i].nexthop);
+        free(shadow[i].request);
+    }
+    free(shadow);
+    shadow = NULL;
+    numshadow = maxshadow = 0;
+}
+
+/* Route operations are not sent one at a time: they are queued, and the
+   whole queue goes out in a single sendmsg at most once per main loop
+   iteration.  Each message asks for an ACK, which is matched
+   asynchronously against the pending requests by seqno. */
+
+#define FIB_QUEUE_SIZE (32 * 1024)
+#define FIB_QUEUE_MAX 256
+
+/* Pseudo-operations for nexthop objects, which share the queue. */
+#define FIB_NEXTHOP (-1)
+#define FIB_NEXTHOP_FLUSH (-2)
+
+struct fib_request {
+    unsigned short seqno;
+    /* metric is the kernel priority, or the id of a nexthop object. */
+    struct kernel_route_error status;
+};
+
+static union {
+    char raw[FIB_QUEUE_SIZE];
+    struct nlmsghdr nh;
+} fib_queue;
+static int fib_queue_len = 0;
+
+/* The first fib_numsent requests have been sent and await their ACK. */
+static struct fib_request fib_requests[FIB_QUEUE_MAX];
+static int fib_numrequests = 0, fib_numsent = 0;
+
+static int numnexthops = 0;
+
+static int (*fib_failed)(struct kernel_route_error *, void *) = NULL;
+static void *fib_failed_closure = NULL;
+
+void
+kernel_route_callback(int (*failed)(struct kernel_route_error *, void *),
+                      void *closure)
+{
+    fib_failed = failed;
+    fib_failed_closure = closure;
+}
+
+static int (*fib_wanted)(int, struct kernel_route *, void *) = NULL;
+static void (*fib_reinstall)(void *) = NULL;
+static void *fib_check_closure = NULL;
+
+void
+kernel_fib_callback(int (*wanted)(int, struct kernel_route *, void *),
+                    void (*reinstall)(void *), void *closure)
+{
+    fib_wanted = wanted;
+    fib_reinstall = reinstall;
+    fib_check_closure = closure;
+}
+
+static void
+fib_report(struct fib_request *request, int error)
+{
+    struct kernel_route *route = &request->status.route;
+
+    /* The route is already there, which the synchronous code always
+       took for success. */
+    if(request->status.operation == ROUTE_ADD && error == EEXIST) {
+        trace_route_status(request->seqno, 0, 0);
+        return;
+    }
+
+    if(request->status.operation >= 0)
+        trace_route_status(request->seqno, -1, error);
+    request->status.error = error;
+    if(request->status.operation == FIB_NEXTHOP_FLUSH) {
+        if(error != ENOENT)
+            fprintf(stderr, "kernel_route: delete nexthop via %s: %s\n",
+                    format_address(route->gw), strerror(error));
+        return;
+    } else if(request->status.operation == FIB_NEXTHOP) {
+        nexthop_failed(route->metric, error);
+        return;
+    }
+    /* A failed deletion may leave the route behind; since deletions are
+       always sent, forgetting it is safe either way. */
+    shadow_forget_route(request->status.table, route);
+    if(request->status.operation == ROUTE_FLUSH && error == ESRCH)
+        kdebugf("kernel_route: flush %s: already gone.\n",
+                format_prefix(route->prefix, route->plen));
+    else
+        fprintf(stderr, "kernel_route: %s %s from %s table %d: %s\n",
+                request->status.operation == ROUTE_ADD ? "add" :
+                request->status.operation == ROUTE_FLUSH ? "flush" :
+                request->status.operation == ROUTE_MODIFY ? "modify" : "???",
+                format_prefix(route->prefix, route->plen),
+                format_prefix(route->src_prefix, route->src_plen),
+                request->status.table, strerror(error));
+    if(fib_failed)
+        fib_failed(&request->status, fib_failed_closure);
+}
+
+/* Forget every request that was sent, reporting it with error if non-zero.
+   Used when the ACKs can no longer arrive. */
+static void
+fib_drop_sent(int error)
+{
+    int i, n = fib_numsent;
+
+    if(n == 0)
+        return;
+    fib_numsent = 0;
+    fib_numrequests -= n;
+    for(i = 0; i < n; i++) {
+        if(error)
+            fib_report(&fib_requests[i], error);
+        else if(fib_requests[i].status.operation >= 0) {
+            /* We don't know whether it was applied. */
+            trace_route_status(fib_requests[i].seqno, 2, 0);
+            shadow_forget_route(fib_requests[i].status.table,
+                                &fib_requests[i].status.route);
+        }
+    }
+    memmove(fib_requests, fib_requests + n,
+            fib_numrequests * sizeof(struct fib_request));
+}
+
+/* The deletion of our route at key's destination, source and priority,
+   whatever its next hops. */
+static void
+fib_delete_message(struct nlmsghdr *nh, const struct fib_shadow *key)
+{
+    struct rtmsg *rtm;
+    int ipv4 = v4mapped(key->prefix);
+    int table = key->table;
+
+    memset(nh, 0, NLMSG_LENGTH(sizeof(struct rtmsg)));
+    nh->nlmsg_type = RTM_DELROUTE;
+    nh->nlmsg_flags = NLM_F_REQUEST;
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    rtm = NLMSG_DATA(nh);
+    rtm->rtm_family = ipv4 ? AF_INET : AF_INET6;
+    rtm->rtm_dst_len = ipv4 ? key->plen - 96 : key->plen;
+    rtm->rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+    rtm->rtm_protocol = RTPROT_BABEL;
+    rtm->rtm_scope = RT_SCOPE_NOWHERE;
+
+    /* Without a gateway, this deletes every member of a multipath
+       route. */
+    nexthop_rta(nh, RTA_DST, ipv4 ? key->prefix + 12 : key->prefix,
+                ipv4 ? sizeof(struct in_addr) : sizeof(struct in6_addr));
+    if(key->src_plen > 0) {
+        rtm->rtm_src_len = ipv4 ? key->src_plen - 96 : key->src_plen;
+        nexthop_rta(nh, RTA_SRC,
+                    ipv4 ? key->src_prefix + 12 : key->src_prefix,
+                    ipv4 ? sizeof(struct in_addr) : sizeof(struct in6_addr));
+    }
+    nexthop_rta(nh, RTA_PRIORITY, &key->priority, sizeof(int));
+    nexthop_rta(nh, RTA_TABLE, &table, sizeof(int));
+
+}
+
+/* A failed NLM_F_REPLACE leaves the previous route in the kernel, while
+   our caller will take the route as gone and add it again if it still
+   wants it.  So delete it, right away: requests still in the queue were
+   made before the failure was known. */
+static void
+fib_replace_failed(const struct fib_request *request)
+{
+    union { char raw[256]; struct nlmsghdr nh; } buf;
+    const struct kernel_route *route = &request->status.route;
+    struct sockaddr_nl nladdr;
+    struct fib_shadow key;
+    struct fib_request *sent;
+    int rc, ipv4 = v4mapped(route->prefix);
+
+    if(fib_numrequests >= FIB_QUEUE_MAX) {
+        fprintf(stderr, "kernel_route: couldn't delete %s after a failed "
+                "replace.\n", format_prefix(route->prefix, route->plen));
+        return;
+    }
+
+    shadow_key(&key, request->status.table, route->prefix, route->plen,
+               route->src_prefix,
+               kernel_disambiguate(ipv4) ? route->src_plen : 0);
+    key.priority = route->metric;
+    fib_delete_message(&buf.nh, &key);
+    buf.nh.nlmsg_flags |= NLM_F_ACK;
+    buf.nh.nlmsg_seq = ++nl_command.seqno;
+
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+    rc = sendto(nl_command.sock, buf.raw, buf.nh.nlmsg_len, MSG_DONTWAIT,
+                (struct sockaddr*)&nladdr, sizeof(nladdr));
+    if(rc < 0) {
+        perror("kernel_route: send");
+        return;
+    }
+
+    /* It went out before the requests still queued. */
+    memmove(fib_requests + fib_numsent + 1, fib_requests + fib_numsent,
+            (fib_numrequests - fib_numsent) * sizeof(struct fib_request));
+    sent = &fib_requests[fib_numsent];
+    memset(sent, 0, sizeof(*sent));
+    sent->seqno = buf.nh.nlmsg_seq;
+    sent->status.operation = ROUTE_FLUSH;
+    sent->status.table = key.table;
+    sent->status.route = *route;
+    memset(sent->status.route.gw, 0, 16);
+    sent->status.route.ifindex = 0;
+    fib_numsent++;
+    fib_numrequests++;
+}
+
+/* Returns 1 if nh acknowledged a queued route operation. */
+static int
+fib_ack(struct nlmsghdr *nh)
+{
+    struct nlmsgerr *err;
+    struct fib_request request;
+    int i;
+
+    if(nh->nlmsg_type != NLMSG_ERROR ||
+       nh->nlmsg_pid != nl_command.sockaddr.nl_pid)
+        return 0;
+
+    for(i = 0; i < fib_numsent; i++) {
+        if(fib_requests[i].seqno == nh->nlmsg_seq)
+            break;
+    }
+    if(i >= fib_numsent)
+        return 0;
+
+    request = fib_requests[i];
+    memmove(fib_requests + i, fib_requests + i + 1,
+            (fib_numrequests - i - 1) * sizeof(struct fib_request));
+    fib_numsent--;
+    fib_numrequests--;
+
+    err = (struct nlmsgerr *)NLMSG_DATA(nh);
+    if(err->error == 0 && request.status.operation >= 0)
+        trace_route_status(request.seqno, 0, 0);
+    if(err->error != 0) {
+        if(request.status.operation == ROUTE_MODIFY)
+            fib_replace_failed(&request);
+        fib_report(&request, -err->error);
+    }
+    return 1;
+}
+
+/* Read the ACKs that are available without blocking.  Since the kernel
+   processes route requests synchronously, all of them are normally
+   waiting by the time sendmsg returns. */
+static void
+fib_read_acks(void)
+{
+    struct msghdr msg;
+    struct nlmsghdr *nh;
+    int len;
+
+    while(fib_numsent > 0) {
+        memset(&msg, 0, sizeof(msg));
+        len = netlink_recv(&nl_command, &msg);
+        if(len < 0) {
+            if(errno == ENOBUFS) {
+                /* Some ACKs were dropped, and we cannot know which. */
+                fprintf(stderr, "kernel_route: lost ACKs for %d routes.\n",
+                        fib_numsent);
+                fib_drop_sent(0);
+            } else if(errno != EAGAIN) {
+                perror("kernel_route: recv");
+            }
+            break;
+        }
+        for(nh = (struct nlmsghdr *)nl_command.buf;
+            NLMSG_OK(nh, len);
+            nh = NLMSG_NEXT(nh, len)) {
+            if(!fib_ack(nh))
+                kdebugf("kernel_route: stray message seq %d type %d.\n",
+                        nh->nlmsg_seq, nh->nlmsg_type);
+        }
+    }
+}
+
+static int
+fib_flush(void)
+{
+    struct sockaddr_nl nladdr;
+    struct msghdr msg;
+    struct iovec iov;
+    int rc, i, errors = 0;
+
+    if(nl_command.sock < 0) {
+        /* The socket was closed after an error, with our ACKs in it. */
+        fib_drop_sent(0);
+        if(fib_numrequests > 0) {
+            for(i = 0; i < fib_numrequests; i++)
+                fib_report(&fib_requests[i], EIO);
+            fib_numrequests = 0;
+            fib_queue_len = 0;
+        }
+        return -1;
+    }
+
+    if(fib_numsent > 0)
+        fib_read_acks();
+
+    if(fib_queue_len == 0)
+        return 0;
+
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &nladdr;
+    msg.msg_namelen = sizeof(nladdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    iov.iov_base = fib_queue.raw;
+    iov.iov_len = fib_queue_len;
+
+    kdebugf("Sending %d route requests (%d bytes).\n",
+            fib_numrequests - fib_numsent, fib_queue_len);
+
+    do {
+        rc = sendmsg(nl_command.sock, &msg, MSG_DONTWAIT);
+        if(rc < 0) {
+            errors++;
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == ENOBUFS) {
+                wait_for_fd(1, nl_command.sock, 5);
+                continue;
+            }
+            break;
+        }
+    } while(rc < 0 && errors < 5);
+
+    if(rc < fib_queue_len) {
+        int saved_errno = rc < 0 ? errno : EIO;
+        perror("kernel_route: sendmsg");
+        for(i = fib_numsent; i < fib_numrequests; i++)
+            fib_report(&fib_requests[i], saved_errno);
+        fib_numrequests = fib_numsent;
+        fib_queue_len = 0;
+        errno = saved_errno;
+        return -1;
+    }
+
+    fib_queue_len = 0;
+    fib_numsent = fib_numrequests;
+    fib_read_acks();
+    return 0;
+}
+
+static int
+fib_queue_request(struct nlmsghdr *nh, int operation, int table,
+                  const unsigned char *dest, unsigned short plen,
+                  const unsigned char *src, unsigned short src_plen,
+                  const unsigned char *gate, int ifindex, unsigned int metric)
+{
+    struct fib_request *request;
+    int len = NLMSG_ALIGN(nh->nlmsg_len);
+
+    if(fib_queue_len + len > FIB_QUEUE_SIZE ||
+       fib_numrequests >= FIB_QUEUE_MAX)
+        fib_flush();
+
+    if(fib_numrequests >= FIB_QUEUE_MAX) {
+        /* ACKs that never came; give up on them. */
+        fprintf(stderr, "kernel_route: no ACK for %d routes.\n",
+                fib_numsent);
+        fib_drop_sent(0);
+    }
+
+    nh->nlmsg_flags |= NLM_F_ACK;
+    nh->nlmsg_seq = ++nl_command.seqno;
+    memcpy(fib_queue.raw + fib_queue_len, nh, nh->nlmsg_len);
+    fib_queue_len += len;
+
+    request = &fib_requests[fib_numrequests++];
+    memset(request, 0, sizeof(*request));
+    request->seqno = nh->nlmsg_seq;
+    request->status.operation = operation;
+    request->status.table = table;
+    memcpy(request->status.route.prefix, dest, 16);
+    request->status.route.plen = plen;
+    if(src_plen > 0)
+        memcpy(request->status.route.src_prefix, src, 16);
+    request->status.route.src_plen = src_plen;
+    memcpy(request->status.route.gw, gate, 16);
+    request->status.route.ifindex = ifindex;
+    request->status.route.metric = metric;
+    return 0;
+}
+
+/* Kernel nexthop objects, one per gateway.  Routes refer to them by id,
+   so removing a nexthop takes every route through it out of the FIB in
+   a single operation.
+
+   With fast reroute, a route refers instead to a group for its primary
+   and backup gateways, which contains just the primary.  When the
+   primary goes away, every group using it is repointed at its backup,
+   which moves the traffic of all the affected routes at once.
+
+   A nexthop is referenced by the routes of the shadow that use it, and
+   by the groups it is a member of.  Unreferenced nexthops are deleted
+   once per main loop iteration, so that a route that moves from one
+   nexthop to another within an iteration doesn't cause any churn.
+
+   The ids live in a range of their own for each instance, derived from
+   the netlink port id; objects are created exclusively, so that a clash
+   with somebody else's fails rather than replacing theirs. */
+
+#define NEXTHOP_ID_RANGE 0x100000
+
+struct kernel_nexthop {
+    unsigned int id;
+    int refcount;
+    unsigned char gate[16];
+    int ifindex;
+    /* A group forwards to gate until it fails over to backup. */
+    unsigned char group;
+    unsigned char failed;
+    unsigned char backup[16];
+    int backup_ifindex;
+};
+
+static struct kernel_nexthop *nexthops = NULL;
+static int maxnexthops = 0;
+static unsigned int nexthop_base = 0, nexthop_serial = 0;
+
+/* Move to the next range of ids, keeping the high bit set. */
+static void
+next_nexthop_range(void)
+{
+    unsigned int range = nexthop_base == 0 ?
+        nl_command.sockaddr.nl_pid : nexthop_base / NEXTHOP_ID_RANGE + 1;
+    nexthop_base = 0x80000000 | ((range * NEXTHOP_ID_RANGE) & 0x7FFFFFFF);
+    nexthop_serial = 0;
+}
+
+static struct rtattr *
+nexthop_rta(struct nlmsghdr *nh, int type, const void *data, int len)
+{
+    struct rtattr *rta =
+        (struct rtattr *)((char*)nh + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+    return rta;
+}
+
+/* For a group, member is the id of the nexthop it should forward to. */
+static int
+nexthop_message(int type, const struct kernel_nexthop *nexthop,
+                unsigned int member)
+{
+    union { char raw[128]; struct nlmsghdr nh; } buf;
+    struct nhmsg *nhm;
+    int ipv4 = v4mapped(nexthop->gate);
+
+    memset(buf.raw, 0, sizeof(buf.raw));
+    buf.nh.nlmsg_type = type;
+    buf.nh.nlmsg_flags = NLM_F_REQUEST;
+    buf.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct nhmsg));
+    nhm = NLMSG_DATA(&buf.nh);
+
+    nexthop_rta(&buf.nh, NHA_ID, &nexthop->id, sizeof(nexthop->id));
+    if(type == RTM_DELNEXTHOP)
+        shadow_forget_nexthop(nexthop->id);
+    if(type == RTM_NEWNEXTHOP) {
+        /* Only a group that fails over exists already. */
+        buf.nh.nlmsg_flags |= nexthop->failed ?
+            NLM_F_REPLACE : NLM_F_CREATE | NLM_F_EXCL;
+        nhm->nh_protocol = RTPROT_BABEL;
+        if(nexthop->group) {
+            struct nexthop_grp grp;
+            memset(&grp, 0, sizeof(grp));
+            grp.id = member;
+            nhm->nh_family = AF_UNSPEC;
+            nexthop_rta(&buf.nh, NHA_GROUP, &grp, sizeof(grp));
+        } else {
+            nhm->nh_family = ipv4 ? AF_INET : AF_INET6;
+            nexthop_rta(&buf.nh, NHA_OIF,
+                        &nexthop->ifindex, sizeof(nexthop->ifindex));
+            if(ipv4)
+                nexthop_rta(&buf.nh, NHA_GATEWAY, nexthop->gate + 12,
+                            sizeof(struct in_addr));
+            else
+                nexthop_rta(&buf.nh, NHA_GATEWAY, nexthop->gate,
+                            sizeof(struct in6_addr));
+        }
+    }
+
+    return fib_queue_request(&buf.nh,
+                             type == RTM_NEWNEXTHOP ?
+                             FIB_NEXTHOP : FIB_NEXTHOP_FLUSH,
+                             0, nexthop->gate, 128, NULL, 0,
+                             nexthop->gate, nexthop->ifindex, nexthop->id);
+}
+
+/* A NULL gate matches every gateway on the interface. */
+static int
+nexthop_matches(const unsigned char *a, int a_ifindex,
+                const unsigned char *gate, int ifindex)
+{
+    return a_ifindex == ifindex && (gate == NULL || memcmp(a, gate, 16) == 0);
+}
+
+static struct kernel_nexthop *
+find_nexthop(const unsigned char *gate, int ifindex,
+             const unsigned char *backup, int backup_ifindex)
+{
+    int i;
+
+    for(i = 0; i < numnexthops; i++) {
+        struct kernel_nexthop *nexthop = &nexthops[i];
+        if(!nexthop_matches(nexthop->gate, nexthop->ifindex, gate, ifindex))
+            continue;
+        if(backup == NULL ?
+           !nexthop->group :
+           (nexthop->group && !nexthop->failed &&
+            nexthop_matches(nexthop->backup, nexthop->backup_ifindex,
+                            backup, backup_ifindex)))
+            return nexthop;
+    }
+    return NULL;
+}
+
+/* Returns a new entry, which is only counted once it has been sent. */
+static struct kernel_nexthop *
+new_nexthop(const unsigned char *gate, int ifindex)
+{
+    struct kernel_nexthop *nexthop;
+
+    if(numnexthops >= maxnexthops) {
+        struct kernel_nexthop *new_nexthops;
+        int n = maxnexthops < 1 ? 8 : 2 * maxnexthops;
+        new_nexthops = realloc(nexthops, n * sizeof(struct kernel_nexthop));
+        if(new_nexthops == NULL)
+            return NULL;
+        nexthops = new_nexthops;
+        maxnexthops = n;
+    }
+
+    if(nexthop_base == 0 || nexthop_serial >= NEXTHOP_ID_RANGE - 1)
+        next_nexthop_range();
+
+    nexthop = &nexthops[numnexthops];
+    memset(nexthop, 0, sizeof(*nexthop));
+    nexthop->id = nexthop_base + ++nexthop_serial;
+    memcpy(nexthop->gate, gate, 16);
+    nexthop->ifindex = ifindex;
+    return nexthop;
+}
+
+static struct kernel_nexthop *
+find_nexthop_id(unsigned int id)
+{
+    int i;
+
+    if(id == 0)
+        return NULL;
+    for(i = 0; i < numnexthops; i++) {
+        if(nexthops[i].id == id)
+            return &nexthops[i];
+    }
+    return NULL;
+}
+
+static void
+nexthop_hold(unsigned int id)
+{
+    struct kernel_nexthop *nexthop = find_nexthop_id(id);
+    if(nexthop)
+        nexthop->refcount++;
+}
+
+static void
+nexthop_release(unsigned int id)
+{
+    struct kernel_nexthop *nexthop = find_nexthop_id(id);
+    if(nexthop && nexthop->refcount > 0)
+        nexthop->refcount--;
+}
+
+/* The interface that packets through nexthop id go out of, or 0. */
+static int
+nexthop_ifindex(unsigned int id)
+{
+    struct kernel_nexthop *nexthop = find_nexthop_id(id);
+    if(nexthop == NULL)
+        return 0;
+    return nexthop->failed ? nexthop->backup_ifindex : nexthop->ifindex;
+}
+
+/* A group holds its primary, and its backup for as long as it can fail
+   over to it. */
+static void
+release_members(struct kernel_nexthop *nexthop)
+{
+    struct kernel_nexthop *member;
+
+    if(!nexthop->group)
+        return;
+    member = find_nexthop(nexthop->gate, nexthop->ifindex, NULL, 0);
+    if(member)
+        nexthop_release(member->id);
+    if(nexthop->backup_ifindex != 0) {
+        member = find_nexthop(nexthop->backup, nexthop->backup_ifindex,
+                              NULL, 0);
+        if(member)
+            nexthop_release(member->id);
+    }
+}
+
+static void
+drop_nexthop(int i)
+{
+    release_members(&nexthops[i]);
+    if(i != numnexthops - 1)
+        memcpy(&nexthops[i], &nexthops[numnexthops - 1],
+               sizeof(struct kernel_nexthop));
+    numnexthops--;
+}
+
+/* The kernel refused to create a nexthop.  The routes queued after it
+   that refer to it fail too, unless the id clashed with an object that
+   isn't ours: those routes are now using it, and must be installed
+   again.  Any other error disables nexthop objects, but the existing
+   ones are kept track of until the routes have moved off them. */
+static void
+nexthop_failed(unsigned int id, int error)
+{
+    struct kernel_nexthop *nexthop = find_nexthop_id(id);
+    struct kernel_route_error status;
+    int i;
+
+    if(nexthop == NULL)
+        return;
+
+    fprintf(stderr, "kernel_route: nexthop %u via %s: %s%s.\n",
+            id, format_address(nexthop->gate), strerror(error),
+            nexthop->failed ? "" :
+            error == EEXIST ? ", trying other ids" :
+            ", disabling nexthop objects");
+    if(nexthop->failed)
+        /* A group that didn't fail over still forwards to its primary,
+           and is deleted with its last route. */
+        return;
+
+    memset(&status, 0, sizeof(status));
+    status.operation = ROUTE_ADD;
+    status.error = error;
+    memcpy(status.route.gw, nexthop->gate, 16);
+    status.route.ifindex = nexthop->ifindex;
+    i = 0;
+    while(i < numshadow) {
+        if(shadow[i].nexthop != id) {
+            i++;
+            continue;
+        }
+        status.table = shadow[i].table;
+        memcpy(status.route.prefix, shadow[i].prefix, 16);
+        status.route.plen = shadow[i].plen;
+        memcpy(status.route.src_prefix, shadow[i].src_prefix, 16);
+        status.route.src_plen = shadow[i].src_plen;
+        status.route.metric = shadow[i].priority;
+        drop_shadow(i);
+        if(fib_failed)
+            fib_failed(&status, fib_failed_closure);
+    }
+
+    nexthop = find_nexthop_id(id);
+    if(nexthop)
+        drop_nexthop(nexthop - nexthops);
+    if(error == EEXIST)
+        next_nexthop_range();
+    else
+        has_kernel_nexthops = 0;
+}
 
-    char buf[65536*2];
+/* Returns the id of the nexthop object for gate, creating it if needed,
+   or 0 if the route must carry its own gateway. */
+static unsigned int
+kernel_nexthop_id(const unsigned char *gate, int ifindex)
+{
+    struct kernel_nexthop *nexthop;
+    int rc;
 
-    memset(&nladdr, 0, sizeof(nladdr));
-    nladdr.nl_family = AF_NETLINK;
+    nexthop = find_nexthop(gate, ifindex, NULL, 0);
+    if(nexthop)
+        return nexthop->id;
 
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = &nladdr;
-    msg.msg_namelen = sizeof(nladdr);
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    nexthop = new_nexthop(gate, ifindex);
+    if(nexthop == NULL)
+        return 0;
+    rc = nexthop_message(RTM_NEWNEXTHOP, nexthop, 0);
+    if(rc < 0)
+        return 0;
+    numnexthops++;
+    return nexthop->id;
+}
 
-    iov.iov_base = &buf;
+/* Like kernel_nexthop_id, but for a route with a backup gateway. */
+static unsigned int
+kernel_nexthop_group(const unsigned char *gate, int ifindex,
+                     const unsigned char *backup, int backup_ifindex)
+{
+    struct kernel_nexthop *nexthop;
+    unsigned int primary, secondary;
+    int rc;
 
-    int errors = 0;
-    do {
-        iov.iov_len = sizeof(buf);
-        len = recvmsg(nl->sock, &msg, 0);
+    primary = kernel_nexthop_id(gate, ifindex);
+    if(primary == 0)
+        return 0;
+    /* The backup must exist by the time we fail over. */
+    secondary = kernel_nexthop_id(backup, backup_ifindex);
+    if(secondary == 0)
+        return primary;
+
+    nexthop = find_nexthop(gate, ifindex, backup, backup_ifindex);
+    if(nexthop)
+        return nexthop->id;
+
+    nexthop = new_nexthop(gate, ifindex);
+    if(nexthop == NULL)
+        return primary;
+    nexthop->group = 1;
+    memcpy(nexthop->backup, backup, 16);
+    nexthop->backup_ifindex = backup_ifindex;
+    rc = nexthop_message(RTM_NEWNEXTHOP, nexthop, primary);
+    if(rc < 0)
+        return primary;
+    numnexthops++;
+    nexthop_hold(primary);
+    nexthop_hold(secondary);
+    return nexthop->id;
+}
 
-    if(len < 0) {
-	    errors++;
-	    switch(errno) {
-	    case EINTR: continue;
-	    case ENOBUFS:
-	    case ENOMEM:
-	    case EAGAIN: sched_yield(); continue; // fixme, wait for fd again
-	    default: fprintf(stderr,"EEEIEEE - got a netlink message %d we don't handle!\n", errno);
-			    continue;
-	    }
+/* Repoint the groups whose primary matches at their backup. */
+static int
+failover_nexthops(const unsigned char *gate, int ifindex)
+{
+    int i, n = 0;
+
+    for(i = 0; i < numnexthops; i++) {
+        struct kernel_nexthop *nexthop = &nexthops[i];
+        if(!nexthop->group || nexthop->failed)
+            continue;
+        if(nexthop_matches(nexthop->gate, nexthop->ifindex, gate, ifindex)) {
+            struct kernel_nexthop *backup =
+                find_nexthop(nexthop->backup, nexthop->backup_ifindex,
+                             NULL, 0);
+            if(backup &&
+               !nexthop_matches(backup->gate, backup->ifindex,
+                                gate, ifindex)) {
+                kdebugf("kernel_flush_nexthop: group %u fails over to %s.\n",
+                        nexthop->id, format_address(backup->gate));
+                nexthop->failed = 1;
+                nexthop_message(RTM_NEWNEXTHOP, nexthop, backup->id);
+                n++;
+            }
+        } else if(nexthop_matches(nexthop->backup, nexthop->backup_ifindex,
+                                  gate, ifindex)) {
+            /* No longer a usable backup. */
+            struct kernel_nexthop *backup =
+                find_nexthop(nexthop->backup, nexthop->backup_ifindex,
+                             NULL, 0);
+            if(backup)
+                nexthop_release(backup->id);
+            memset(nexthop->backup, 0, 16);
+            nexthop->backup_ifindex = 0;
+        }
     }
-     while(len < 0 && errors < 5);
+    return n;
+}
 
-    if(len < 0) {
-            perror("netlink_read: recvmsg()");
-            return -1;
-        } else if(len == 0) {
-            fprintf(stderr, "netlink_read: EOF\n");
-            goto socket_error;
-        } else if(msg.msg_namelen != nl->socklen) {
-            fprintf(stderr,
-                    "netlink_read: unexpected sender address length (%d)\n",
-                    msg.msg_namelen);
-            goto socket_error;
-        } else if(nladdr.nl_pid != 0) {
-            kdebugf("netlink_read: message not sent by kernel.\n");
-            return -1;
-        }
+/* Called as soon as a gateway is known to be unreachable, before the
+   protocol has had a chance to switch routes: the failover is sent
+   straight away rather than with the next batch. */
+int
+kernel_failover_nexthop(const unsigned char *gate, int ifindex)
+{
+    int n = failover_nexthops(gate, ifindex);
+    if(n > 0)
+        fib_flush();
+    return n;
+}
 
-        kdebugf("Netlink message: ");
+int
+kernel_flush_nexthop(const unsigned char *gate, int ifindex)
+{
+    int i, n = 0;
+
+    /* Fail over first, so that deleting the primaries below leaves these
+       groups, and the routes that use them, alone. */
+    failover_nexthops(gate, ifindex);
+
+    i = 0;
+    while(i < numnexthops) {
+        struct kernel_nexthop *nexthop = &nexthops[i];
+        const unsigned char *a = nexthop->failed ?
+            nexthop->backup : nexthop->gate;
+        int a_ifindex = nexthop->failed ?
+            nexthop->backup_ifindex : nexthop->ifindex;
+        if(!nexthop_matches(a, a_ifindex, gate, ifindex)) {
+            i++;
+            continue;
+        }
+        kdebugf("kernel_flush_nexthop: %s dev %d (id %u)\n",
+                format_address(nexthop->gate), nexthop->ifindex, nexthop->id);
+        nexthop_message(RTM_DELNEXTHOP, nexthop, 0);
+        drop_nexthop(i);
+        n++;
+    }
+    return n;
+}
 
-        for(nh = (struct nlmsghdr *)buf;
-            NLMSG_OK(nh, len);
-            nh = NLMSG_NEXT(nh, len)) {
-            kdebugf("%s{seq:%d}", (nh->nlmsg_flags & NLM_F_MULTI) ? "[multi] " : "",
-                    nh->nlmsg_seq);
-            if(!answer)
-                done = 1;
-            if(nl_ignore && nh->nlmsg_pid == nl_ignore->sockaddr.nl_pid) {
-                fprintf(stderr,"Message from self - we should not see this more than twice - ever\n");
-		kdebugf("(ignore), ");
-                continue;
-            } else if(answer && (nh->nlmsg_pid != nl->sockaddr.nl_pid ||
-                                 nh->nlmsg_seq != nl->seqno)) {
-                kdebugf("(wrong seqno %d %d /pid %d %d), ",
-                        nh->nlmsg_seq, nl->seqno,
-                        nh->nlmsg_pid, nl->sockaddr.nl_pid);
-                continue;
-            } else if(nh->nlmsg_type == NLMSG_DONE) {
-                kdebugf("(done)\n");
-                done = 1;
-                break;
-            } else if(nh->nlmsg_type == NLMSG_ERROR) {
-                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(nh);
-                if(err->error == 0) {
-                    kdebugf("(ACK)\n");
-                    return 0;
-                } else {
-                    kdebugf("netlink_read: %s\n", strerror(-err->error));
-                    errno = -err->error;
-                    return -1;
-                }
-            } else if(skip) {
-                kdebugf("(skip)");
-            } if(filter) {
-                kdebugf("(msg -> \"");
-                err = filter_netlink(nh, filter);
-                kdebugf("\" %d), ", err);
-                if(err < 0) skip = 1;
-                continue;
+/* Delete the nexthops that no route uses any more.  Groups go first,
+   which releases their members. */
+static void
+collect_nexthops(void)
+{
+    int i, group;
+
+    for(group = 1; group >= 0; group--) {
+        i = 0;
+        while(i < numnexthops) {
+            if(nexthops[i].refcount <= 0 && nexthops[i].group == group) {
+                kdebugf("collect_nexthops: %s dev %d (id %u)\n",
+                        format_address(nexthops[i].gate),
+                        nexthops[i].ifindex, nexthops[i].id);
+                nexthop_message(RTM_DELNEXTHOP, &nexthops[i], 0);
+                drop_nexthop(i);
+            } else {
+                i++;
             }
-            kdebugf(", ");
         }
-        kdebugf("\n");
-
-        if(msg.msg_flags & MSG_TRUNC)
-            fprintf(stderr, "netlink_read: message truncated\n");
+    }
+}
 
-    } while(!done);
+static void
+flush_all_nexthops(void)
+{
+    int i;
 
-    return 0;
+    /* Groups first, so that deleting their members doesn't race. */
+    for(i = 0; i < numnexthops; i++) {
+        if(nexthops[i].group)
+            nexthop_message(RTM_DELNEXTHOP, &nexthops[i], 0);
+    }
+    for(i = 0; i < numnexthops; i++) {
+        if(!nexthops[i].group)
+            nexthop_message(RTM_DELNEXTHOP, &nexthops[i], 0);
+    }
+    numnexthops = 0;
+}
 
- socket_error:
-    close(nl->sock);
-    nl->sock = -1;
-    errno = EIO;
-    return -1;
+int
+kernel_flush_routes(void)
+{
+    collect_nexthops();
+    return fib_flush();
 }
 
 static int
@@ -448,6 +1600,9 @@ netlink_talk(struct nlmsghdr *nh)
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
 
+    /* Keep the kernel's view of our requests in order. */
+    fib_flush();
+
     iov.iov_base = nh;
     iov.iov_len = nh->nlmsg_len;
 
@@ -528,16 +1683,14 @@ netlink_send_dump(int type, void *data, int len) {
     } buf;
     int rc;
 
-    /* At least we should send an 'struct rtgenmsg' */
+    /* At least we should send an 'struct rtgenmsg'.  Older kernels only
+       look at its family, which comes first in the header of every
+       request; with strict checking, the whole header must be valid. */
     if(data == NULL || len == 0) {
         errno = EIO;
         return -1;
     }
 
-    /* And more : using anything else that 'struct rtgenmsg' is currently */
-    /* ignored by the linux kernel (today: 2.6.21) because NLM_F_MATCH is */
-    /* not yet implemented */
-
     memset(&nladdr, 0, sizeof(nladdr));
     nladdr.nl_family = AF_NETLINK;
 
@@ -552,6 +1705,9 @@ netlink_send_dump(int type, void *data, int len) {
     iov[1].iov_base = data;
     iov[1].iov_len = len;
 
+    /* A dump must see the routes we have queued. */
+    fib_flush();
+
     memset(buf.raw, 0, sizeof(buf.raw));
     buf.nh.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
     buf.nh.nlmsg_type = type;
@@ -622,6 +1778,9 @@ kernel_setup(int setup)
         close(dgram_socket);
         dgram_socket = -1;
 
+        flush_all_nexthops();
+        fib_flush();
+        flush_shadow();
         close(nl_command.sock);
         nl_command.sock = -1;
         nl_setup = 0;
@@ -1011,6 +2170,12 @@ kernel_has_ipv6_subtrees(void)
     return (kernel_older_than("Linux", 3, 11) == 0);
 }
 
+int
+kernel_has_nexthops(void)
+{
+    return (kernel_older_than("Linux", 5, 3) == 0);
+}
+
 // The way this gets called is confusing
 // "newgate" is only used on a change or replace
 // otherwise add/del uses the first parameters only
@@ -1018,24 +2183,42 @@ kernel_has_ipv6_subtrees(void)
 
 const int iflo = 0; // fixme find this
 
+/* Set once we have installed a multipath route. */
+static int multipath_installed = 0;
+
+/* The priority of a route in the kernel.  Unreachable routes get the
+   priority of reachable ones, so that NLM_F_REPLACE can turn one into the
+   other; this used to leave unreachable routes behind, pointing at lo. */
+static int
+kernel_priority(int ipv4, unsigned int metric)
+{
+    int priority = metric < KERNEL_INFINITY ? metric : kernel_metric;
+    /* The kernel turns an IPv6 priority of 0 into 1024. */
+    if(!ipv4 && priority == 0)
+        priority = 1024;
+    return priority;
+}
+
 int
 kernel_route(int operation, int table,
              const unsigned char *dest, unsigned short plen,
              const unsigned char *src, unsigned short src_plen,
              const unsigned char *gate, int ifindex, unsigned int metric,
              const unsigned char *newgate, int newifindex,
-             unsigned int newmetric, int newtable)
+             unsigned int newmetric, int newtable,
+             const unsigned char *backup, int backup_ifindex,
+             const struct kernel_multipath *paths, int numpaths,
+             int expires)
 {
     union { char raw[1024]; struct nlmsghdr nh; } buf;
     struct rtmsg *rtm;
     struct rtattr *rta;
+    struct rtnexthop *rtnh;
+    struct fib_shadow key;
     int len = sizeof(buf.raw);
     int rc, ipv4, use_src = 0;
-    // It is not clear how we determine the metric elsewhere for kernel writes
-    int ipv4_metric = 0;
-    int ipv6_metric = 1024;
-    
-    // const int expires = 6000;
+    unsigned int nexthop = 0;
+    int with_gateway = 1;
 
     if(!nl_setup) {
         fprintf(stderr,"kernel_route: netlink not initialized.\n");
@@ -1077,44 +2260,36 @@ kernel_route(int operation, int table,
             format_prefix(dest, plen), format_prefix(src, src_plen),
             table, metric, ifindex, format_address(gate));
 
-    // Is it possible we are getting a nonsensical anything?
-    replay_iproute(operation, src, dest, src_plen, plen,
-	           gate, table, metric, ifindex,
-	           newgate, newtable, newmetric, newifindex);
-
     if(operation == ROUTE_MODIFY) {
-//        if(newmetric == metric && memcmp(newgate, gate, 16) == 0 &&
-//           newifindex == ifindex)
-//            return 0;
-
-	// Hmm. Can we do better on infinity here? Why would the gates
-	// OR ifindex be the same on infinity? They could change...
-
-	// This change busted ipv4 and shouldn't have
-//        if(newmetric == metric && metric >= KERNEL_INFINITY)
-//            return 0;
-
-	// This was the code I had working correctly this
-	// morning. Or I hope it was.
-
-
-        // clear out the old route
-        // Going from infinite to normal
-        // going from normal to infinite
-
-	if(metric >= KERNEL_INFINITY || newmetric >= KERNEL_INFINITY) {
-                     rc = kernel_route(ROUTE_FLUSH, table, dest, plen,
-                     src, src_plen,
-                     gate, ifindex, metric,
-                     NULL, 0, 0, 0);
-                     if(rc!=0) fprintf(stderr,"Flushing infinite route failed\n");
-            }
-
-	    // What info am I losing in this transition?
-	table = newtable;
-	gate = newgate;
-	ifindex = newifindex;
-	metric = newmetric;
+        ipv4 = v4mapped(gate);
+        /* We don't install unreachable default routes (see below). */
+        if(newmetric >= KERNEL_INFINITY && (plen == 0 || (ipv4 && plen == 96)))
+            return kernel_route(ROUTE_FLUSH, table, dest, plen,
+                                src, src_plen,
+                                gate, ifindex, metric,
+                                NULL, 0, 0, 0, NULL, 0, NULL, 0, 0);
+        if(table != newtable ||
+           kernel_priority(ipv4, metric) != kernel_priority(ipv4, newmetric)) {
+            /* NLM_F_REPLACE only matches a route with the same priority,
+               so make before break.  Both requests go out in the same
+               batch. */
+            rc = kernel_route(ROUTE_ADD, newtable, dest, plen,
+                              src, src_plen,
+                              newgate, newifindex, newmetric,
+                              NULL, 0, 0, 0, backup, backup_ifindex,
+                              paths, numpaths, expires);
+            if(rc < 0)
+                return rc;
+            return kernel_route(ROUTE_FLUSH, table, dest, plen,
+                                src, src_plen,
+                                gate, ifindex, metric,
+                                NULL, 0, 0, 0, NULL, 0, NULL, 0, 0);
+        }
+        /* Otherwise, a single NLM_F_REPLACE switches atomically, even
+           between unreachable and reachable. */
+        gate = newgate;
+        ifindex = newifindex;
+        metric = newmetric;
     }
 
     ipv4 = v4mapped(gate);
@@ -1134,6 +2309,30 @@ kernel_route(int operation, int table,
 	    (plen == 0 || (ipv4 && plen == 96)))
         return 0;
 
+    if(operation == ROUTE_FLUSH || metric >= KERNEL_INFINITY)
+        numpaths = 0;
+
+    /* Refer to the nexthop object of the gateway when we can.  When
+       deleting, leave the gateway out: the kernel won't match it against
+       a nexthop object, and the priority is enough.  Multipath routes
+       carry their own next hops. */
+    if(numpaths > 1) {
+        with_gateway = 0;
+        multipath_installed = 1;
+    } else if(metric < KERNEL_INFINITY && has_kernel_nexthops && !use_src) {
+        if(operation != ROUTE_FLUSH && backup != NULL)
+            nexthop = kernel_nexthop_group(gate, ifindex,
+                                           backup, backup_ifindex);
+        else if(operation != ROUTE_FLUSH)
+            nexthop = kernel_nexthop_id(gate, ifindex);
+        with_gateway = (nexthop == 0 && operation != ROUTE_FLUSH);
+    }
+
+    /* Deleting an IPv6 multipath route by gateway only deletes that
+       member, and we don't remember which routes are multipath. */
+    if(operation == ROUTE_FLUSH && multipath_installed)
+        with_gateway = 0;
+
     memset(buf.raw, 0, sizeof(buf.raw));
 
     // The old behavior used NLM_EXCLU and NOT REPLACE
@@ -1201,29 +2400,57 @@ kernel_route(int operation, int table,
         rta->rta_len = RTA_LENGTH(sizeof(int));
         rta->rta_type = RTA_PRIORITY;
 
-        *(int*)RTA_DATA(rta) = metric;
+        *(int*)RTA_DATA(rta) = kernel_priority(ipv4, metric);
 
-        if(ipv4) {
+        if(nexthop != 0) {
             rta = RTA_NEXT(rta, len);
-            rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
-            rta->rta_type = RTA_GATEWAY;
-            memcpy(RTA_DATA(rta), gate + 12, sizeof(struct in_addr));
-        } else {
+            rta->rta_len = RTA_LENGTH(sizeof(unsigned int));
+            rta->rta_type = RTA_NH_ID;
+            *(unsigned int*)RTA_DATA(rta) = nexthop;
+        } else if(numpaths > 1) {
+            int i, addrlen = ipv4 ? sizeof(struct in_addr) :
+                sizeof(struct in6_addr);
             rta = RTA_NEXT(rta, len);
-            rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
-            rta->rta_type = RTA_GATEWAY;
-            memcpy(RTA_DATA(rta), gate, sizeof(struct in6_addr));
+            rta->rta_type = RTA_MULTIPATH;
+            rtnh = RTA_DATA(rta);
+            for(i = 0; i < numpaths; i++) {
+                struct rtattr *gw;
+                memset(rtnh, 0, sizeof(struct rtnexthop));
+                rtnh->rtnh_len = RTNH_LENGTH(RTA_SPACE(addrlen));
+                rtnh->rtnh_ifindex = paths[i].ifindex;
+                /* The kernel's weight is rtnh_hops + 1. */
+                rtnh->rtnh_hops = MAX(MIN(paths[i].weight, 256), 1) - 1;
+                gw = RTNH_DATA(rtnh);
+                gw->rta_len = RTA_LENGTH(addrlen);
+                gw->rta_type = RTA_GATEWAY;
+                memcpy(RTA_DATA(gw), ipv4 ? paths[i].gate + 12 : paths[i].gate,
+                       addrlen);
+                rtnh = RTNH_NEXT(rtnh);
+            }
+            rta->rta_len = (char*)rtnh - (char*)rta;
+        } else if(with_gateway) {
+            if(ipv4) {
+                rta = RTA_NEXT(rta, len);
+                rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+                rta->rta_type = RTA_GATEWAY;
+                memcpy(RTA_DATA(rta), gate + 12, sizeof(struct in_addr));
+            } else {
+                rta = RTA_NEXT(rta, len);
+                rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+                rta->rta_type = RTA_GATEWAY;
+                memcpy(RTA_DATA(rta), gate, sizeof(struct in6_addr));
+            }
+            rta = RTA_NEXT(rta, len);
+            rta->rta_len = RTA_LENGTH(sizeof(int));
+            rta->rta_type = RTA_OIF;
+            *(int*)RTA_DATA(rta) = ifindex;
         }
-        rta = RTA_NEXT(rta, len);
-        rta->rta_len = RTA_LENGTH(sizeof(int));
-        rta->rta_type = RTA_OIF;
-        *(int*)RTA_DATA(rta) = ifindex;
 
     } else {
         rta = RTA_NEXT(rta, len);
         rta->rta_len = RTA_LENGTH(sizeof(int));
         rta->rta_type = RTA_PRIORITY;
-       *(int*)RTA_DATA(rta) = ipv4 ? ipv4_metric : ipv6_metric;
+       *(int*)RTA_DATA(rta) = kernel_priority(ipv4, metric);
 
 /*        rta = RTA_NEXT(rta, len);
         rta->rta_len = RTA_LENGTH(sizeof(int));
@@ -1231,20 +2458,15 @@ kernel_route(int operation, int table,
         *(int*)RTA_DATA(rta) = 0; // UNSPEC? */
     }
 
-//    PERHAPS one day push babel routes as expiring into the
-//    the kernel and periodically refresh them. This would
-//    give us a window to crash or restart in without retractions
-//    and also let us chew up compute. On the other hand, we
-//    end up writing stuff to the kernel more often to refresh it.
+    /* Only IPv6 routes expire in the kernel; IPv4 ignores RTA_EXPIRES. */
+    if(operation != ROUTE_FLUSH && !ipv4 && expires > 0) {
+        rta = RTA_NEXT(rta, len);
+        rta->rta_len = RTA_LENGTH(sizeof(unsigned int));
+        rta->rta_type = RTA_EXPIRES;
+        *(unsigned int*)RTA_DATA(rta) = expires;
+    }
 
    /* 
-#ifdef HAVE_EXPIRES
-    rta = RTA_NEXT(rta, len);
-    rta->rta_len = RTA_LENGTH(sizeof(int));
-    rta->rta_type = RTA_EXPIRES;
-    memcpy(RTA_DATA(rta), &expires, sizeof(int));
-#endif
-
     rta = RTA_NEXT(rta, len);
     rta->rta_len = RTA_LENGTH(sizeof(int));
     rta->rta_type = RTA_PRIORITY;
@@ -1276,15 +2498,38 @@ kernel_route(int operation, int table,
     if(rtm->rtm_protocol != RTPROT_BABEL)
 		fprintf(stderr,"We scribbled on rtm_protocol!!!\n");
 
-    rc = netlink_talk(&buf.nh);
-    if(rtm->rtm_protocol != RTPROT_BABEL)
-		fprintf(stderr,"Netlink scribbled on rtm_protocol!!!\n");
-    replay_iproute_status(rc, errno);
+    /* A request that renews a route's lifetime is never redundant. */
+    shadow_key(&key, table, dest, plen, src, use_src ? src_plen : 0);
+    if(operation == ROUTE_FLUSH) {
+        shadow_forget(&key, kernel_priority(ipv4, metric));
+    } else if(shadow_update(&key, kernel_priority(ipv4, metric), nexthop,
+                            rtm, buf.nh.nlmsg_len - NLMSG_LENGTH(0)) &&
+              (ipv4 || expires <= 0)) {
+        kdebugf("kernel_route: %s from %s table %d unchanged.\n",
+                format_prefix(dest, plen), format_prefix(src, src_plen),
+                table);
+        trace_route(operation, dest, plen, use_src ? src : NULL,
+                    use_src ? src_plen : 0, gate, ifindex, table,
+                    kernel_priority(ipv4, metric),
+                    rtm->rtm_type != RTN_UNICAST, 0);
+        trace_route_status(0, 1, 0);
+        return 0;
+    }
+
+    rc = fib_queue_request(&buf.nh, operation, table, dest, plen,
+                           src, src_plen, gate, ifindex,
+                           kernel_priority(ipv4, metric));
+    /* The status is traced when the ACK is processed. */
+    trace_route(operation, dest, plen, use_src ? src : NULL,
+                use_src ? src_plen : 0, gate, ifindex, table,
+                kernel_priority(ipv4, metric), rtm->rtm_type != RTN_UNICAST,
+                buf.nh.nlmsg_seq);
     return rc;
 }
 
 static int
-parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
+parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route,
+                       int *table_return)
 {
     int table = rtm->rtm_table;
     struct rtattr *rta= RTM_RTA(rtm);;
@@ -1338,50 +2583,232 @@ parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
         rta = RTA_NEXT(rta, len);
     }
 
-    for(i = 0; i < import_table_count; i++)
-        if(table == import_tables[i])
-            return 0;
+    if(table_return)
+        *table_return = table;
+
+    for(i = 0; i < import_table_count; i++)
+        if(table == import_tables[i])
+            return 0;
+
+    return -1;
+}
+
+static void
+print_kernel_route(int add, int protocol, int type,
+                   struct kernel_route *route)
+{
+    char ifname[IFNAMSIZ];
+    char addr_prefix[INET6_ADDRSTRLEN];
+    char src_addr_prefix[INET6_ADDRSTRLEN];
+    char addr_gw[INET6_ADDRSTRLEN];
+
+    if(!inet_ntop(AF_INET6, route->prefix,
+                  addr_prefix, sizeof(addr_prefix)) ||
+       !inet_ntop(AF_INET6,route->gw, addr_gw, sizeof(addr_gw)) ||
+       !if_indextoname(route->ifindex, ifname)) {
+        kdebugf("Couldn't format kernel route for printing.");
+        return;
+    }
+
+    if(route->src_plen >= 0) {
+        if(!inet_ntop(AF_INET6, route->src_prefix,
+                      src_addr_prefix, sizeof(src_addr_prefix))) {
+            kdebugf("Couldn't format kernel route for printing.");
+            return;
+        }
+
+        kdebugf("%s kernel route: dest: %s/%d gw: %s metric: %d if: %s "
+                "(proto: %d, type: %d, from: %s/%d)",
+                add == RTM_NEWROUTE ? "Add" : "Delete",
+                addr_prefix, route->plen, addr_gw, route->metric, ifname,
+                protocol, type, src_addr_prefix, route->src_plen);
+        return;
+    }
+
+    kdebugf("%s kernel route: dest: %s/%d gw: %s metric: %d if: %s "
+           "(proto: %d, type: %d)",
+           add == RTM_NEWROUTE ? "Add" : "Delete",
+           addr_prefix, route->plen, addr_gw, route->metric, ifname,
+           protocol, type);
+}
+
+/* What a route request, or a route in a dump, says about where packets
+   go. */
+struct fib_signature {
+    int type;
+    int priority;
+    unsigned int nexthop;
+    unsigned char gate[16];
+    int ifindex;
+    int numpaths;
+    unsigned int paths;         /* a hash of the members */
+};
+
+static void
+fib_signature(struct rtmsg *rtm, int len, struct fib_signature *sig)
+{
+    struct rtattr *rta = RTM_RTA(rtm);
+
+    len -= NLMSG_ALIGN(sizeof(*rtm));
+    memset(sig, 0, sizeof(*sig));
+    sig->type = rtm->rtm_type;
+
+    while(RTA_OK(rta, len)) {
+        switch(rta->rta_type) {
+        case RTA_PRIORITY:
+            sig->priority = *(int*)RTA_DATA(rta);
+            break;
+        case RTA_NH_ID:
+            sig->nexthop = *(unsigned int*)RTA_DATA(rta);
+            break;
+        case RTA_GATEWAY:
+            memcpy(sig->gate, RTA_DATA(rta), MIN(RTA_PAYLOAD(rta), 16));
+            break;
+        case RTA_OIF:
+            sig->ifindex = *(int*)RTA_DATA(rta);
+            break;
+        case RTA_MULTIPATH: {
+            struct rtnexthop *rtnh = RTA_DATA(rta);
+            int n = RTA_PAYLOAD(rta);
+            while(RTNH_OK(rtnh, n)) {
+                struct rtattr *gw = RTNH_DATA(rtnh);
+                int gwlen = rtnh->rtnh_len - RTNH_LENGTH(0);
+                sig->paths = sig->paths * 31 +
+                    rtnh->rtnh_ifindex * 257 + rtnh->rtnh_hops;
+                while(RTA_OK(gw, gwlen)) {
+                    if(gw->rta_type == RTA_GATEWAY) {
+                        unsigned char *p = RTA_DATA(gw);
+                        int i;
+                        for(i = 0; i < RTA_PAYLOAD(gw); i++)
+                            sig->paths = sig->paths * 31 + p[i];
+                    }
+                    gw = RTA_NEXT(gw, gwlen);
+                }
+                sig->numpaths++;
+                n -= RTNH_ALIGN(rtnh->rtnh_len);
+                rtnh = RTNH_NEXT(rtnh);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        rta = RTA_NEXT(rta, len);
+    }
+}
+
+/* The kernel adds to what we asked for, so only compare that. */
+static int
+fib_signature_matches(const struct fib_signature *request,
+                      const struct fib_signature *kernel)
+{
+    if(request->type != kernel->type || request->priority != kernel->priority)
+        return 0;
+    if(request->nexthop != 0)
+        return kernel->nexthop == request->nexthop;
+    if(request->numpaths > 0)
+        return kernel->numpaths == request->numpaths &&
+            kernel->paths == request->paths;
+    if(request->type != RTN_UNICAST)
+        return 1;
+    return kernel->ifindex == request->ifindex &&
+        memcmp(kernel->gate, request->gate, 16) == 0;
+}
+
+/* Whether the request of entry sends packets out of ifindex. */
+static int
+shadow_through(const struct fib_shadow *entry, int ifindex)
+{
+    struct rtattr *rta = RTM_RTA(entry->request);
+    int len = entry->len - NLMSG_ALIGN(sizeof(struct rtmsg));
+
+    if(entry->nexthop != 0)
+        return nexthop_ifindex(entry->nexthop) == ifindex;
+
+    while(RTA_OK(rta, len)) {
+        if(rta->rta_type == RTA_OIF) {
+            if(*(int*)RTA_DATA(rta) == ifindex)
+                return 1;
+        } else if(rta->rta_type == RTA_MULTIPATH) {
+            struct rtnexthop *rtnh = RTA_DATA(rta);
+            int n = RTA_PAYLOAD(rta);
+            while(RTNH_OK(rtnh, n)) {
+                if(rtnh->rtnh_ifindex == ifindex)
+                    return 1;
+                n -= RTNH_ALIGN(rtnh->rtnh_len);
+                rtnh = RTNH_NEXT(rtnh);
+            }
+        }
+        rta = RTA_NEXT(rta, len);
+    }
+    return 0;
+}
+
+/* The link ifindex went down, and the kernel may have dropped the routes
+   through it silently. */
+static void
+shadow_forget_ifindex(int ifindex)
+{
+    int i = 0;
 
-    return -1;
+    while(i < numshadow) {
+        if(shadow_through(&shadow[i], ifindex))
+            drop_shadow(i);
+        else
+            i++;
+    }
 }
 
+/* Called for each of our own routes, whether the kernel notifies us of
+   a change or we are checking the shadow against a dump. */
 static void
-print_kernel_route(int add, int protocol, int type,
-                   struct kernel_route *route)
+fib_shadow_route(int type, struct rtmsg *rtm, int len,
+                 struct kernel_route *route, int table)
 {
-    char ifname[IFNAMSIZ];
-    char addr_prefix[INET6_ADDRSTRLEN];
-    char src_addr_prefix[INET6_ADDRSTRLEN];
-    char addr_gw[INET6_ADDRSTRLEN];
+    struct fib_shadow key;
+    struct fib_signature expected, found;
+    int i;
 
-    if(!inet_ntop(AF_INET6, route->prefix,
-                  addr_prefix, sizeof(addr_prefix)) ||
-       !inet_ntop(AF_INET6,route->gw, addr_gw, sizeof(addr_gw)) ||
-       !if_indextoname(route->ifindex, ifname)) {
-        kdebugf("Couldn't format kernel route for printing.");
+    shadow_key(&key, table, route->prefix, route->plen,
+               route->src_prefix, route->src_plen);
+    fib_signature(rtm, len, &found);
+    i = find_shadow(&key, NULL);
+
+    if(type == RTM_DELROUTE) {
+        if(i >= 0 && shadow[i].priority == found.priority)
+            drop_shadow(i);
         return;
     }
 
-    if(route->src_plen >= 0) {
-        if(!inet_ntop(AF_INET6, route->src_prefix,
-                      src_addr_prefix, sizeof(src_addr_prefix))) {
-            kdebugf("Couldn't format kernel route for printing.");
-            return;
-        }
+    if(!fib_checking)
+        return;
 
-        kdebugf("%s kernel route: dest: %s/%d gw: %s metric: %d if: %s "
-                "(proto: %d, type: %d, from: %s/%d)",
-                add == RTM_NEWROUTE ? "Add" : "Delete",
-                addr_prefix, route->plen, addr_gw, route->metric, ifname,
-                protocol, type, src_addr_prefix, route->src_plen);
+    if(i >= 0 && shadow[i].priority == found.priority) {
+        fib_signature(shadow[i].request, shadow[i].len, &expected);
+        if(fib_signature_matches(&expected, &found))
+            shadow[i].seen = 1;
+        else
+            fprintf(stderr, "kernel_check_fib: %s from %s table %d differs.\n",
+                    format_prefix(key.prefix, key.plen),
+                    format_prefix(key.src_prefix, key.src_plen), table);
         return;
     }
 
-    kdebugf("%s kernel route: dest: %s/%d gw: %s metric: %d if: %s "
-           "(proto: %d, type: %d)",
-           add == RTM_NEWROUTE ? "Add" : "Delete",
-           addr_prefix, route->plen, addr_gw, route->metric, ifname,
-           protocol, type);
+    /* Somebody else's, another instance perhaps. */
+    if(!own_table(table))
+        return;
+
+    if(numstrays >= maxstrays) {
+        struct fib_shadow *new_strays;
+        int n = maxstrays < 1 ? 8 : 2 * maxstrays;
+        new_strays = realloc(strays, n * sizeof(struct fib_shadow));
+        if(new_strays == NULL)
+            return;
+        strays = new_strays;
+        maxstrays = n;
+    }
+    key.priority = found.priority;
+    strays[numstrays++] = key;
 }
 
 static int
@@ -1399,14 +2826,18 @@ filter_kernel_routes(struct nlmsghdr *nh, struct kernel_route *route)
     rtm = (struct rtmsg*)NLMSG_DATA(nh);
     len -= NLMSG_LENGTH(0);
 
-    if(rtm->rtm_protocol == RTPROT_BABEL)
-        return 0;
-
     /* Ignore cached routes, advertised by some kernels (linux 3.x). */
     if(rtm->rtm_flags & RTM_F_CLONED)
         return 0;
 
-    rc = parse_kernel_route_rta(rtm, len, route);
+    if(rtm->rtm_protocol == RTPROT_BABEL) {
+        int table;
+        parse_kernel_route_rta(rtm, len, route, &table);
+        fib_shadow_route(nh->nlmsg_type, rtm, len, route, table);
+        return 0;
+    }
+
+    rc = parse_kernel_route_rta(rtm, len, route, NULL);
     if(rc < 0)
         return 0;
 
@@ -1425,13 +2856,50 @@ filter_kernel_routes(struct nlmsghdr *nh, struct kernel_route *route)
 
 }
 
+/* Dump the routes of one family.  With strict checking, the kernel only
+   sends those in table and of protocol, if non-zero; otherwise it
+   ignores the header of the request and sends all of them. */
+static int
+netlink_dump_routes(int family, int table, int protocol,
+                    struct kernel_filter *filter)
+{
+    union {
+        char raw[NLMSG_ALIGN(sizeof(struct rtmsg)) + RTA_SPACE(sizeof(int))];
+        struct rtmsg rtm;
+    } req;
+    int rc, len = NLMSG_ALIGN(sizeof(struct rtmsg));
+
+    memset(req.raw, 0, sizeof(req.raw));
+    req.rtm.rtm_family = family;
+    if(nl_strict) {
+        req.rtm.rtm_protocol = protocol;
+        if(table > 0) {
+            struct rtattr *rta = (struct rtattr*)(req.raw + len);
+            req.rtm.rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+            rta->rta_type = RTA_TABLE;
+            rta->rta_len = RTA_LENGTH(sizeof(int));
+            memcpy(RTA_DATA(rta), &table, sizeof(int));
+            len += RTA_SPACE(sizeof(int));
+        }
+    }
+
+    rc = netlink_send_dump(RTM_GETROUTE, req.raw, len);
+    if(rc < 0)
+        return -1;
+
+    rc = netlink_read(&nl_command, NULL, 1, filter);
+    /* IPv4 complains about tables that don't exist yet. */
+    if(rc < 0 && errno == ENOENT && table > 0)
+        return 0;
+    return rc;
+}
+
 /* This function should not return routes installed by us. */
 int
 kernel_dump(int operation, struct kernel_filter *filter)
 {
-    int i, rc;
+    int i, j, rc;
     int families[2] = { AF_INET6, AF_INET };
-    struct rtgenmsg g;
 
     if(!nl_setup) {
         fprintf(stderr,"kernel_dump: netlink not initialized.\n");
@@ -1450,22 +2918,28 @@ kernel_dump(int operation, struct kernel_filter *filter)
     }
 
     for(i = 0; i < 2; i++) {
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = families[i];
         if(operation & CHANGE_ROUTE) {
-            rc = netlink_send_dump(RTM_GETROUTE, &g, sizeof(g));
-            if(rc < 0)
-                return -1;
-
-            rc = netlink_read(&nl_command, NULL, 1, filter);
-            if(rc < 0)
-                return -1;
+            /* Only strict dumps are filtered by table in the kernel;
+               otherwise one dump brings every table. */
+            if(nl_strict) {
+                for(j = 0; j < import_table_count; j++) {
+                    rc = netlink_dump_routes(families[i], import_tables[j],
+                                             0, filter);
+                    if(rc < 0)
+                        return -1;
+                }
+            } else {
+                rc = netlink_dump_routes(families[i], 0, 0, filter);
+                if(rc < 0)
+                    return -1;
+            }
         }
 
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = families[i];
         if(operation & CHANGE_RULE) {
-            rc = netlink_send_dump(RTM_GETRULE, &g, sizeof(g));
+            struct fib_rule_hdr frh;
+            memset(&frh, 0, sizeof(frh));
+            frh.family = families[i];
+            rc = netlink_send_dump(RTM_GETRULE, &frh, sizeof(frh));
             if(rc < 0)
                 return -1;
 
@@ -1476,9 +2950,12 @@ kernel_dump(int operation, struct kernel_filter *filter)
     }
 
     if(operation & CHANGE_ADDR) {
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = AF_UNSPEC;
-        rc = netlink_send_dump(RTM_GETADDR, &g, sizeof(g));
+        struct ifaddrmsg ifa;
+        memset(&ifa, 0, sizeof(ifa));
+        ifa.ifa_family = AF_UNSPEC;
+        /* Ignored by the kernel unless the dump is strict. */
+        ifa.ifa_index = filter->ifindex;
+        rc = netlink_send_dump(RTM_GETADDR, &ifa, sizeof(ifa));
         if(rc < 0)
             return -1;
 
@@ -1490,6 +2967,174 @@ kernel_dump(int operation, struct kernel_filter *filter)
     return 0;
 }
 
+static int
+fib_check_ignore(struct kernel_route *route, void *closure)
+{
+    return 0;
+}
+
+static int
+fib_delete_stray(const struct fib_shadow *stray)
+{
+    union { char raw[256]; struct nlmsghdr nh; } buf;
+    static const unsigned char zeroes[16] = {0};
+
+    fib_delete_message(&buf.nh, stray);
+    return fib_queue_request(&buf.nh, ROUTE_FLUSH, stray->table,
+                             stray->prefix, stray->plen,
+                             stray->src_prefix, stray->src_plen,
+                             zeroes, 0, stray->priority);
+}
+
+/* Whether the RIB has installed a route of ours found in the kernel. */
+static int
+fib_route_wanted(const struct fib_shadow *entry)
+{
+    struct kernel_route route;
+
+    if(fib_wanted == NULL)
+        return 0;
+
+    memset(&route, 0, sizeof(route));
+    memcpy(route.prefix, entry->prefix, 16);
+    route.plen = entry->plen;
+    memcpy(route.src_prefix, entry->src_prefix, 16);
+    route.src_plen = entry->src_plen;
+    route.metric = entry->priority;
+    route.proto = RTPROT_BABEL;
+    return fib_wanted(entry->table, &route, fib_check_closure);
+}
+
+static void
+fib_delete_unknown(const struct fib_shadow *entry)
+{
+    fprintf(stderr, "kernel_check_fib: deleting unknown route "
+            "%s from %s table %d.\n",
+            format_prefix(entry->prefix, entry->plen),
+            format_prefix(entry->src_prefix, entry->src_plen),
+            entry->table);
+    fib_delete_stray(entry);
+}
+
+static int
+fib_resend(const struct fib_shadow *entry)
+{
+    union { char raw[1024]; struct nlmsghdr nh; } buf;
+    static const unsigned char zeroes[16] = {0};
+
+    if(NLMSG_LENGTH(entry->len) > sizeof(buf.raw)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memset(&buf.nh, 0, sizeof(buf.nh));
+    buf.nh.nlmsg_type = RTM_NEWROUTE;
+    buf.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
+    buf.nh.nlmsg_len = NLMSG_LENGTH(entry->len);
+    memcpy(NLMSG_DATA(&buf.nh), entry->request, entry->len);
+
+    return fib_queue_request(&buf.nh, ROUTE_MODIFY, entry->table,
+                             entry->prefix, entry->plen,
+                             entry->src_prefix, entry->src_plen,
+                             zeroes, 0, entry->priority);
+}
+
+/* Compare the shadow with a dump of the kernel tables, and repair the
+   kernel: delete the routes of ours that the RIB doesn't have, and have
+   the RIB reinstall its routes, which only sends those that the shadow
+   doesn't hold as they are in the kernel.  Returns the number of
+   repairs. */
+int
+kernel_check_fib(void)
+{
+    int families[2] = { AF_INET6, AF_INET };
+    struct kernel_filter filter;
+    int i, rc = 0, n = 0;
+
+    if(!nl_setup) {
+        fprintf(stderr,"kernel_check_fib: netlink not initialized.\n");
+        errno = EIO;
+        return -1;
+    }
+
+    if(nl_command.sock < 0) {
+        rc = netlink_socket(&nl_command, 0);
+        if(rc < 0) {
+            int save = errno;
+            perror("kernel_check_fib: netlink_socket()");
+            errno = save;
+            return -1;
+        }
+    }
+
+    for(i = 0; i < numshadow; i++)
+        shadow[i].seen = 0;
+    numstrays = 0;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.route = fib_check_ignore;
+
+    fib_checking = 1;
+    for(i = 0; i < 2; i++) {
+        rc = netlink_dump_routes(families[i], 0, RTPROT_BABEL, &filter);
+        if(rc < 0)
+            break;
+    }
+    fib_checking = 0;
+
+    if(rc < 0) {
+        int save = errno;
+        perror("kernel_check_fib: dump");
+        numstrays = 0;
+        errno = save;
+        return -1;
+    }
+
+    /* A stray that the shadow holds at another priority is a leftover,
+       whatever the RIB says. */
+    for(i = 0; i < numstrays; i++) {
+        if(find_shadow(&strays[i], NULL) < 0 && fib_route_wanted(&strays[i]))
+            continue;
+        fib_delete_unknown(&strays[i]);
+        n++;
+    }
+    numstrays = 0;
+
+    /* What the kernel lacks is forgotten, so that the RIB's requests
+       for it are not taken as redundant. */
+    i = 0;
+    while(i < numshadow) {
+        if(shadow[i].seen) {
+            if(fib_wanted == NULL || fib_route_wanted(&shadow[i])) {
+                i++;
+            } else {
+                fib_delete_unknown(&shadow[i]);
+                drop_shadow(i);
+                n++;
+            }
+            continue;
+        }
+        fprintf(stderr, "kernel_check_fib: %s from %s table %d "
+                "is missing.\n",
+                format_prefix(shadow[i].prefix, shadow[i].plen),
+                format_prefix(shadow[i].src_prefix, shadow[i].src_plen),
+                shadow[i].table);
+        n++;
+        if(fib_reinstall == NULL) {
+            fib_resend(&shadow[i]);
+            i++;
+        } else {
+            drop_shadow(i);
+        }
+    }
+
+    if(fib_reinstall)
+        fib_reinstall(fib_check_closure);
+
+    fib_flush();
+    return n;
+}
+
 static char *
 parse_ifname_rta(struct ifinfomsg *info, int len)
 {
@@ -1568,6 +3213,11 @@ filter_link(struct nlmsghdr *nh, struct kernel_link *link)
     link->ifname = parse_ifname_rta(info, len);
     if(link->ifname == NULL)
         return 0;
+    link->ifindex = ifindex;
+    link->up = nh->nlmsg_type == RTM_NEWLINK &&
+        (ifflags & IFF_UP) && (!link_detect || (ifflags & IFF_RUNNING));
+    if(!link->up)
+        shadow_forget_ifindex(ifindex);
     kdebugf("filter_interfaces: link change on if %s(%d): 0x%x\n",
             link->ifname, ifindex, (unsigned)ifflags);
     return 1;
@@ -1708,6 +3358,28 @@ filter_netlink(struct nlmsghdr *nh, struct kernel_filter *filter)
     return 0;
 }
 
+/* The changes that the notifications received on nl can be about.  An
+   overrun doesn't say which of them were lost. */
+static int
+netlink_changes(struct netlink *nl)
+{
+    uint32_t groups = nl->sockaddr.nl_groups;
+    int changes = 0;
+
+    if(groups & rtnlgrp_to_mask(RTNLGRP_LINK))
+        changes |= CHANGE_LINK;
+    if(groups & (rtnlgrp_to_mask(RTNLGRP_IPV4_ROUTE) |
+                 rtnlgrp_to_mask(RTNLGRP_IPV6_ROUTE)))
+        changes |= CHANGE_ROUTE;
+    if(groups & (rtnlgrp_to_mask(RTNLGRP_IPV4_IFADDR) |
+                 rtnlgrp_to_mask(RTNLGRP_IPV6_IFADDR)))
+        changes |= CHANGE_ADDR;
+    if(groups & (rtnlgrp_to_mask(RTNLGRP_IPV4_RULE) |
+                 rtnlgrp_to_mask(RTNLGRP_IPV6_RULE)))
+        changes |= CHANGE_RULE;
+    return changes;
+}
+
 int
 kernel_callback(struct kernel_filter *filter)
 {
@@ -1724,28 +3396,57 @@ kernel_callback(struct kernel_filter *filter)
     }
     rc = netlink_read(&nl_listen, &nl_command, 0, filter);
 
+    if(rc == -2) {
+        /* Notifications were lost, deletions of our routes among them
+           perhaps; repair the kernel tables, and have the caller dump
+           what the lost notifications were about. */
+        kernel_check_fib();
+        return netlink_changes(&nl_listen);
+    }
+
     if(rc < 0 && nl_listen.sock < 0)
         kernel_setup_socket(1);
 
     return 0;
 }
 
+static void
+netlink_print_stats(FILE *out, const char *name, struct netlink *nl)
+{
+    long elapsed = now.tv_sec - nl->last_time;
+
+    fprintf(out, "Netlink %s: %lu messages", name, nl->messages);
+    if(nl->last_time > 0 && elapsed > 0)
+        fprintf(out, " (%lu/s)",
+                (nl->messages - nl->last_messages) / elapsed);
+    fprintf(out, ", %lu bytes, %lu overruns, buffer %d.\n",
+            nl->bytes, nl->overruns, nl->bufsize);
+    nl->last_messages = nl->messages;
+    nl->last_time = now.tv_sec;
+}
+
+void
+kernel_print_stats(FILE *out)
+{
+    netlink_print_stats(out, "command", &nl_command);
+    netlink_print_stats(out, "listen", &nl_listen);
+}
+
 
 /* Routing table's rules */
 
-int
-add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
+/* Fill buffer, which must hold at least 64 bytes, with a request of type
+   RTM_NEWRULE or RTM_DELRULE for the given rule. */
+static int
+rule_message(char *buffer, int type, int prio,
+             const unsigned char *src_prefix, int src_plen, int table)
 {
-    char buffer[128] = {0}; /* 56 needed */
     struct nlmsghdr *message_header = (void*)buffer;
     struct rtmsg *message = NULL;
     struct rtattr *current_attribute = NULL;
     int is_v4 = v4mapped(src_prefix);
     int addr_size = is_v4 ? sizeof(struct in_addr) : sizeof(struct in6_addr);
 
-    kdebugf("Add rule v%c prio %d from %s\n", is_v4 ? '4' : '6', prio,
-            format_prefix(src_prefix, src_plen));
-
     if(is_v4) {
         src_prefix += 12;
         src_plen -= 96;
@@ -1759,9 +3460,13 @@ add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 #error "RTA_ALIGNTO != NLMSG_ALIGNTO"
 #endif
 
+    memset(buffer, 0, 64);
+
     /* Set the header */
-    message_header->nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL;
-    message_header->nlmsg_type  = RTM_NEWRULE;
+    message_header->nlmsg_flags = NLM_F_REQUEST;
+    if(type == RTM_NEWRULE)
+        message_header->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+    message_header->nlmsg_type  = type;
     message_header->nlmsg_len   = NLMSG_ALIGN(sizeof(struct nlmsghdr));
 
     /* Append the message */
@@ -1773,7 +3478,7 @@ add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
     message->rtm_table = table;
     message->rtm_protocol = RTPROT_BABEL;
     message->rtm_scope = RT_SCOPE_UNIVERSE;
-    message->rtm_type = RTN_UNICAST;
+    message->rtm_type = type == RTM_NEWRULE ? RTN_UNICAST : RTN_UNSPEC;
     message->rtm_flags = 0;
     message_header->nlmsg_len += NLMSG_ALIGN(sizeof(struct rtmsg));
 
@@ -1797,76 +3502,137 @@ add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
     current_attribute = (void*)
         ((char*)current_attribute) + current_attribute->rta_len;
 
-    /* send message */
     if(message_header->nlmsg_len > 64) {
         errno = EINVAL;
         return -1;
     }
-    return netlink_talk(message_header);
+    return message_header->nlmsg_len;
 }
 
 int
-flush_rule(int prio, int family)
+add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
-    char buffer[128] = {0}; /* 36 needed */
-    struct nlmsghdr *message_header = (void*)buffer;
-    struct rtmsg *message = NULL;
-    struct rtattr *current_attribute = NULL;
+    char buffer[128]; /* 56 needed */
+    int rc;
 
-    memset(buffer, 0, sizeof(buffer));
+    kdebugf("Add rule v%c prio %d from %s\n",
+            v4mapped(src_prefix) ? '4' : '6', prio,
+            format_prefix(src_prefix, src_plen));
 
-    kdebugf("Flush rule v%c prio %d\n", family == AF_INET ? '4' : '6', prio);
+    rc = rule_message(buffer, RTM_NEWRULE, prio, src_prefix, src_plen, table);
+    if(rc < 0)
+        return -1;
+    return netlink_talk((struct nlmsghdr*)buffer);
+}
 
-#if RTA_ALIGNTO != NLMSG_ALIGNTO
-#error "RTA_ALIGNTO != NLMSG_ALIGNTO"
-#endif
+/* Delete exactly this rule, and not whatever else is at prio. */
+int
+flush_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
+{
+    char buffer[128]; /* 56 needed */
+    int rc;
 
-    /* Set the header */
-    message_header->nlmsg_flags = NLM_F_REQUEST;
-    message_header->nlmsg_type  = RTM_DELRULE;
-    message_header->nlmsg_len   = NLMSG_ALIGN(sizeof(struct nlmsghdr));
+    kdebugf("Flush rule v%c prio %d from %s table %d\n",
+            v4mapped(src_prefix) ? '4' : '6', prio,
+            format_prefix(src_prefix, src_plen), table);
 
-    /* Append the message */
-    message = NLMSG_DATA(message_header);
-    message->rtm_family = family;
-    message->rtm_dst_len = 0;
-    message->rtm_src_len = 0;
-    message->rtm_tos = 0;
-    message->rtm_table = 0;
-    message->rtm_protocol = RTPROT_BABEL;
-    message->rtm_scope = RT_SCOPE_UNIVERSE;
-    message->rtm_type = RTN_UNSPEC;
-    message->rtm_flags = 0;
-    message_header->nlmsg_len += NLMSG_ALIGN(sizeof(struct rtmsg));
+    rc = rule_message(buffer, RTM_DELRULE, prio, src_prefix, src_plen, table);
+    if(rc < 0)
+        return -1;
+    return netlink_talk((struct nlmsghdr*)buffer);
+}
 
-    /* Append each attribute */
-    current_attribute = RTM_RTA(message);
-    /* prio */
-    current_attribute->rta_len = RTA_LENGTH(sizeof(int));
-    current_attribute->rta_type = FRA_PRIORITY;
-    *(int*)RTA_DATA(current_attribute) = prio;
+/* Move n rules to new priorities: add every rule at its new priority,
+   then delete every old one, all in a single sendmsg.  Each rule is in
+   the kernel at one priority or the other throughout, and deletions name
+   the rule completely so that they cannot hit a rule just added. */
+int
+change_rules(const struct kernel_rule *old, const struct kernel_rule *new,
+             int n)
+{
+    struct sockaddr_nl nladdr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct nlmsghdr *nh;
+    char *buffer;
+    int i, rc, len = 0, errors = 0, failed = 0, saved_errno = 0;
 
-    message_header->nlmsg_len += current_attribute->rta_len;
-    current_attribute = (void*)
-        ((char*)current_attribute) + current_attribute->rta_len;
+    if(n <= 0)
+        return 0;
 
-    /* send message */
-    if(message_header->nlmsg_len > 64) {
-        errno = EINVAL;
+    buffer = malloc(2 * n * 64);
+    if(buffer == NULL)
         return -1;
+
+    /* Keep the kernel's view of our requests in order. */
+    fib_flush();
+
+    nl_command.seqno++;
+    for(i = 0; i < 2 * n; i++) {
+        const struct kernel_rule *rule = i < n ? &new[i] : &old[i - n];
+        kdebugf("%s rule prio %d from %s (batch)\n",
+                i < n ? "Add" : "Flush", rule->priority,
+                format_prefix(rule->src, rule->src_plen));
+        nh = (struct nlmsghdr*)(buffer + len);
+        rc = rule_message((char*)nh, i < n ? RTM_NEWRULE : RTM_DELRULE,
+                          rule->priority, rule->src, rule->src_plen,
+                          rule->table);
+        if(rc < 0) {
+            free(buffer);
+            return -1;
+        }
+        nh->nlmsg_flags |= NLM_F_ACK;
+        nh->nlmsg_seq = nl_command.seqno;
+        len += NLMSG_ALIGN(rc);
     }
-    return netlink_talk(message_header);
-}
 
-int
-change_rule(int new_prio, int old_prio,
-            const unsigned char *src, int plen, int table)
-{
-    int rc;
-    kdebugf("/Swap: ");
-    rc = add_rule(new_prio, src, plen, table);
-    if(rc < 0)
-        return rc;
-    kdebugf("\\Swap: ");
-    return flush_rule(old_prio, v4mapped(src) ? AF_INET : AF_INET6);
+    memset(&nladdr, 0, sizeof(nladdr));
+    nladdr.nl_family = AF_NETLINK;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &nladdr;
+    msg.msg_namelen = sizeof(nladdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+
+    do {
+        rc = sendmsg(nl_command.sock, &msg, MSG_DONTWAIT);
+        if(rc < 0) {
+            errors++;
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == ENOBUFS) {
+                wait_for_fd(1, nl_command.sock, 5);
+                continue;
+            }
+            break;
+        }
+    } while(rc < 0 && errors < 5);
+    free(buffer);
+
+    if(rc < len) {
+        if(rc >= 0)
+            errno = EIO;
+        return -1;
+    }
+
+    /* The kernel acknowledges each request on its own. */
+    for(i = 0; i < 2 * n; i++) {
+        rc = netlink_read(&nl_command, NULL, 1, NULL);
+        if(rc < 0) {
+            if(errno == EAGAIN || errno == ENOBUFS)
+                return -1;
+            saved_errno = errno;
+            failed++;
+        }
+    }
+
+    if(failed > 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
 }
@@ -400,13 +400,41 @@ kernel_has_ipv6_subtrees(void)
     return 0;
 }
 
+int
+kernel_has_nexthops(void)
+{
+    return 0;
+}
+
+int
+kernel_flush_nexthop(const unsigned char *gate, int ifindex)
+{
+    return 0;
+}
+
+int
+kernel_failover_nexthop(const unsigned char *gate, int ifindex)
+{
+    return 0;
+}
+
+int
+kernel_check_fib(void)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 int
 kernel_route(int operation, int table,
              const unsigned char *dest, unsigned short plen,
              const unsigned char *src, unsigned short src_plen,
              const unsigned char *gate, int ifindex, unsigned int metric,
              const unsigned char *newgate, int newifindex,
-             unsigned int newmetric, int newtable)
+             unsigned int newmetric, int newtable,
+             const unsigned char *backup, int backup_ifindex,
+             const struct kernel_multipath *paths, int numpaths,
+             int expires)
 {
     struct {
         struct rt_msghdr m_rtm;
@@ -452,11 +480,11 @@ kernel_route(int operation, int table,
         kernel_route(ROUTE_FLUSH, table, dest, plen,
                      src, src_plen,
                      gate, ifindex, metric,
-                     NULL, 0, 0, 0);
+                     NULL, 0, 0, 0, NULL, 0, NULL, 0, 0);
         return kernel_route(ROUTE_ADD, table, dest, plen,
                             src, src_plen,
                             newgate, newifindex, newmetric,
-                            NULL, 0, 0, 0);
+                            NULL, 0, 0, 0, NULL, 0, NULL, 0, 0);
 
     }
 
@@ -825,6 +853,29 @@ kernel_addresses(struct kernel_filter *filter)
     return 0;
 }
 
+/* Routing sockets don't acknowledge requests, so route operations are
+   still performed synchronously. */
+
+int
+kernel_flush_routes(void)
+{
+    return 0;
+}
+
+void
+kernel_route_callback(int (*failed)(struct kernel_route_error *, void *),
+                      void *closure)
+{
+    return;
+}
+
+void
+kernel_fib_callback(int (*wanted)(int, struct kernel_route *, void *),
+                    void (*reinstall)(void *), void *closure)
+{
+    return;
+}
+
 int
 kernel_dump(int operation, struct kernel_filter *filter)
 {
@@ -849,6 +900,11 @@ kernel_callback(struct kernel_filter *filter)
 
 }
 
+void
+kernel_print_stats(FILE *out)
+{
+}
+
 int
 add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
@@ -857,15 +913,15 @@ add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 }
 
 int
-flush_rule(int prio, int family)
+flush_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
     errno = ENOSYS;
     return -1;
 }
 
 int
-change_rule(int new_prio, int old_prio,
-            const unsigned char *src, int plen, int table)
+change_rules(const struct kernel_rule *old, const struct kernel_rule *new,
+             int n)
 {
     errno = ENOSYS;
     return -1;
@@ -23,11 +23,13 @@ THE SOFTWARE.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <sys/socket.h>
 
 #include "babeld.h"
 #include "interface.h"
@@ -47,36 +49,241 @@ int num_local_sockets = 0;
 int local_server_port = -1;
 char *local_server_path;
 int local_server_write = 0;
+int local_batch_interval = 0;
+struct local_filter local_monitor_request;
+struct timeval local_batch_timeout = {0, 0};
 
+int local_overflow = LOCAL_OVERFLOW_RESYNC;
+int local_buffer_size = LOCAL_OUTSIZE;
+
+static const char resync_marker[] = "resync\n";
+static const unsigned char resync_record[LOCAL_RECORD_HEADER] =
+    {LOCAL_RECORD_RESYNC, 0, 0, LOCAL_RECORD_HEADER};
+
+static const char *
+local_marker(struct local_socket *s, int *len_return)
+{
+    if(s->binary) {
+        *len_return = sizeof(resync_record);
+        return (const char*)resync_record;
+    }
+    *len_return = sizeof(resync_marker) - 1;
+    return resync_marker;
+}
+
+static unsigned char
+out_byte(struct local_socket *s, int i)
+{
+    return s->out[(s->outstart + i) % s->outsize];
+}
+
+/* The length of the line or record starting at offset i of the ring. */
 static int
-write_timeout(int fd, const void *buf, int len)
+out_record(struct local_socket *s, int i)
 {
-    int n = 0, rc = 0;
-    const char *b = buf;
+    int j = i;
+    if(s->binary)
+        return (out_byte(s, i + 2) << 8) | out_byte(s, i + 3);
+    while(out_byte(s, j) != '\n')
+        j++;
+    return j + 1 - i;
+}
 
-    while(n < len) {
-        rc = write(fd, b + n, len - n);
+static void
+out_append(struct local_socket *s, const char *buf, int len)
+{
+    int end = (s->outstart + s->outlen) % s->outsize;
+    int n = MIN(len, s->outsize - end);
+
+    memcpy(s->out + end, buf, n);
+    memcpy(s->out, buf + n, len - n);
+    s->outlen += len;
+}
+
+/* Make the ring large enough for len more bytes. */
+static int
+out_grow(struct local_socket *s, int len)
+{
+    int size = s->outsize, n;
+    char *out;
+
+    while(size - s->outlen < len)
+        size *= 2;
+    out = malloc(size);
+    if(out == NULL)
+        return -1;
+    n = MIN(s->outlen, s->outsize - s->outstart);
+    memcpy(out, s->out + s->outstart, n);
+    memcpy(out + n, s->out, s->outlen - n);
+    free(s->out);
+    s->out = out;
+    s->outsize = size;
+    s->outstart = 0;
+    return 1;
+}
+
+/* Drop the oldest lines until there is room for len bytes.  A line that
+   has been partly written must go out whole, and so must a reply, so we
+   drop the lines after them and move them forward. */
+static int
+out_drop(struct local_socket *s, int len)
+{
+    int keep = MAX(s->partial, s->pinned), drop = 0, i;
+
+    while(s->outsize - s->outlen + drop < len) {
+        if(keep + drop >= s->outlen)
+            return -1;
+        drop += out_record(s, keep + drop);
+    }
+
+    for(i = keep - 1; i >= 0; i--)
+        s->out[(s->outstart + drop + i) % s->outsize] = out_byte(s, i);
+    s->outstart = (s->outstart + drop) % s->outsize;
+    s->outlen -= drop;
+    return 1;
+}
+
+static void
+local_fail(struct local_socket *s)
+{
+    s->outlen = 0;
+    s->pinned = 0;
+    s->resync = 0;
+    s->closing = 1;
+    /* The main loop will see end of file and get rid of the socket. */
+    shutdown(s->fd, SHUT_RDWR);
+}
+
+/* Write out as much of the ring as the socket will take. */
+int
+local_flush(struct local_socket *s)
+{
+    const char *marker;
+    int n, i, rc;
+
+    while(1) {
+        marker = local_marker(s, &n);
+        if(s->resync && s->outsize - s->outlen >= n) {
+            out_append(s, marker, n);
+            s->resync = 0;
+        }
+        if(s->outlen == 0)
+            break;
+        n = MIN(s->outlen, s->outsize - s->outstart);
+        rc = write(s->fd, s->out + s->outstart, n);
         if(rc < 0) {
-            if(errno == EAGAIN || errno == EINTR) {
-                rc = wait_for_fd(1, fd, 100);
-                if(rc > 0) {
-                    rc = write(fd, b + n, len - n);
-                }
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN)
+                return 0;
+            local_fail(s);
+            return -1;
+        }
+        if(rc == 0)
+            return 0;
+        i = s->partial;
+        while(i < rc)
+            i += out_record(s, i);
+        s->partial = i - rc;
+        s->pinned = MAX(s->pinned - rc, 0);
+        s->outstart = (s->outstart + rc) % s->outsize;
+        s->outlen -= rc;
+    }
+
+    /* A reply has grown the ring; start afresh at the usual size. */
+    if(s->outsize > local_buffer_size) {
+        free(s->out);
+        s->out = NULL;
+        s->outsize = 0;
+    }
+
+    if(s->closing)
+        shutdown(s->fd, 1);
+    return 1;
+}
+
+/* Send one or more complete lines to the client.  We only queue when
+   the socket is full, and apply local_overflow when the ring is full
+   too, except to replies, which grow the ring.  Returns 0 if the lines
+   were dropped. */
+static int
+local_write(struct local_socket *s, const char *buf, int len)
+{
+    const char *marker;
+    int n, rc;
+
+    if(s->closing)
+        return 0;
+
+    if(s->outlen == 0 && !s->resync) {
+        rc = write(s->fd, buf, len);
+        if(rc < 0) {
+            if(errno != EAGAIN && errno != EINTR) {
+                local_fail(s);
+                return -1;
             }
+            rc = 0;
         }
-        if(rc > 0)
-            n += rc;
-        else
-            break;
+        if(rc >= len)
+            return 1;
+        s->partial = rc > 0 ? len - rc : 0;
+        buf += rc;
+        len -= rc;
     }
 
-    if(n >= len)
-        return 1;
-    else {
-        if(rc >= 0)
-            errno = EAGAIN;
-        return -1;
+    if(s->out == NULL) {
+        s->out = malloc(local_buffer_size);
+        if(s->out == NULL) {
+            local_fail(s);
+            return -1;
+        }
+        s->outsize = local_buffer_size;
+        s->outstart = 0;
+    }
+
+    if(s->resync) {
+        marker = local_marker(s, &n);
+        if(s->outsize - s->outlen < len + n &&
+           (!s->replying || out_grow(s, len + n) < 0))
+            return 0;
+        out_append(s, marker, n);
+        s->resync = 0;
+    }
+
+    if(s->outsize - s->outlen < len && s->replying) {
+        if(out_grow(s, len) < 0) {
+            local_fail(s);
+            return -1;
+        }
+    } else if(s->outsize - s->outlen < len) {
+        switch(local_overflow) {
+        case LOCAL_OVERFLOW_DROP:
+            rc = out_drop(s, len);
+            if(rc < 0)
+                return 0;
+            break;
+        case LOCAL_OVERFLOW_RESYNC:
+            s->resync = 1;
+            return 0;
+        default:
+            local_fail(s);
+            return -1;
+        }
     }
+
+    out_append(s, buf, len);
+    if(s->replying)
+        s->pinned = s->outlen;
+    return 1;
+}
+
+/* Shut the socket down once the client has read what is queued. */
+static void
+local_close(struct local_socket *s)
+{
+    s->closing = 1;
+    if(s->outlen == 0 && !s->resync)
+        shutdown(s->fd, 1);
 }
 
 static const char *
@@ -90,11 +297,10 @@ local_kind(int kind)
     }
 }
 
-static void
-local_notify_interface_1(struct local_socket *s,
-                         struct interface *ifp, int kind)
+static int
+format_interface(char *buf, struct interface *ifp, int kind)
 {
-    char buf[512], v4[INET_ADDRSTRLEN];
+    char v4[INET_ADDRSTRLEN];
     int rc;
     int up;
 
@@ -105,49 +311,34 @@ local_notify_interface_1(struct local_socket *s,
         v4[0] = '\0';
     if(up)
         rc = snprintf(buf, 512,
-                      "%s interface %s up true%s%s%s%s\n",
+                      "%s interface %s up true%s%s%s%s "
+                      "transport %s reason %s\n",
                       local_kind(kind), ifp->name,
                       ifp->ll ? " ipv6 " : "",
                       ifp->ll ? format_address(*ifp->ll) : "",
-                      v4[0] ? " ipv4 " : "", v4);
+                      v4[0] ? " ipv4 " : "", v4,
+                      interface_transport(ifp),
+                      interface_transport_reason(ifp));
     else
         rc = snprintf(buf, 512, "%s interface %s up false\n",
                       local_kind(kind), ifp->name);
 
     if(rc < 0 || rc >= 512)
-        goto fail;
-
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
-}
-
-void
-local_notify_interface(struct interface *ifp, int kind)
-{
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_interface_1(&local_sockets[i], ifp, kind);
-    }
+        return -1;
+    return rc;
 }
 
-static void
-local_notify_neighbour_1(struct local_socket *s,
-                         struct neighbour *neigh, int kind)
+static int
+format_neighbour(char *buf, struct neighbour *neigh, int kind)
 {
-    char buf[512], rttbuf[64];
+    char rttbuf[64];
     int rc;
 
     rttbuf[0] = '\0';
     if(valid_rtt(neigh)) {
-        rc = snprintf(rttbuf, 64, " rtt %s rttcost %d",
-                      format_thousands(neigh->rtt), neighbour_rttcost(neigh));
+        rc = snprintf(rttbuf, 64, " rtt %s rttcost %d rto %d",
+                      format_thousands(neigh->rtt), neighbour_rttcost(neigh),
+                      neighbour_rto(neigh));
         if(rc < 0 || rc >= 64)
             rttbuf[0] = '\0';
     }
@@ -168,32 +359,13 @@ local_notify_neighbour_1(struct local_socket *s,
                   neighbour_cost(neigh));
 
     if(rc < 0 || rc >= 512)
-        goto fail;
-
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
-}
-
-void
-local_notify_neighbour(struct neighbour *neigh, int kind)
-{
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_neighbour_1(&local_sockets[i], neigh, kind);
-    }
+        return -1;
+    return rc;
 }
 
-static void
-local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
+static int
+format_xroute(char *buf, struct xroute *xroute, int kind)
 {
-    char buf[512];
     int rc;
     const char *dst_prefix = format_prefix(xroute->prefix,
                                            xroute->plen);
@@ -206,32 +378,13 @@ local_notify_xroute_1(struct local_socket *s, struct xroute *xroute, int kind)
                   dst_prefix, src_prefix, xroute->metric, xroute->expires);
 
     if(rc < 0 || rc >= 512)
-        goto fail;
-
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
-
- fail:
-    shutdown(s->fd, 1);
-    return;
-}
-
-void
-local_notify_xroute(struct xroute *xroute, int kind)
-{
-    int i;
-    for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_xroute_1(&local_sockets[i], xroute, kind);
-    }
+        return -1;
+    return rc;
 }
 
-static void
-local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind)
+static int
+format_route(char *buf, struct babel_route *route, int kind)
 {
-    char buf[512];
     int rc;
     const char *dst_prefix = format_prefix(route->src->prefix,
                                            route->src->plen);
@@ -253,42 +406,670 @@ local_notify_route_1(struct local_socket *s, struct babel_route *route, int kind
                   route->neigh->ifp->name);
 
     if(rc < 0 || rc >= 512)
-        goto fail;
+        return -1;
+    return rc;
+}
 
-    rc = write_timeout(s->fd, buf, rc);
-    if(rc < 0)
-        goto fail;
-    return;
+/* Binary records; see local.h. */
 
- fail:
-    shutdown(s->fd, 1);
-    return;
+static int
+put_header(unsigned char *buf, int type, int kind, int len)
+{
+    buf[0] = type;
+    buf[1] = kind;
+    DO_HTONS(buf + 2, len);
+    return len;
+}
+
+static void
+put_id(unsigned char *buf, const void *object)
+{
+    uint64_t id = (uintptr_t)object;
+    DO_HTONL(buf, (unsigned)(id >> 32));
+    DO_HTONL(buf + 4, (unsigned)id);
+}
+
+static void
+put_name(unsigned char *buf, const char *name)
+{
+    memcpy(buf, name, MIN(strlen(name), 15));
+}
+
+static int
+encode_interface(unsigned char *buf, struct interface *ifp, int kind)
+{
+    int up = if_up(ifp);
+
+    memset(buf, 0, 80);
+    DO_HTONL(buf + 4, ifp->ifindex);
+    buf[8] = up;
+    put_name(buf + 12, ifp->name);
+    if(up) {
+        if(ifp->ll) {
+            buf[9] |= 1;
+            memcpy(buf + 28, *ifp->ll, 16);
+        }
+        if(ifp->ipv4) {
+            buf[9] |= 2;
+            memcpy(buf + 44, ifp->ipv4, 4);
+        }
+        put_name(buf + 48, interface_transport(ifp));
+        put_name(buf + 64, interface_transport_reason(ifp));
+    }
+    return put_header(buf, LOCAL_RECORD_INTERFACE, kind, 80);
+}
+
+static int
+encode_neighbour(unsigned char *buf, struct neighbour *neigh, int kind)
+{
+    memset(buf, 0, 64);
+    put_id(buf + 4, neigh);
+    memcpy(buf + 12, neigh->address, 16);
+    put_name(buf + 28, neigh->ifp->name);
+    DO_HTONS(buf + 44, neigh->reach);
+    DO_HTONS(buf + 46, neighbour_rxcost(neigh));
+    DO_HTONS(buf + 48, neighbour_txcost(neigh));
+    DO_HTONS(buf + 50, neighbour_cost(neigh));
+    if(valid_rtt(neigh)) {
+        buf[52] = 1;
+        DO_HTONS(buf + 54, neighbour_rttcost(neigh));
+        DO_HTONL(buf + 56, neigh->rtt);
+        DO_HTONL(buf + 60, neighbour_rto(neigh));
+    }
+    return put_header(buf, LOCAL_RECORD_NEIGHBOUR, kind, 64);
+}
+
+static int
+encode_xroute(unsigned char *buf, struct xroute *xroute, int kind)
+{
+    memcpy(buf + 4, xroute->prefix, 16);
+    memcpy(buf + 20, xroute->src_prefix, 16);
+    buf[36] = xroute->plen;
+    buf[37] = xroute->src_plen;
+    DO_HTONS(buf + 38, xroute->metric);
+    DO_HTONL(buf + 40, xroute->expires);
+    return put_header(buf, LOCAL_RECORD_XROUTE, kind, 44);
+}
+
+static int
+encode_route(unsigned char *buf, struct babel_route *route, int kind)
+{
+    memset(buf, 0, 96);
+    put_id(buf + 4, route);
+    memcpy(buf + 12, route->src->prefix, 16);
+    memcpy(buf + 28, route->src->src_prefix, 16);
+    buf[44] = route->src->plen;
+    buf[45] = route->src->src_plen;
+    buf[46] = route->installed;
+    memcpy(buf + 48, route->src->id, 8);
+    DO_HTONS(buf + 56, route_metric(route));
+    DO_HTONS(buf + 58, route->refmetric);
+    memcpy(buf + 60, route->neigh->address, 16);
+    put_name(buf + 76, route->neigh->ifp->name);
+    DO_HTONL(buf + 92, route->expires);
+    return put_header(buf, LOCAL_RECORD_ROUTE, kind, 96);
+}
+
+static int
+encode_event(unsigned char *buf, int type, void *object, int kind)
+{
+    switch(type) {
+    case EVENT_INTERFACE: return encode_interface(buf, object, kind);
+    case EVENT_NEIGHBOUR: return encode_neighbour(buf, object, kind);
+    case EVENT_XROUTE: return encode_xroute(buf, object, kind);
+    case EVENT_ROUTE: return encode_route(buf, object, kind);
+    default: abort();
+    }
+}
+
+static void
+local_send(struct local_socket *s, const char *buf, int len)
+{
+    if(len < 0)
+        local_close(s);
+    else
+        local_write(s, buf, len);
+}
+
+static int
+format_event(char *buf, int type, void *object, int kind)
+{
+    switch(type) {
+    case EVENT_INTERFACE: return format_interface(buf, object, kind);
+    case EVENT_NEIGHBOUR: return format_neighbour(buf, object, kind);
+    case EVENT_XROUTE: return format_xroute(buf, object, kind);
+    case EVENT_ROUTE: return format_route(buf, object, kind);
+    default: abort();
+    }
+}
+
+/* What monitor filters look at, extracted from an object before
+   anything is formatted.  Interfaces and neighbours have no prefix,
+   xroutes no interface. */
+
+struct local_subject {
+    int type;
+    unsigned char prefix[16];
+    unsigned char plen;
+    char ifname[IF_NAMESIZE];
+};
+
+/* The union of the types subscribed to, so that events nobody wants
+   cost a single test. */
+static int monitored_types = 0;
+
+static void
+update_monitored(void)
+{
+    int i;
+    monitored_types = 0;
+    for(i = 0; i < num_local_sockets; i++) {
+        if(local_sockets[i].monitor)
+            monitored_types |= local_sockets[i].filter.types;
+    }
+}
+
+static void
+set_filter(struct local_socket *s, struct local_filter *filter)
+{
+    free(s->filter.ifname);
+    if(filter != NULL) {
+        s->filter = *filter;
+        if(s->filter.types == 0)
+            s->filter.types = (1 << EVENT_INTERFACE) |
+                (1 << EVENT_NEIGHBOUR) | (1 << EVENT_XROUTE) |
+                (1 << EVENT_ROUTE);
+    } else {
+        memset(&s->filter, 0, sizeof(s->filter));
+    }
+}
+
+static void
+get_subject(struct local_subject *subject, int type, void *object)
+{
+    const char *ifname = NULL;
+
+    memset(subject, 0, sizeof(*subject));
+    subject->type = type;
+    switch(type) {
+    case EVENT_INTERFACE:
+        ifname = ((struct interface*)object)->name;
+        break;
+    case EVENT_NEIGHBOUR:
+        ifname = ((struct neighbour*)object)->ifp->name;
+        break;
+    case EVENT_XROUTE: {
+        struct xroute *xroute = object;
+        memcpy(subject->prefix, xroute->prefix, 16);
+        subject->plen = xroute->plen;
+        break;
+    }
+    case EVENT_ROUTE: {
+        struct babel_route *route = object;
+        memcpy(subject->prefix, route->src->prefix, 16);
+        subject->plen = route->src->plen;
+        ifname = route->neigh->ifp->name;
+        break;
+    }
+    }
+    if(ifname != NULL)
+        memcpy(subject->ifname, ifname, MIN(strlen(ifname), IF_NAMESIZE - 1));
+}
+
+static int
+local_wants(struct local_socket *s, const struct local_subject *subject)
+{
+    const struct local_filter *filter = &s->filter;
+    int i;
+
+    if(!s->monitor || !(filter->types & (1 << subject->type)))
+        return 0;
+    if(filter->ifname != NULL && subject->ifname[0] != '\0' &&
+       strcmp(filter->ifname, subject->ifname) != 0)
+        return 0;
+    if(filter->numprefixes > 0 &&
+       (subject->type == EVENT_XROUTE || subject->type == EVENT_ROUTE)) {
+        for(i = 0; i < filter->numprefixes; i++) {
+            if(subject->plen >= filter->plens[i] &&
+               in_prefix(subject->prefix, filter->prefixes[i],
+                         filter->plens[i]))
+                return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+#define FORMAT_TEXT 1
+#define FORMAT_BINARY 2
+
+/* The formats wanted by the clients interested in subject, 0 if there
+   are none. */
+static int
+wanted_formats(const struct local_subject *subject)
+{
+    int i, formats = 0;
+    for(i = 0; i < num_local_sockets; i++) {
+        if(local_wants(&local_sockets[i], subject))
+            formats |= local_sockets[i].binary ? FORMAT_BINARY : FORMAT_TEXT;
+    }
+    return formats;
+}
+
+/* Monitor events are either sent straight away, or, when
+   monitor-batch-interval is set, coalesced into a table holding the
+   latest kind of event for each object, which is sent as a numbered
+   batch when the interval expires.  Objects are identified by their
+   address, except xroutes, which move around in memory, and by what
+   they stand for, since a freed object's memory may be reused by
+   another one; add and change events are formatted when the batch is
+   sent, flush events right away, since the object is about to be
+   freed. */
+
+struct local_event {
+    int type;
+    void *object;               /* NULL for xroutes */
+    unsigned char prefix[16], src_prefix[16];
+    unsigned char plen, src_plen;
+    unsigned char address[16];  /* of the neighbour */
+    char ifname[IF_NAMESIZE];
+    int kind;
+    struct local_subject subject;
+    /* Flush events, in both formats. */
+    char *line;
+    unsigned char *record;
+    int reclen;
+};
+
+static struct local_event *events = NULL;
+static int numevents = 0, maxevents = 0;
+static unsigned int batch_seqno = 0;
+
+static int
+event_compare(const struct local_event *e1, const struct local_event *e2)
+{
+    int rc;
+
+    if(e1->type != e2->type)
+        return e1->type < e2->type ? -1 : 1;
+    if(e1->object != e2->object)
+        return (uintptr_t)e1->object < (uintptr_t)e2->object ? -1 : 1;
+    rc = memcmp(e1->prefix, e2->prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(e1->plen != e2->plen)
+        return e1->plen < e2->plen ? -1 : 1;
+    rc = memcmp(e1->src_prefix, e2->src_prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(e1->src_plen != e2->src_plen)
+        return e1->src_plen < e2->src_plen ? -1 : 1;
+    rc = memcmp(e1->address, e2->address, 16);
+    if(rc != 0)
+        return rc;
+    return strncmp(e1->ifname, e2->ifname, IF_NAMESIZE);
+}
+
+static void
+event_key(struct local_event *key, int type, void *object)
+{
+    struct neighbour *neigh = NULL;
+    const char *ifname = NULL;
+
+    memset(key, 0, sizeof(*key));
+    key->type = type;
+    switch(type) {
+    case EVENT_INTERFACE:
+        ifname = ((struct interface*)object)->name;
+        break;
+    case EVENT_NEIGHBOUR:
+        neigh = object;
+        break;
+    case EVENT_XROUTE: {
+        struct xroute *xroute = object;
+        memcpy(key->prefix, xroute->prefix, 16);
+        memcpy(key->src_prefix, xroute->src_prefix, 16);
+        key->plen = xroute->plen;
+        key->src_plen = xroute->src_plen;
+        return;
+    }
+    case EVENT_ROUTE: {
+        struct babel_route *route = object;
+        memcpy(key->prefix, route->src->prefix, 16);
+        memcpy(key->src_prefix, route->src->src_prefix, 16);
+        key->plen = route->src->plen;
+        key->src_plen = route->src->src_plen;
+        neigh = route->neigh;
+        break;
+    }
+    }
+    key->object = object;
+    if(neigh != NULL) {
+        memcpy(key->address, neigh->address, 16);
+        ifname = neigh->ifp->name;
+    }
+    if(ifname != NULL)
+        memcpy(key->ifname, ifname, MIN(strlen(ifname), IF_NAMESIZE - 1));
+}
+
+static int
+event_position(const struct local_event *key, int *found_return)
+{
+    int p, m, g, c;
+
+    *found_return = 0;
+    p = 0;
+    g = numevents - 1;
+    while(p <= g) {
+        m = (p + g) / 2;
+        c = event_compare(key, &events[m]);
+        if(c == 0) {
+            *found_return = 1;
+            return m;
+        } else if(c < 0) {
+            g = m - 1;
+        } else {
+            p = m + 1;
+        }
+    }
+    return p;
+}
+
+static void
+clear_event(struct local_event *e)
+{
+    free(e->line);
+    e->line = NULL;
+    free(e->record);
+    e->record = NULL;
+}
+
+static void
+remove_event(int i)
+{
+    clear_event(&events[i]);
+    if(i < numevents - 1)
+        memmove(events + i, events + i + 1,
+                (numevents - i - 1) * sizeof(struct local_event));
+    numevents--;
+}
+
+static void
+queue_event(const struct local_subject *subject, void *object, int kind)
+{
+    int type = subject->type;
+    struct local_event key, *e;
+    char buf[512];
+    unsigned char record[LOCAL_RECORD_MAX];
+    int i, found, rc;
+
+    event_key(&key, type, object);
+
+    i = event_position(&key, &found);
+    if(found) {
+        e = &events[i];
+        if(kind == LOCAL_FLUSH && e->kind == LOCAL_ADD) {
+            /* Nobody has heard of it. */
+            remove_event(i);
+            return;
+        }
+        if(kind != LOCAL_FLUSH) {
+            /* An object that went away and came back again at the same
+               place is seen as changed. */
+            if(e->kind == LOCAL_FLUSH) {
+                clear_event(e);
+                e->kind = LOCAL_CHANGE;
+                e->subject = *subject;
+            }
+            return;
+        }
+    } else {
+        if(numevents >= maxevents) {
+            int n = maxevents < 1 ? 8 : 2 * maxevents;
+            struct local_event *new_events =
+                realloc(events, n * sizeof(struct local_event));
+            if(new_events == NULL) {
+                perror("malloc(local_event)");
+                return;
+            }
+            events = new_events;
+            maxevents = n;
+        }
+        if(i < numevents)
+            memmove(events + i + 1, events + i,
+                    (numevents - i) * sizeof(struct local_event));
+        numevents++;
+        events[i] = key;
+        e = &events[i];
+        if(local_batch_timeout.tv_sec == 0)
+            timeval_add_msec(&local_batch_timeout, &now,
+                             local_batch_interval);
+    }
+
+    e->kind = kind;
+    e->subject = *subject;
+    if(kind == LOCAL_FLUSH) {
+        clear_event(e);
+        rc = format_event(buf, type, object, kind);
+        if(rc >= 0)
+            e->line = strdup(buf);
+        e->reclen = encode_event(record, type, object, kind);
+        e->record = malloc(e->reclen);
+        if(e->record != NULL)
+            memcpy(e->record, record, e->reclen);
+    }
+}
+
+static void
+local_notify(int type, void *object, int kind)
+{
+    struct local_subject subject;
+    char buf[512];
+    unsigned char record[LOCAL_RECORD_MAX];
+    int i, rc = -2, reclen = -2;
+
+    /* The interval was just set to zero. */
+    if(numevents > 0 && local_batch_interval <= 0)
+        local_notify_batch();
+
+    if(!(monitored_types & (1 << type)))
+        return;
+
+    get_subject(&subject, type, object);
+
+    if(local_batch_interval > 0) {
+        if(wanted_formats(&subject) != 0)
+            queue_event(&subject, object, kind);
+        return;
+    }
+
+    for(i = 0; i < num_local_sockets; i++) {
+        if(!local_wants(&local_sockets[i], &subject))
+            continue;
+        if(local_sockets[i].binary) {
+            if(reclen == -2)
+                reclen = encode_event(record, type, object, kind);
+            local_send(&local_sockets[i], (char*)record, reclen);
+        } else {
+            if(rc == -2)
+                rc = format_event(buf, type, object, kind);
+            local_send(&local_sockets[i], buf, rc);
+        }
+    }
+}
+
+void
+local_notify_interface(struct interface *ifp, int kind)
+{
+    local_notify(EVENT_INTERFACE, ifp, kind);
+}
+
+void
+local_notify_neighbour(struct neighbour *neigh, int kind)
+{
+    local_notify(EVENT_NEIGHBOUR, neigh, kind);
+}
+
+void
+local_notify_xroute(struct xroute *xroute, int kind)
+{
+    local_notify(EVENT_XROUTE, xroute, kind);
 }
 
 void
 local_notify_route(struct babel_route *route, int kind)
+{
+    local_notify(EVENT_ROUTE, route, kind);
+}
+
+/* Send to the clients interested in subject, or to those that are
+   part of the current batch if subject is NULL. */
+static void
+send_monitors(const struct local_subject *subject,
+              const char *buf, int len,
+              const unsigned char *record, int reclen)
 {
     int i;
     for(i = 0; i < num_local_sockets; i++) {
-        if(local_sockets[i].monitor)
-            local_notify_route_1(&local_sockets[i], route, kind);
+        if(subject ? !local_wants(&local_sockets[i], subject) :
+           !local_sockets[i].inbatch)
+            continue;
+        if(local_sockets[i].binary) {
+            if(record != NULL)
+                local_send(&local_sockets[i], (const char*)record, reclen);
+        } else {
+            if(buf != NULL)
+                local_send(&local_sockets[i], buf, len);
+        }
+    }
+}
+
+static void
+send_event(struct local_event *e)
+{
+    char buf[512];
+    unsigned char record[LOCAL_RECORD_MAX];
+    void *object = e->object;
+    int rc = -1, reclen = 0, formats;
+
+    if(e->kind == LOCAL_FLUSH) {
+        send_monitors(&e->subject, e->line, e->line ? strlen(e->line) : 0,
+                      e->record, e->reclen);
+        return;
+    }
+
+    formats = wanted_formats(&e->subject);
+    if(formats == 0)
+        return;
+
+    if(e->type == EVENT_XROUTE) {
+        object = find_xroute(e->prefix, e->plen, e->src_prefix, e->src_plen);
+        if(object == NULL)
+            return;
     }
+    if(formats & FORMAT_TEXT)
+        rc = format_event(buf, e->type, object, e->kind);
+    if(formats & FORMAT_BINARY)
+        reclen = encode_event(record, e->type, object, e->kind);
+    send_monitors(&e->subject, (formats & FORMAT_TEXT) ? buf : NULL, rc,
+                  (formats & FORMAT_BINARY) ? record : NULL, reclen);
 }
 
 static void
-local_notify_all_1(struct local_socket *s)
+send_boundary(int begin)
+{
+    char buf[64];
+    unsigned char record[8];
+    int rc;
+
+    rc = snprintf(buf, 64, "%s batch %u\n", begin ? "begin" : "end",
+                  batch_seqno);
+    DO_HTONL(record + 4, batch_seqno);
+    put_header(record,
+               begin ? LOCAL_RECORD_BEGIN_BATCH : LOCAL_RECORD_END_BATCH,
+               0, 8);
+    send_monitors(NULL, buf, rc, record, 8);
+}
+
+/* Send the pending events as a single batch.  Additions and changes go
+   out first, interfaces before the neighbours and routes that refer to
+   them, then the flushes in the opposite order. */
+void
+local_notify_batch(void)
+{
+    int i, j, any = 0;
+
+    local_batch_timeout.tv_sec = 0;
+    local_batch_timeout.tv_usec = 0;
+
+    /* Clients whose subscription matches nothing get no batch at all. */
+    for(j = 0; j < num_local_sockets; j++) {
+        local_sockets[j].inbatch = 0;
+        for(i = 0; i < numevents; i++) {
+            if(local_wants(&local_sockets[j], &events[i].subject)) {
+                local_sockets[j].inbatch = 1;
+                any = 1;
+                break;
+            }
+        }
+    }
+
+    if(any) {
+        batch_seqno++;
+        send_boundary(1);
+        for(i = 0; i < numevents; i++) {
+            if(events[i].kind != LOCAL_FLUSH)
+                send_event(&events[i]);
+        }
+        for(i = numevents - 1; i >= 0; i--) {
+            if(events[i].kind == LOCAL_FLUSH)
+                send_event(&events[i]);
+        }
+        send_boundary(0);
+    }
+
+    for(i = 0; i < numevents; i++)
+        clear_event(&events[i]);
+    numevents = 0;
+}
+
+static void
+send_object(struct local_socket *s, int type, void *object, int filtered)
+{
+    struct local_subject subject;
+    char buf[512];
+    unsigned char record[LOCAL_RECORD_MAX];
+
+    if(filtered) {
+        get_subject(&subject, type, object);
+        if(!local_wants(s, &subject))
+            return;
+    }
+
+    if(s->binary)
+        local_send(s, (char*)record,
+                   encode_event(record, type, object, LOCAL_ADD));
+    else
+        local_send(s, buf, format_event(buf, type, object, LOCAL_ADD));
+}
+
+/* Dump everything, or, for a new monitor, what it subscribed to. */
+static void
+local_notify_all_1(struct local_socket *s, int filtered)
 {
     struct interface *ifp;
     struct neighbour *neigh;
     struct xroute_stream *xroutes;
     struct route_stream *routes;
 
+    s->replying = 1;
+
     FOR_ALL_INTERFACES(ifp) {
-        local_notify_interface_1(s, ifp, LOCAL_ADD);
+        send_object(s, EVENT_INTERFACE, ifp, filtered);
     }
 
     FOR_ALL_NEIGHBOURS(neigh) {
-        local_notify_neighbour_1(s, neigh, LOCAL_ADD);
+        send_object(s, EVENT_NEIGHBOUR, neigh, filtered);
     }
 
     xroutes = xroute_stream();
@@ -297,7 +1078,7 @@ local_notify_all_1(struct local_socket *s)
             struct xroute *xroute = xroute_stream_next(xroutes);
             if(xroute == NULL)
                 break;
-            local_notify_xroute_1(s, xroute, LOCAL_ADD);
+            send_object(s, EVENT_XROUTE, xroute, filtered);
         }
         xroute_stream_done(xroutes);
     }
@@ -308,11 +1089,38 @@ local_notify_all_1(struct local_socket *s)
             struct babel_route *route = route_stream_next(routes);
             if(route == NULL)
                 break;
-            local_notify_route_1(s, route, LOCAL_ADD);
+            send_object(s, EVENT_ROUTE, route, filtered);
         }
         route_stream_done(routes);
     }
-    return;
+
+    s->replying = 0;
+}
+
+static void
+local_reply(struct local_socket *s, int reply, const char *message)
+{
+    static const char *replies[] = {"ok", "no", "bad"};
+    char buf[LOCAL_RECORD_MAX];
+    unsigned char *record = (unsigned char*)buf;
+    int rc;
+
+    if(s->binary) {
+        rc = message ? MIN(strlen(message),
+                           LOCAL_RECORD_MAX - LOCAL_RECORD_HEADER) : 0;
+        if(rc > 0)
+            memcpy(record + LOCAL_RECORD_HEADER, message, rc);
+        rc = put_header(record, LOCAL_RECORD_REPLY, reply,
+                        LOCAL_RECORD_HEADER + rc);
+    } else {
+        rc = snprintf(buf, sizeof(buf), "%s%s%s\n", replies[reply],
+                      message ? " " : "", message ? message : "");
+        if(rc < 0 || rc >= sizeof(buf))
+            rc = -1;
+    }
+    s->replying = 1;
+    local_send(s, buf, rc);
+    s->replying = 0;
 }
 
 int
@@ -320,7 +1128,7 @@ local_read(struct local_socket *s)
 {
     int rc;
     char *eol;
-    char reply[100] = "ok\n";
+    int reply = LOCAL_REPLY_OK;
     const char *message = NULL;
 
     if(s->buf == NULL)
@@ -347,32 +1155,45 @@ local_read(struct local_socket *s)
     case CONFIG_ACTION_DONE:
         break;
     case CONFIG_ACTION_QUIT:
-        shutdown(s->fd, 1);
-        reply[0] = '\0';
+        local_close(s);
+        reply = -1;
         break;
     case CONFIG_ACTION_DUMP:
-        local_notify_all_1(s);
+        local_notify_all_1(s, 0);
         break;
     case CONFIG_ACTION_MONITOR:
-        local_notify_all_1(s);
+        /* Pending events predate the subscription. */
+        if(numevents > 0)
+            local_notify_batch();
+        set_filter(s, &local_monitor_request);
+        memset(&local_monitor_request, 0, sizeof(local_monitor_request));
         s->monitor = 1;
+        update_monitored();
+        local_notify_all_1(s, 1);
         break;
     case CONFIG_ACTION_UNMONITOR:
         s->monitor = 0;
+        set_filter(s, NULL);
+        update_monitored();
+        break;
+    case CONFIG_ACTION_BINARY:
+        /* The ring must not mix lines and records. */
+        if(s->outlen > 0 || s->resync) {
+            reply = LOCAL_REPLY_NO;
+            message = "Output pending";
+        } else {
+            s->binary = 1;
+        }
         break;
     case CONFIG_ACTION_NO:
-        snprintf(reply, sizeof(reply), "no%s%s\n",
-                 message ? " " : "", message ? message : "");
+        reply = LOCAL_REPLY_NO;
         break;
     default:
-        snprintf(reply, sizeof(reply), "bad\n");
+        reply = LOCAL_REPLY_BAD;
     }
 
-    if(reply[0] != '\0') {
-        rc = write_timeout(s->fd, reply, strlen(reply));
-        if(rc < 0)
-            goto fail;
-    }
+    if(reply >= 0)
+        local_reply(s, reply, reply == LOCAL_REPLY_NO ? message : NULL);
 
     if(s->n > eol + 1 - s->buf) {
         memmove(s->buf, eol + 1, s->n - (eol + 1 - s->buf));
@@ -400,18 +1221,19 @@ local_header(struct local_socket *s)
     if(rc < 0)
         strncpy(host, "alamakota", 64);
 
-    rc = snprintf(buf, 512, "BABEL 1.0\nversion %s\nhost %s\nmy-id %s\nok\n",
+    rc = snprintf(buf, 512, "BABEL 1.0\nversion %s\nhost %s\nmy-id %s\n"
+                  "binary 1\nok\n",
                   BABELD_VERSION, host, format_eui64(myid));
     if(rc < 0 || rc >= 512)
         goto fail;
-    rc = write_timeout(s->fd, buf, rc);
+    rc = local_write(s, buf, rc);
     if(rc < 0)
-        goto fail;
+        return -1;
 
     return 1;
 
  fail:
-    shutdown(s->fd, 1);
+    local_close(s);
     return -1;
 }
 
@@ -437,8 +1259,11 @@ local_socket_destroy(int i)
     }
 
     free(local_sockets[i].buf);
+    free(local_sockets[i].out);
+    free(local_sockets[i].filter.ifname);
     close(local_sockets[i].fd);
     local_sockets[i] = local_sockets[--num_local_sockets];
     VALGRIND_MAKE_MEM_UNDEFINED(local_sockets + num_local_sockets,
                                 sizeof(struct local_socket));
+    update_monitored();
 }
@@ -36,11 +36,77 @@ struct xroute;
 
 #define LOCAL_BUFSIZE 1024
 
+#ifndef LOCAL_OUTSIZE
+#define LOCAL_OUTSIZE (256 * 1024)
+#endif
+
+/* What to do when a client doesn't read its output fast enough. */
+#define LOCAL_OVERFLOW_DROP 0
+#define LOCAL_OVERFLOW_RESYNC 1
+#define LOCAL_OVERFLOW_DISCONNECT 2
+
+/* The binary format, selected by the "binary" command.  Every record
+   starts with a four-byte header: the record type, the kind of event
+   (LOCAL_FLUSH, LOCAL_ADD or LOCAL_CHANGE, or LOCAL_REPLY_* for replies)
+   and the length of the whole record, header included.  Integers are in
+   network byte order, prefixes take 16 bytes, with IPv4 prefixes
+   mapped into IPv6 and their length counted accordingly, and names are
+   padded with NULs.  Objects are identified by 8-byte ids.  The offsets
+   of the fields are given in babeld(8). */
+
+#define LOCAL_RECORD_HEADER 4
+#define LOCAL_RECORD_MAX 128
+
+#define LOCAL_RECORD_REPLY 1
+#define LOCAL_RECORD_INTERFACE 2
+#define LOCAL_RECORD_NEIGHBOUR 3
+#define LOCAL_RECORD_XROUTE 4
+#define LOCAL_RECORD_ROUTE 5
+#define LOCAL_RECORD_BEGIN_BATCH 6
+#define LOCAL_RECORD_END_BATCH 7
+#define LOCAL_RECORD_RESYNC 8
+
+#define LOCAL_REPLY_OK 0
+#define LOCAL_REPLY_NO 1
+#define LOCAL_REPLY_BAD 2
+
+#define EVENT_INTERFACE 0
+#define EVENT_NEIGHBOUR 1
+#define EVENT_XROUTE 2
+#define EVENT_ROUTE 3
+
+#ifndef LOCAL_MAX_PREFIXES
+#define LOCAL_MAX_PREFIXES 8
+#endif
+
+/* The events a monitoring client subscribed to. */
+struct local_filter {
+    int types;                  /* 1 << EVENT_*, 0 for all */
+    int numprefixes;            /* routes and xroutes within */
+    unsigned char prefixes[LOCAL_MAX_PREFIXES][16];
+    unsigned char plens[LOCAL_MAX_PREFIXES];
+    char *ifname;               /* everything but xroutes */
+};
+
 struct local_socket {
     char *buf;
     int fd;
     int n;
     int monitor;
+    struct local_filter filter;
+    int inbatch;                /* some of the current batch is for us */
+    /* Output not yet accepted by the socket, a ring of outsize bytes
+       holding complete lines. */
+    char *out;
+    int outsize, outstart, outlen;
+    int binary;                 /* the client asked for binary records */
+    int partial;                /* unwritten bytes of a partly sent line */
+    int resync;                 /* lines were dropped, marker not sent yet */
+    int closing;                /* shut down once the output is drained */
+    /* Replies to requests are never dropped: the ring grows to hold
+       them, and the first pinned bytes of the ring are kept by out_drop. */
+    int replying;
+    int pinned;
 };
 
 extern int local_server_socket;
@@ -48,13 +114,20 @@ extern struct local_socket local_sockets[MAX_LOCAL_SOCKETS];
 extern int num_local_sockets;
 extern int local_server_port;
 extern char *local_server_path;
+extern int local_overflow;
+extern int local_buffer_size;
+extern int local_batch_interval;
+extern struct local_filter local_monitor_request;
+extern struct timeval local_batch_timeout;
 
 void local_notify_interface(struct interface *ifp, int kind);
 void local_notify_neighbour(struct neighbour *neigh, int kind);
 void local_notify_xroute(struct xroute *xroute, int kind);
 void local_notify_route(struct babel_route *route, int kind);
+void local_notify_batch(void);
 int local_read(struct local_socket *s);
 int local_header(struct local_socket *s);
+int local_flush(struct local_socket *s);
 struct local_socket *local_socket_create(int fd);
 void local_socket_destroy(int i);
 #endif
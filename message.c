@@ -41,6 +41,7 @@ THE SOFTWARE.
 #include "resend.h"
 #include "message.h"
 #include "configuration.h"
+#include "aggregate.h"
 
 unsigned char packet_header[4] = {42, 2};
 
@@ -51,6 +52,7 @@ struct timeval seqno_time = {0, 0};
 
 #define UNICAST_BUFSIZE 1024
 int unicast_buffered = 0;
+static int unicast_buffered_hello = -1;
 unsigned char *unicast_buffer = NULL;
 struct neighbour *unicast_neighbour = NULL;
 struct timeval unicast_flush_timeout = {0, 0};
@@ -119,12 +121,13 @@ network_prefix(int ae, int plen, unsigned int omitted,
     return ret;
 }
 
-static void
+/* Returns 1 if the update carries an aggregate. */
+static int
 parse_update_subtlv(struct interface *ifp, int metric,
                     const unsigned char *a, int alen,
                     unsigned char *channels, int *channels_len_return)
 {
-    int type, len, i = 0;
+    int type, len, i = 0, aggregate = 0;
     int channels_len;
 
     /* This will be overwritten if there's a DIVERSITY_HOPS sub-TLV. */
@@ -150,12 +153,12 @@ parse_update_subtlv(struct interface *ifp, int metric,
 
         if(i + 1 > alen) {
             fprintf(stderr, "Received truncated attributes.\n");
-            return;
+            return aggregate;
         }
         len = a[i + 1];
         if(i + len > alen) {
             fprintf(stderr, "Received truncated attributes.\n");
-            return;
+            return aggregate;
         }
 
         if(type == SUBTLV_PADN) {
@@ -163,6 +166,8 @@ parse_update_subtlv(struct interface *ifp, int metric,
         } else if(type == SUBTLV_DIVERSITY) {
             memcpy(channels, a + i + 2, MIN(len, *channels_len_return));
             channels_len = MIN(len, *channels_len_return);
+        } else if(type == SUBTLV_AGGREGATE) {
+            aggregate = 1;
         } else {
             debugf("Received unknown update sub-TLV %d.\n", type);
         }
@@ -170,16 +175,18 @@ parse_update_subtlv(struct interface *ifp, int metric,
         i += len + 2;
     }
     *channels_len_return = channels_len;
+    return aggregate;
 }
 
 static int
 parse_hello_subtlv(const unsigned char *a, int alen,
-                   unsigned int *hello_send_us)
+                   unsigned int *hello_send_us,
+                   unsigned int *capabilities_return)
 {
     int type, len, i = 0, ret = 0;
 
     while(i < alen) {
-        type = a[0];
+        type = a[i];
         if(type == SUBTLV_PAD1) {
             i++;
             continue;
@@ -205,6 +212,10 @@ parse_hello_subtlv(const unsigned char *a, int alen,
                 fprintf(stderr,
                         "Received incorrect RTT sub-TLV on Hello message.\n");
             }
+        } else if(type == SUBTLV_UNICAST_HELLO) {
+            *capabilities_return |= CAPABILITY_UNICAST_HELLO;
+        } else if(type == SUBTLV_AGGREGATE) {
+            *capabilities_return |= CAPABILITY_AGGREGATE;
         } else {
             debugf("Received unknown Hello sub-TLV type %d.\n", type);
         }
@@ -222,7 +233,7 @@ parse_ihu_subtlv(const unsigned char *a, int alen,
     int type, len, i = 0, ret = 0;
 
     while(i < alen) {
-        type = a[0];
+        type = a[i];
         if(type == SUBTLV_PAD1) {
             i++;
             continue;
@@ -353,32 +364,45 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                    nonce, interval, format_address(from), ifp->name);
             send_ack(neigh, nonce, interval);
         } else if(type == MESSAGE_ACK) {
-            debugf("Received ack from %s on %s.\n",
-                   format_address(from), ifp->name);
-            /* Nothing right now */
+            unsigned short nonce;
+            if(len < 2) goto fail;
+            DO_NTOHS(nonce, message + 2);
+            debugf("Received ack (%04X) from %s on %s.\n",
+                   nonce, format_address(from), ifp->name);
+            neighbour_probe_answer(neigh, nonce);
         } else if(type == MESSAGE_HELLO) {
-            unsigned short seqno, interval;
+            unsigned short flags, seqno, interval;
             int changed;
-            unsigned int timestamp;
+            unsigned int timestamp, capabilities = 0;
             if(len < 6) goto fail;
+            DO_NTOHS(flags, message + 2);
             DO_NTOHS(seqno, message + 4);
             DO_NTOHS(interval, message + 6);
-            debugf("Received hello %d (%d) from %s on %s.\n",
+            debugf("Received %shello %d (%d) from %s on %s.\n",
+                   (flags & HELLO_FLAG_UNICAST) ? "unicast " : "",
                    seqno, interval,
                    format_address(from), ifp->name);
-            changed = update_neighbour(neigh, seqno, interval);
-            update_neighbour_metric(neigh, changed);
-            if(interval > 0)
-                /* Multiply by 3/2 to allow hellos to expire. */
-                schedule_neighbours_check(interval * 15, 0);
             /* Sub-TLV handling. */
             if(len > 8) {
-                if(parse_hello_subtlv(message + 8, len - 6, &timestamp) > 0) {
+                if(parse_hello_subtlv(message + 8, len - 6, &timestamp,
+                                      &capabilities) > 0) {
                     neigh->hello_send_us = timestamp;
                     neigh->hello_rtt_receive_time = now;
                     have_hello_rtt = 1;
                 }
             }
+            if(!(flags & HELLO_FLAG_UNICAST)) {
+                neighbour_unicast_capable(neigh, capabilities &
+                                          CAPABILITY_UNICAST_HELLO);
+                neigh->aggregate = !!(capabilities & CAPABILITY_AGGREGATE);
+            }
+            if(neighbour_track_hello(neigh, flags & HELLO_FLAG_UNICAST)) {
+                changed = update_neighbour(neigh, seqno, interval);
+                update_neighbour_metric(neigh, changed);
+                if(interval > 0)
+                    /* Multiply by 3/2 to allow hellos to expire. */
+                    schedule_neighbours_check(interval * 15, 0);
+            }
         } else if(type == MESSAGE_IHU) {
             unsigned short txcost, interval;
             unsigned char address[16];
@@ -523,8 +547,23 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                     goto done;
             }
 
-            parse_update_subtlv(ifp, metric, message + 2 + parsed_len,
-                                len - parsed_len, channels, &channels_len);
+            /* Aggregates are only sent to us if we announced that we
+               understand them, and are otherwise ordinary updates.  One
+               that violates the feasibility condition might be our own
+               aggregate coming back, so it is taken as a retraction. */
+            if(parse_update_subtlv(ifp, metric, message + 2 + parsed_len,
+                                   len - parsed_len, channels,
+                                   &channels_len)) {
+                struct source *src;
+                neigh->aggregate = 1;
+                src = find_source(router_id, prefix, plen, zeroes, 0, 0, 0);
+                if(!update_feasible(src, seqno, metric)) {
+                    debugf("Rejecting unfeasible aggregate %s from %s.\n",
+                           format_prefix(prefix, plen),
+                           format_address(from));
+                    metric = INFINITY;
+                }
+            }
             update_route(router_id, prefix, plen, zeroes, 0, seqno,
                          metric, interval, neigh, nh,
                          channels, channels_len);
@@ -744,6 +783,10 @@ parse_packet(const unsigned char *from, struct interface *ifp,
 
         old_rttcost = neighbour_rttcost(neigh);
         if(valid_rtt(neigh)) {
+            /* Mean deviation, with a gain of 1/4 as in TCP. */
+            unsigned int err = rtt > neigh->rtt ?
+                rtt - neigh->rtt : neigh->rtt - rtt;
+            neigh->rttvar = (3 * (unsigned long long)neigh->rttvar + err) / 4;
             /* Running exponential average. */
             smoothed_rtt = (ifp->rtt_decay * rtt +
                             (256 - ifp->rtt_decay) * neigh->rtt);
@@ -755,6 +798,9 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                (higher RTT) */
             assert(rtt <= 0x7FFFFFFF);
             neigh->rtt = 2*rtt;
+            /* RFC 6298 starts the RTO at three times the first sample;
+               the doubled RTT already accounts for two of them. */
+            neigh->rttvar = rtt / 4;
         }
         changed = (neighbour_rttcost(neigh) == old_rttcost ? 0 : 1);
         update_neighbour_metric(neigh, changed);
@@ -789,17 +835,17 @@ check_bucket(struct interface *ifp)
 }
 
 static int
-fill_rtt_message(struct interface *ifp)
+fill_rtt_message(struct interface *ifp, unsigned char *buf, int hello)
 {
-    if((ifp->flags & IF_TIMESTAMPS) && (ifp->buffered_hello >= 0)) {
-        if(ifp->sendbuf[ifp->buffered_hello + 8] == SUBTLV_PADN &&
-           ifp->sendbuf[ifp->buffered_hello + 9] == 4) {
+    if((ifp->flags & IF_TIMESTAMPS) && (hello >= 0)) {
+        if(buf[hello + 8] == SUBTLV_PADN &&
+           buf[hello + 9] == 4) {
             unsigned int time;
             /* Change the type of sub-TLV. */
-            ifp->sendbuf[ifp->buffered_hello + 8] = SUBTLV_TIMESTAMP;
+            buf[hello + 8] = SUBTLV_TIMESTAMP;
             gettime(&now);
             time = time_us(now);
-            DO_HTONL(ifp->sendbuf + ifp->buffered_hello + 10, time);
+            DO_HTONL(buf + hello + 10, time);
             return 1;
         } else {
             fprintf(stderr,
@@ -811,6 +857,36 @@ fill_rtt_message(struct interface *ifp)
     return 0;
 }
 
+/* Send the interface buffer as a separate unicast packet to each of the
+   neighbours on the interface.  Returns the number of copies sent, or -1
+   if any of them failed. */
+static int
+send_unicast_copies(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    struct sockaddr_in6 sin6;
+    int rc, ret = 0;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        memset(&sin6, 0, sizeof(sin6));
+        sin6.sin6_family = AF_INET6;
+        memcpy(&sin6.sin6_addr, neigh->address, 16);
+        sin6.sin6_port = htons(protocol_port);
+        sin6.sin6_scope_id = ifp->ifindex;
+        rc = babel_send(protocol_socket,
+                        packet_header, sizeof(packet_header),
+                        ifp->sendbuf, ifp->buffered,
+                        (struct sockaddr*)&sin6, sizeof(sin6));
+        if(rc < 0)
+            ret = -1;
+        else if(ret >= 0)
+            ret++;
+    }
+    return ret;
+}
+
 void
 flushbuf(struct interface *ifp)
 {
@@ -832,12 +908,20 @@ flushbuf(struct interface *ifp)
             sin6.sin6_port = htons(protocol_port);
             sin6.sin6_scope_id = ifp->ifindex;
             DO_HTONS(packet_header + 2, ifp->buffered);
-            u = fill_rtt_message(ifp);
+            u = fill_rtt_message(ifp, ifp->sendbuf, ifp->buffered_hello);
 	    if(u==1) setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_TCLASS, &ds_urgent, sizeof(ds_urgent));
-            rc = babel_send(protocol_socket,
-                            packet_header, sizeof(packet_header),
-                            ifp->sendbuf, ifp->buffered,
-                            (struct sockaddr*)&sin6, sizeof(sin6));
+            /* Multicast Hellos must reach neighbours we don't know yet,
+               so a packet carrying one always goes to the group, as does
+               everything when there is nobody to copy it to. */
+            rc = 0;
+            if(ifp->transport == IF_TRANSPORT_UNICAST &&
+               ifp->buffered_hello < 0)
+                rc = send_unicast_copies(ifp);
+            if(rc == 0)
+                rc = babel_send(protocol_socket,
+                                packet_header, sizeof(packet_header),
+                                ifp->sendbuf, ifp->buffered,
+                                (struct sockaddr*)&sin6, sizeof(sin6));
 	    if(u==1) setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_TCLASS, &ds, sizeof(ds));
             if(rc < 0)
                 perror("send");
@@ -1016,9 +1100,28 @@ send_ack(struct neighbour *neigh, unsigned short nonce, unsigned short interval)
     schedule_unicast_flush(roughly(interval * 6));
 }
 
+/* Ask a neighbour to acknowledge within interval centiseconds.  This is
+   answered by any Babel speaker, which makes it usable as a probe. */
+void
+send_ack_request(struct neighbour *neigh, unsigned short nonce,
+                 unsigned short interval)
+{
+    int rc;
+    debugf("Sending ack-req (%04x %d) to %s on %s.\n",
+           nonce, interval, format_address(neigh->address), neigh->ifp->name);
+    rc = start_unicast_message(neigh, MESSAGE_ACK_REQ, 6); if(rc < 0) return;
+    accumulate_unicast_short(neigh, 0);
+    accumulate_unicast_short(neigh, nonce);
+    accumulate_unicast_short(neigh, interval);
+    end_unicast_message(neigh, MESSAGE_ACK_REQ, 6);
+    flush_unicast(0);
+}
+
 void
 send_hello_noupdate(struct interface *ifp, unsigned interval)
 {
+    int len;
+
     /* This avoids sending multiple hellos in a single packet, which breaks
        link quality estimation. */
     if(ifp->buffered_hello >= 0)
@@ -1033,7 +1136,10 @@ send_hello_noupdate(struct interface *ifp, unsigned interval)
     debugf("Sending hello %d (%d) to %s.\n",
            ifp->hello_seqno, interval, ifp->name);
 
-    start_message(ifp, MESSAGE_HELLO, (ifp->flags & IF_TIMESTAMPS) ? 12 : 6);
+    len = ((ifp->flags & IF_TIMESTAMPS) ? 12 : 6) +
+        ((ifp->flags & IF_UNICAST_HELLO) ? 2 : 0) +
+        ((ifp->flags & IF_AGGREGATE) ? 2 : 0);
+    start_message(ifp, MESSAGE_HELLO, len);
     ifp->buffered_hello = ifp->buffered - 2;
     accumulate_short(ifp, 0);
     accumulate_short(ifp, ifp->hello_seqno);
@@ -1045,13 +1151,45 @@ send_hello_noupdate(struct interface *ifp, unsigned interval)
         accumulate_byte(ifp, 4);
         accumulate_int(ifp, 0);
     }
-    end_message(ifp, MESSAGE_HELLO, (ifp->flags & IF_TIMESTAMPS) ? 12 : 6);
+    if(ifp->flags & IF_UNICAST_HELLO) {
+        accumulate_byte(ifp, SUBTLV_UNICAST_HELLO);
+        accumulate_byte(ifp, 0);
+    }
+    if(ifp->flags & IF_AGGREGATE) {
+        accumulate_byte(ifp, SUBTLV_AGGREGATE);
+        accumulate_byte(ifp, 0);
+    }
+    end_message(ifp, MESSAGE_HELLO, len);
+}
+
+/* Once every neighbour on an interface gets unicast Hellos, multicast
+   Hellos are only needed for discovery, and can be sent less often. */
+static unsigned
+multicast_hello_interval(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    int n = 0;
+
+    if(!(ifp->flags & IF_UNICAST_HELLO))
+        return ifp->hello_interval;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        if(!neigh->unicast_hello)
+            return ifp->hello_interval;
+        n++;
+    }
+
+    return n > 0 ? ifp->hello_interval * 4 : ifp->hello_interval;
 }
 
 void
 send_hello(struct interface *ifp)
 {
-    send_hello_noupdate(ifp, (ifp->hello_interval + 9) / 10);
+    unsigned interval = multicast_hello_interval(ifp);
+    send_hello_noupdate(ifp, (interval + 9) / 10);
+    set_timeout(&ifp->hello_timeout, interval);
     /* Send full IHU every 3 hellos, and marginal IHU each time */
     if(ifp->hello_seqno % 3 == 0)
         send_ihu(NULL, ifp);
@@ -1059,11 +1197,54 @@ send_hello(struct interface *ifp)
         send_marginal_ihu(ifp);
 }
 
+/* Unicast Hellos have their own seqno space for each neighbour, and are
+   only sent to neighbours that announced that they understand them. */
+void
+send_unicast_hello(struct neighbour *neigh)
+{
+    struct interface *ifp = neigh->ifp;
+    unsigned interval = (ifp->hello_interval + 9) / 10;
+    int rc, len;
+
+    set_timeout(&neigh->unicast_hello_timeout, ifp->hello_interval);
+
+    if(!if_up(ifp))
+        return;
+
+    /* As above, a single hello per packet. */
+    if(unicast_buffered_hello >= 0)
+        flush_unicast(0);
+
+    neigh->unicast_hello_seqno = seqno_plus(neigh->unicast_hello_seqno, 1);
+
+    debugf("Sending unicast hello %d (%d) to %s on %s.\n",
+           neigh->unicast_hello_seqno, interval,
+           format_address(neigh->address), ifp->name);
+
+    len = (ifp->flags & IF_TIMESTAMPS) ? 12 : 6;
+    rc = start_unicast_message(neigh, MESSAGE_HELLO, len);
+    if(rc < 0) return;
+    unicast_buffered_hello = unicast_buffered - 2;
+    accumulate_unicast_short(neigh, HELLO_FLAG_UNICAST);
+    accumulate_unicast_short(neigh, neigh->unicast_hello_seqno);
+    accumulate_unicast_short(neigh, interval > 0xFFFF ? 0xFFFF : interval);
+    if(ifp->flags & IF_TIMESTAMPS) {
+        accumulate_unicast_byte(neigh, SUBTLV_PADN);
+        accumulate_unicast_byte(neigh, 4);
+        accumulate_unicast_int(neigh, 0);
+    }
+    end_unicast_message(neigh, MESSAGE_HELLO, len);
+
+    if(neigh->unicast_hello_seqno % 3 == 0 ||
+       neigh->txcost >= 384 || (neigh->reach & 0xF000) != 0xF000)
+        send_ihu(neigh, NULL);
+}
+
 void
 flush_unicast(int dofree)
 {
     struct sockaddr_in6 sin6;
-    int rc;
+    int rc, u;
 
     if(unicast_buffered == 0)
         goto done;
@@ -1081,11 +1262,14 @@ flush_unicast(int dofree)
         sin6.sin6_port = htons(protocol_port);
         sin6.sin6_scope_id = unicast_neighbour->ifp->ifindex;
         DO_HTONS(packet_header + 2, unicast_buffered);
-        fill_rtt_message(unicast_neighbour->ifp);
+        u = fill_rtt_message(unicast_neighbour->ifp, unicast_buffer,
+                             unicast_buffered_hello);
+	if(u==1) setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_TCLASS, &ds_urgent, sizeof(ds_urgent));
         rc = babel_send(protocol_socket,
                         packet_header, sizeof(packet_header),
                         unicast_buffer, unicast_buffered,
                         (struct sockaddr*)&sin6, sizeof(sin6));
+	if(u==1) setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_TCLASS, &ds, sizeof(ds));
         if(rc < 0)
             perror("send(unicast)");
     } else {
@@ -1099,6 +1283,7 @@ flush_unicast(int dofree)
  done:
     VALGRIND_MAKE_MEM_UNDEFINED(unicast_buffer, UNICAST_BUFSIZE);
     unicast_buffered = 0;
+    unicast_buffered_hello = -1;
     if(dofree && unicast_buffer) {
         free(unicast_buffer);
         unicast_buffer = NULL;
@@ -1109,14 +1294,14 @@ flush_unicast(int dofree)
 }
 
 static void
-really_send_update(struct interface *ifp,
-                   const unsigned char *id,
-                   const unsigned char *prefix, unsigned char plen,
-                   const unsigned char *src_prefix, unsigned char src_plen,
-                   unsigned short seqno, unsigned short metric,
-                   unsigned char *channels, int channels_len)
+accumulate_update(struct interface *ifp,
+                  const unsigned char *id,
+                  const unsigned char *prefix, unsigned char plen,
+                  const unsigned char *src_prefix, unsigned char src_plen,
+                  unsigned short seqno, unsigned short metric,
+                  unsigned char *channels, int channels_len, int aggregate)
 {
-    int add_metric, v4, real_plen, omit = 0;
+    int v4, real_plen, omit = 0;
     const unsigned char *real_prefix;
     const unsigned char *real_src_prefix = NULL;
     int real_src_plen = 0;
@@ -1126,17 +1311,9 @@ really_send_update(struct interface *ifp,
     if(diversity_kind != DIVERSITY_CHANNEL)
         channels_len = -1;
 
-    channels_size = channels_len >= 0 ? channels_len + 2 : 0;
-
-    if(!if_up(ifp))
-        return;
-
-    add_metric = output_filter(id, prefix, plen, src_prefix,
-                               src_plen, ifp->ifindex);
-    if(add_metric >= INFINITY)
-        return;
+    channels_size = (channels_len >= 0 ? channels_len + 2 : 0) +
+        (aggregate ? 2 : 0);
 
-    metric = MIN(metric + add_metric, INFINITY);
     /* Worst case */
     ensure_space(ifp, 20 + 12 + 28 + 18);
 
@@ -1216,6 +1393,10 @@ really_send_update(struct interface *ifp,
         accumulate_byte(ifp, channels_len);
         accumulate_bytes(ifp, channels, channels_len);
     }
+    if(aggregate) {
+        accumulate_byte(ifp, SUBTLV_AGGREGATE);
+        accumulate_byte(ifp, 0);
+    }
     if(src_plen == 0)
         end_message(ifp, MESSAGE_UPDATE, 10 + (real_plen + 7) / 8 - omit +
                     channels_size);
@@ -1230,6 +1411,29 @@ really_send_update(struct interface *ifp,
     }
 }
 
+static void
+really_send_update(struct interface *ifp,
+                   const unsigned char *id,
+                   const unsigned char *prefix, unsigned char plen,
+                   const unsigned char *src_prefix, unsigned char src_plen,
+                   unsigned short seqno, unsigned short metric,
+                   unsigned char *channels, int channels_len, int aggregate)
+{
+    int add_metric;
+
+    if(!if_up(ifp))
+        return;
+
+    add_metric = output_filter(id, prefix, plen, src_prefix,
+                               src_plen, ifp->ifindex);
+    if(add_metric >= INFINITY)
+        return;
+
+    accumulate_update(ifp, id, prefix, plen, src_prefix, src_plen,
+                      seqno, MIN(metric + add_metric, INFINITY),
+                      channels, channels_len, aggregate);
+}
+
 // FIXME all callers have to check for true or false
 // if I want to get away from memcmp
 
@@ -1276,6 +1480,188 @@ compare_buffered_updates(const void *av, const void *bv)
     return memcmp(a->src_prefix, b->src_prefix,16);
 }
 
+static void schedule_update_flush(struct interface *ifp, int urgent);
+static void buffer_update(struct interface *ifp,
+                          const unsigned char *prefix, unsigned char plen,
+                          const unsigned char *src_prefix,
+                          unsigned char src_plen);
+
+/* Incremented on every flush, so that an aggregate is sent at most once
+   per flush however many of its components are buffered. */
+static unsigned int aggregate_stamp = 0;
+
+static int
+buffer_component(const unsigned char *prefix, unsigned char plen,
+                 void *closure)
+{
+    buffer_update(closure, prefix, plen, zeroes, 0);
+    return 0;
+}
+
+/* Make before break: announce the components of an aggregate again, then
+   retract the aggregate itself.  Since the aggregate is shorter than its
+   components, it sorts after them within the next flush.  If retract is
+   false, a real route for the aggregate's prefix replaces it at the
+   receivers, and a retraction would kill that route. */
+static void
+withdraw_aggregate(struct interface *ifp, struct aggregate *agg, int retract)
+{
+    unsigned char prefix[16], plen;
+
+    memcpy(prefix, agg->prefix, 16);
+    plen = agg->plen;
+    if(retract)
+        agg->withdrawn = 1;
+    else
+        flush_announced_aggregate(ifp, agg);
+    agg = NULL;
+
+    debugf("Withdrawing aggregate %s on %s.\n",
+           format_prefix(prefix, plen), ifp->name);
+
+    aggregate_components(prefix, plen, buffer_component, ifp);
+
+    if(retract)
+        buffer_update(ifp, prefix, plen, zeroes, 0);
+}
+
+struct hidden {
+    struct interface *ifp;
+    const struct aggregate *agg;
+};
+
+static int
+retract_component(const unsigned char *prefix, unsigned char plen,
+                  void *closure)
+{
+    struct hidden *h = closure;
+    really_send_update(h->ifp, h->agg->id, prefix, plen, zeroes, 0,
+                       h->agg->seqno, INFINITY, NULL, -1, 0);
+    return 0;
+}
+
+/* A new aggregate hides its components and any aggregate announced
+   inside it.  Retract them just after it, rather than leaving them at
+   the receivers until they expire. */
+static void
+retract_hidden(struct interface *ifp, const struct aggregate *agg)
+{
+    struct aggregate *a;
+    struct hidden h;
+
+    while((a = find_announced_aggregate_within(ifp, agg->prefix,
+                                               agg->plen)) != NULL) {
+        really_send_update(ifp, a->id, a->prefix, a->plen, zeroes, 0,
+                           a->seqno, INFINITY, NULL, -1, 0);
+        flush_announced_aggregate(ifp, a);
+    }
+
+    h.ifp = ifp;
+    h.agg = agg;
+    aggregate_components(agg->prefix, agg->plen, retract_component, &h);
+}
+
+/* The aggregate to announce on ifp for prefix, as for find_aggregate. */
+static int
+interface_aggregate(struct interface *ifp,
+                    const unsigned char *prefix, unsigned char plen,
+                    struct aggregate *agg)
+{
+    int rc;
+
+    if(!interface_aggregates(ifp))
+        return 0;
+    rc = find_aggregate(prefix, plen, agg);
+    if(rc > 0 && agg->neigh && (ifp->flags & IF_SPLIT_HORIZON) &&
+       agg->neigh->ifp == ifp)
+        rc = 0;
+    return rc;
+}
+
+/* Send agg, unless it already went out in this flush. */
+static void
+send_aggregate_update(struct interface *ifp, struct aggregate *agg)
+{
+    struct aggregate *a;
+    int new;
+
+    a = find_announced_aggregate(ifp, agg->prefix, agg->plen, 1);
+    if(a && !a->withdrawn && a->stamp == aggregate_stamp)
+        return;
+    new = a == NULL || a->withdrawn;
+
+    really_send_update(ifp, agg->id, agg->prefix, agg->plen, zeroes, 0,
+                       agg->seqno, agg->metric, NULL, -1, 1);
+    agg->stamp = aggregate_stamp;
+    a = announce_aggregate(ifp, agg);
+    if(a)
+        update_source(a->src, agg->seqno, agg->metric);
+    if(new)
+        retract_hidden(ifp, agg);
+}
+
+/* Returns 1 if the buffered update has been dealt with by sending or
+   retracting an aggregate, 0 if it should be sent on its own. */
+static int
+send_aggregate(struct interface *ifp, const struct buffered_update *b)
+{
+    struct aggregate agg, *a;
+    unsigned char prefix[16], plen;
+    int rc;
+
+    if(b->src_plen != 0)
+        return 0;
+
+    a = find_announced_aggregate(ifp, b->prefix, b->plen, 1);
+    if(a) {
+        if(a->withdrawn) {
+            /* Its components went out just before. */
+            really_send_update(ifp, a->id, a->prefix, a->plen, zeroes, 0,
+                               a->seqno, INFINITY, NULL, -1, 0);
+            flush_announced_aggregate(ifp, a);
+            return 1;
+        }
+        if(find_xroute(b->prefix, b->plen, zeroes, 0) != NULL ||
+           find_installed_route(b->prefix, b->plen, zeroes, 0) != NULL) {
+            withdraw_aggregate(ifp, a, 0);
+            return 0;
+        }
+        /* The aggregate itself, typically in answer to a request.  Check
+           that it still holds before sending it again. */
+        if(a->stamp == aggregate_stamp)
+            return 1;
+        if(aggregate_component(a->prefix, a->plen, prefix, &plen) &&
+           interface_aggregate(ifp, prefix, plen, &agg) > 0 &&
+           agg.plen == a->plen && v6_equal(agg.prefix, a->prefix))
+            send_aggregate_update(ifp, &agg);
+        else
+            withdraw_aggregate(ifp, a, 1);
+        return 1;
+    }
+
+    rc = interface_aggregate(ifp, b->prefix, b->plen, &agg);
+
+    /* A route nested within a component doesn't affect the aggregate. */
+    a = find_announced_aggregate(ifp, b->prefix, b->plen, 0);
+    if(a && aggregate_hides(a, b->prefix, b->plen) &&
+       (rc <= 0 || a->plen != agg.plen || !v6_equal(a->prefix, agg.prefix)))
+        withdraw_aggregate(ifp, a, 1);
+
+    if(rc <= 0)
+        return 0;
+
+    if(agg.neigh) {
+        struct babel_route *route =
+            find_installed_route(b->prefix, b->plen, zeroes, 0);
+        if(route && route->seqno == agg.seqno)
+            satisfy_request(b->prefix, b->plen, zeroes, 0,
+                            agg.seqno, agg.id, ifp);
+    }
+
+    send_aggregate_update(ifp, &agg);
+    return 1;
+}
+
 void
 flushupdates(struct interface *ifp)
 {
@@ -1294,6 +1680,16 @@ flushupdates(struct interface *ifp)
         return;
     }
 
+    aggregate_stamp++;
+
+    /* A neighbour that doesn't understand aggregates has appeared. */
+    if(ifp->numaggregates > 0 && !interface_aggregates(ifp)) {
+        for(i = 0; i < ifp->numaggregates; i++) {
+            if(!ifp->aggregates[i].withdrawn)
+                withdraw_aggregate(ifp, &ifp->aggregates[i], 1);
+        }
+    }
+
     if(ifp->num_buffered_updates > 0) {
         struct buffered_update *b = ifp->buffered_updates;
         int n = ifp->num_buffered_updates;
@@ -1319,10 +1715,14 @@ flushupdates(struct interface *ifp)
         for(i = 0; i < n; i++) {
             route = find_installed_route(b[i].prefix, b[i].plen,
                                          b[i].src_prefix, b[i].src_plen);
-            if(route)
+            if(route) {
                 memcpy(b[i].id, route->src->id, 8);
-            else
-                memcpy(b[i].id, myid, 8);
+            } else {
+                /* Retract an aggregate after its components. */
+                struct aggregate *a =
+                    find_announced_aggregate(ifp, b[i].prefix, b[i].plen, 1);
+                memcpy(b[i].id, a && b[i].src_plen == 0 ? a->id : myid, 8);
+            }
         }
 
 // FIXME - memcmp conversion issue
@@ -1343,6 +1743,15 @@ flushupdates(struct interface *ifp)
                v6_equal(b[i].src_prefix, last_src_prefix))
                 continue;
 
+            if((ifp->numaggregates > 0 || (ifp->flags & IF_AGGREGATE)) &&
+               send_aggregate(ifp, &b[i])) {
+                last_prefix = b[i].prefix;
+                last_plen = b[i].plen;
+                last_src_prefix = b[i].src_prefix;
+                last_src_plen = b[i].src_plen;
+                continue;
+            }
+
             xroute = find_xroute(b[i].prefix, b[i].plen,
                                  b[i].src_prefix, b[i].src_plen);
             route = find_installed_route(b[i].prefix, b[i].plen,
@@ -1353,7 +1762,7 @@ flushupdates(struct interface *ifp)
                                    xroute->prefix, xroute->plen,
                                    xroute->src_prefix, xroute->src_plen,
                                    myseqno, xroute->metric,
-                                   NULL, 0);
+                                   NULL, 0, 0);
                 last_prefix = xroute->prefix;
                 last_plen = xroute->plen;
                 last_src_prefix = xroute->src_prefix;
@@ -1402,7 +1811,7 @@ flushupdates(struct interface *ifp)
                                    route->src->prefix, route->src->plen,
                                    route->src->src_prefix, route->src->src_plen,
                                    seqno, metric,
-                                   channels, chlen);
+                                   channels, chlen, 0);
                 update_source(route->src, seqno, metric);
                 last_prefix = route->src->prefix;
                 last_plen = route->src->plen;
@@ -1413,7 +1822,7 @@ flushupdates(struct interface *ifp)
                after an xroute has been retracted, so send a retraction. */
                 really_send_update(ifp, myid, b[i].prefix, b[i].plen,
                                    b[i].src_prefix, b[i].src_plen,
-                                   myseqno, INFINITY, NULL, -1);
+                                   myseqno, INFINITY, NULL, -1, 0);
             }
         }
         schedule_flush_now(ifp);
@@ -1422,6 +1831,9 @@ flushupdates(struct interface *ifp)
     }
     ifp->update_flush_timeout.tv_sec = 0;
     ifp->update_flush_timeout.tv_usec = 0;
+    /* Withdrawing an aggregate buffers its components. */
+    if(ifp->num_buffered_updates > 0)
+        schedule_update_flush(ifp, 1);
 }
 
 static void
@@ -1578,6 +1990,21 @@ send_wildcard_retraction(struct interface *ifp)
     ifp->have_buffered_id = 0;
 }
 
+/* Retract a route that the output filters have started to deny, which
+   send_update would silently skip. */
+void
+send_filtered_retraction(struct interface *ifp, const unsigned char *id,
+                         const unsigned char *prefix, unsigned char plen,
+                         const unsigned char *src_prefix,
+                         unsigned char src_plen, unsigned short seqno)
+{
+    if(!if_up(ifp))
+        return;
+
+    accumulate_update(ifp, id, prefix, plen, src_prefix, src_plen,
+                      seqno, INFINITY, NULL, -1, 0);
+}
+
 void
 update_myseqno()
 {
@@ -2032,6 +2459,19 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
     xroute = find_xroute(prefix, plen, src_prefix, src_plen);
     route = find_installed_route(prefix, plen, src_prefix, src_plen);
 
+    if(!xroute && !route && src_plen == 0) {
+        /* An aggregate we announced: forward the request towards its
+           origin as a request for one of its components. */
+        struct aggregate *a;
+        unsigned char c[16], clen;
+        a = find_announced_aggregate(neigh->ifp, prefix, plen, 1);
+        if(a && !a->withdrawn &&
+           aggregate_component(prefix, plen, c, &clen)) {
+            handle_request(neigh, c, clen, zeroes, 0, hop_count, seqno, id);
+            return;
+        }
+    }
+
     if(xroute && (!route || xroute->metric <= kernel_metric)) {
         if(hop_count > 0 && memcmp(id, myid, 8) == 0) {
             if(seqno_compare(seqno, myseqno) > 0) {
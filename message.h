@@ -47,6 +47,19 @@ THE SOFTWARE.
 #define SUBTLV_PADN 1
 #define SUBTLV_DIVERSITY 2 /* Also known as babelz. */
 #define SUBTLV_TIMESTAMP 3 /* Used to compute RTT. */
+/* Types 112 to 126 are for experimentation and may be ignored; those
+   from 128 up are mandatory, and a peer that doesn't know them must drop
+   the whole TLV (RFC 8966, Section 4.4). */
+#define SUBTLV_UNICAST_HELLO 112 /* Willing to use unicast Hellos. */
+/* On a Hello, we understand aggregates; on an Update, this is one. */
+#define SUBTLV_AGGREGATE 113
+
+/* Capabilities announced in Hello sub-TLVs. */
+#define CAPABILITY_UNICAST_HELLO (1 << 0)
+#define CAPABILITY_AGGREGATE (1 << 1)
+
+/* Flags in the Hello TLV. */
+#define HELLO_FLAG_UNICAST 0x8000
 
 extern unsigned short myseqno;
 extern struct timeval seqno_time;
@@ -68,8 +81,11 @@ void flushbuf(struct interface *ifp);
 void flushupdates(struct interface *ifp);
 void send_ack(struct neighbour *neigh, unsigned short nonce,
               unsigned short interval);
+void send_ack_request(struct neighbour *neigh, unsigned short nonce,
+                      unsigned short interval);
 void send_hello_noupdate(struct interface *ifp, unsigned interval);
 void send_hello(struct interface *ifp);
+void send_unicast_hello(struct neighbour *neigh);
 void flush_unicast(int dofree);
 void send_update(struct interface *ifp, int urgent,
                  const unsigned char *prefix, unsigned char plen,
@@ -79,6 +95,10 @@ void send_update_resend(struct interface *ifp,
                         const unsigned char *src_prefix,
                         unsigned char src_plen);
 void send_wildcard_retraction(struct interface *ifp);
+void send_filtered_retraction(struct interface *ifp, const unsigned char *id,
+                              const unsigned char *prefix, unsigned char plen,
+                              const unsigned char *src_prefix,
+                              unsigned char src_plen, unsigned short seqno);
 void update_myseqno(void);
 void send_self_update(struct interface *ifp);
 void send_ihu(struct neighbour *neigh, struct interface *ifp);
@@ -40,6 +40,8 @@ THE SOFTWARE.
 
 struct neighbour *neighs = NULL;
 
+#define FAST_FAILURE_PROBES 3
+
 static struct neighbour *
 find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
 {
@@ -102,6 +104,7 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
     neigh->next = neighs;
     neighs = neigh;
     local_notify_neighbour(neigh, LOCAL_ADD);
+    check_interface_transport(ifp);
     send_hello(ifp);
     return neigh;
 }
@@ -144,12 +147,12 @@ update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
                     /* Late hello. Probably due to the link layer buffering
                        packets during a link outage or overload. Ignore it, but
                        reset the expected seqno. */
-		    /* FIXME: An overbuffered neighbor should get its metric
-                              bumped up so someone else can take the load off.
-                              This msg should also print the delay here. */
-			fprintf(stderr,
-			"Late hello: bufferbloated neighbor %s\n",
-			format_address(neigh->address));
+                    fprintf(stderr,
+                            "Late hello: bufferbloated neighbour %s "
+                            "(%d behind, %dms after the last one).\n",
+                            format_address(neigh->address), -missed_hellos,
+                            (int)timeval_minus_msec(&now, &neigh->hello_time));
+                    neighbour_bloated(neigh);
                     neigh->hello_seqno = hello;
                     hello = -1;
                     missed_hellos = 0;
@@ -161,6 +164,8 @@ update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
         }
         neigh->hello_time = now;
         neigh->hello_interval = hello_interval;
+        if(neigh->probes > 0)
+            neighbour_probe_done(neigh);
     }
 
     if(missed_hellos > 0) {
@@ -201,6 +206,56 @@ update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
     return rc;
 }
 
+/* Called with the capability flag carried by a multicast Hello. */
+void
+neighbour_unicast_capable(struct neighbour *neigh, int capable)
+{
+    if(!(neigh->ifp->flags & IF_UNICAST_HELLO))
+        capable = 0;
+
+    if(!!capable == neigh->unicast_hello)
+        return;
+
+    debugf("Neighbour %s on %s %s unicast Hellos.\n",
+           format_address(neigh->address), neigh->ifp->name,
+           capable ? "accepts" : "no longer accepts");
+    neigh->unicast_hello = !!capable;
+    if(capable) {
+        /* Start right away. */
+        neigh->unicast_hello_timeout = now;
+    } else {
+        neigh->unicast_hello_timeout.tv_sec = 0;
+        neigh->unicast_hello_timeout.tv_usec = 0;
+    }
+}
+
+/* A neighbour that sends us unicast Hellos keeps sending multicast ones
+   for discovery, in a different seqno space and at a longer interval.
+   Returns true if this Hello should be used to compute reachability. */
+int
+neighbour_track_hello(struct neighbour *neigh, int unicast)
+{
+    if(unicast) {
+        if(!neigh->unicast_rx) {
+            /* Switching seqno spaces. */
+            neigh->unicast_rx = 1;
+            neigh->hello_seqno = -1;
+        }
+        return 1;
+    }
+
+    if(neigh->unicast_rx) {
+        if(neigh->hello_interval > 0 &&
+           timeval_minus_msec(&now, &neigh->hello_time) <
+           neigh->hello_interval * 10 * 2)
+            return 0;
+        /* Unicast Hellos stopped, fall back to multicast ones. */
+        neigh->unicast_rx = 0;
+        neigh->hello_seqno = -1;
+    }
+    return 1;
+}
+
 static int
 reset_txcost(struct neighbour *neigh)
 {
@@ -223,6 +278,122 @@ reset_txcost(struct neighbour *neigh)
     return 0;
 }
 
+/* Accelerated loss detection.  Once a neighbour on a fast-failure
+   interface misses a Hello, we probe it with unicast ack requests at 1/4,
+   1/8 and 1/16 of its Hello interval, never more than 250ms apart.  If
+   none of them is answered, the link is considered down without waiting
+   for reach to decay.  Returns true if the neighbour's cost changed;
+   *msecs is lowered to the time of the next probe. */
+static int
+probe_neighbour(struct neighbour *neigh, unsigned *msecs)
+{
+    unsigned interval = neigh->hello_interval * 10;
+    unsigned silence, deadline, delay;
+
+    if(interval == 0)
+        return 0;
+
+    if(timeval_compare(&now, &neigh->probe_time) < 0) {
+        /* Waiting for the next probe, or backing off after a round. */
+        *msecs = MIN(*msecs,
+                     timeval_minus_msec(&neigh->probe_time, &now) + 1);
+        return 0;
+    }
+
+    if(neigh->probes == 0) {
+        silence = timeval_minus_msec(&now, &neigh->hello_time);
+        /* Hellos are jittered by up to a quarter of the interval, and
+           then take up to an RTO to reach us. */
+        deadline = interval + interval / 4 + neighbour_rto(neigh);
+        if(silence < deadline) {
+            *msecs = MIN(*msecs, deadline - silence);
+            return 0;
+        }
+        neigh->probe_nonce = random() & 0xFFFF;
+    } else if(neigh->probes >= FAST_FAILURE_PROBES) {
+        debugf("Neighbour %s on %s didn't answer %d probes.\n",
+               format_address(neigh->address), neigh->ifp->name,
+               neigh->probes);
+        neigh->probes = 0;
+        timeval_add_msec(&neigh->probe_time, &now, interval);
+        *msecs = MIN(*msecs, interval);
+        if(neigh->txcost >= INFINITY)
+            return 0;
+        neigh->txcost = INFINITY;
+        neigh->ihu_time = now;
+        failover_neighbour_routes(neigh);
+        return 1;
+    }
+
+    neigh->probes++;
+    delay = MIN(interval >> (neigh->probes + 1), 250);
+    /* An answer that takes longer than an RTO counts as lost. */
+    if(valid_rtt(neigh))
+        delay = MIN(delay, neighbour_rto(neigh));
+    delay = MAX(delay, 10);
+    /* A fresh nonce for each probe, so that late answers are ignored. */
+    send_ack_request(neigh, neigh->probe_nonce + neigh->probes,
+                     (delay + 9) / 10);
+    timeval_add_msec(&neigh->probe_time, &now, delay);
+    *msecs = MIN(*msecs, delay);
+    return 0;
+}
+
+/* Called with the nonce of an ack received from neigh.  Returns 1 if it
+   answers the current probe, 0 if it came too late. */
+int
+neighbour_probe_answer(struct neighbour *neigh, unsigned short nonce)
+{
+    if(neigh->probes == 0)
+        return 0;
+
+    if(nonce != (unsigned short)(neigh->probe_nonce + neigh->probes)) {
+        unsigned short n = nonce - neigh->probe_nonce;
+        if(n > 0 && n < neigh->probes) {
+            debugf("Late answer to probe from %s on %s.\n",
+                   format_address(neigh->address), neigh->ifp->name);
+            if(neighbour_bloated(neigh))
+                update_neighbour_metric(neigh, 1);
+        }
+        return 0;
+    }
+
+    neighbour_probe_done(neigh);
+    return 1;
+}
+
+void
+neighbour_probe_done(struct neighbour *neigh)
+{
+    debugf("Neighbour %s on %s answered probe %d.\n",
+           format_address(neigh->address), neigh->ifp->name, neigh->probes);
+    neigh->probes = 0;
+    /* Back off: don't probe again until a full interval has elapsed. */
+    timeval_add_msec(&neigh->probe_time, &now, neigh->hello_interval * 10);
+}
+
+/* Mark a neighbour as bufferbloated; its rxcost is increased for a
+   while, so that someone else can take the load off.  Returns 1 if it
+   wasn't already, in which case the caller must call
+   update_neighbour_metric. */
+int
+neighbour_bloated(struct neighbour *neigh)
+{
+    neigh->bloat_time = now;
+    if(neigh->bloated)
+        return 0;
+    neigh->bloated = 1;
+    return 1;
+}
+
+static unsigned
+bloat_penalty(struct neighbour *neigh, unsigned cost)
+{
+    if(!neigh->bloated)
+        return cost;
+    return MIN(cost + cost / 2, INFINITY - 1);
+}
+
 unsigned
 neighbour_txcost(struct neighbour *neigh)
 {
@@ -233,6 +404,7 @@ unsigned
 check_neighbours()
 {
     struct neighbour *neigh;
+    struct interface *ifp;
     int changed, rc;
     unsigned msecs = 50000;
 
@@ -254,6 +426,21 @@ check_neighbours()
         rc = reset_txcost(neigh);
         changed = changed || rc;
 
+        if(neigh->bloated &&
+           timeval_minus_msec(&now, &neigh->bloat_time) >=
+           neigh->hello_interval * 10 * 16) {
+            neigh->bloated = 0;
+            changed = 1;
+        }
+
+        if(neigh->ifp->flags & IF_FAST_FAILURE) {
+            unsigned probe_msecs = 50000;
+            rc = probe_neighbour(neigh, &probe_msecs);
+            changed = changed || rc;
+            /* Our caller stretches the result by 3/2. */
+            msecs = MIN(msecs, MAX(2 * probe_msecs / 3, 10));
+        }
+
         update_neighbour_metric(neigh, changed);
 
         if(neigh->hello_interval > 0)
@@ -263,6 +450,11 @@ check_neighbours()
         neigh = neigh->next;
     }
 
+    FOR_ALL_INTERFACES(ifp) {
+        if(if_up(ifp))
+            check_interface_transport(ifp);
+    }
+
     return msecs;
 }
 
@@ -286,15 +478,17 @@ neighbour_rxcost(struct neighbour *neigh)
         /* cost >= interface->cost */
         if(delay >= 40000)
             cost = (cost * (delay - 20000) + 10000) / 20000;
-        return MIN(cost, INFINITY);
+        if(cost >= INFINITY)
+            return INFINITY;
+        return bloat_penalty(neigh, cost);
     } else {
         /* To lose one hello is a misfortune, to lose two is carelessness. */
         if((reach & 0xC000) == 0xC000)
-            return neigh->ifp->cost;
+            return bloat_penalty(neigh, neigh->ifp->cost);
         else if((reach & 0xC000) == 0)
             return INFINITY;
         else if((reach & 0x2000))
-            return neigh->ifp->cost;
+            return bloat_penalty(neigh, neigh->ifp->cost);
         else
             return INFINITY;
     }
@@ -323,6 +517,18 @@ neighbour_rttcost(struct neighbour *neigh)
     }
 }
 
+/* Retransmission timeout in milliseconds, computed like TCP's from the
+   smoothed RTT and its mean deviation, but no less than MIN_RTO, so
+   that scheduling jitter on fast links isn't mistaken for loss.  Zero
+   if we have no RTT. */
+unsigned
+neighbour_rto(struct neighbour *neigh)
+{
+    if(!valid_rtt(neigh))
+        return 0;
+    return MAX((neigh->rtt + 4 * neigh->rttvar + 999) / 1000, MIN_RTO);
+}
+
 unsigned
 neighbour_cost(struct neighbour *neigh)
 {
@@ -38,12 +38,31 @@ struct neighbour {
        according to remote clock. */
     unsigned int hello_send_us;
     unsigned int rtt;
+    unsigned int rttvar;
     struct timeval hello_rtt_receive_time;
     struct timeval rtt_time;
+    /* Accelerated loss detection, see probe_neighbour. */
+    unsigned char probes;
+    unsigned short probe_nonce;
+    struct timeval probe_time;
+    /* Set when Hellos or probe answers arrive late. */
+    unsigned char bloated;
+    struct timeval bloat_time;
+    /* Unicast Hellos: whether the neighbour announced it understands
+       them, and whether it sends them to us. */
+    unsigned char unicast_hello;
+    unsigned char unicast_rx;
+    unsigned short unicast_hello_seqno;
+    struct timeval unicast_hello_timeout;
+    /* The neighbour understands aggregates. */
+    unsigned char aggregate;
 } CACHELINE_ALIGN;
 
 extern struct neighbour *neighs;
 
+/* Lower bound on the retransmission timeout, in milliseconds. */
+#define MIN_RTO 200
+
 #define FOR_ALL_NEIGHBOURS(_neigh) \
     for(_neigh = neighs; _neigh; _neigh = _neigh->next)
 
@@ -52,10 +71,16 @@ void flush_neighbour(struct neighbour *neigh);
 struct neighbour *find_neighbour(const unsigned char *address,
                                  struct interface *ifp);
 int update_neighbour(struct neighbour *neigh, int hello, int hello_interval);
+void neighbour_probe_done(struct neighbour *neigh);
+int neighbour_bloated(struct neighbour *neigh);
+void neighbour_unicast_capable(struct neighbour *neigh, int capable);
+int neighbour_track_hello(struct neighbour *neigh, int unicast);
+int neighbour_probe_answer(struct neighbour *neigh, unsigned short nonce);
 unsigned check_neighbours(void);
 unsigned neighbour_txcost(struct neighbour *neigh);
 unsigned neighbour_rxcost(struct neighbour *neigh);
 unsigned neighbour_rttcost(struct neighbour *neigh);
+unsigned neighbour_rto(struct neighbour *neigh);
 unsigned neighbour_cost(struct neighbour *neigh);
 
 static inline int
@@ -40,6 +40,7 @@ THE SOFTWARE.
 #include "babeld.h"
 #include "util.h"
 #include "net.h"
+#include "netlink_trace.h"
 
 const int ds = 0x02;        /* ECN without  */
 const int ds_urgent = 0xc2;        /* ECN without  */
@@ -134,6 +135,15 @@ babel_socket(int port)
     return -1;
 }
 
+static void
+trace_sockaddr(int out, const struct sockaddr *sin, int len)
+{
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sin;
+    if(!trace_running() || sin->sa_family != AF_INET6)
+        return;
+    trace_packet(out, sin6->sin6_scope_id, sin6->sin6_addr.s6_addr, len);
+}
+
 int
 babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen)
 {
@@ -152,6 +162,8 @@ babel_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen)
     // Fixme - no error checking here!
 
     rc = recvmsg(s, &msg, 0);
+    if(rc > 0)
+        trace_sockaddr(0, sin, rc);
     return rc;
 }
 
@@ -208,6 +220,8 @@ Which turns out to be the undocumented EADDRNOTAVAIL!
         }
     }
     while(rc < 0 && count < 10);
+    if(rc >= 0)
+        trace_sockaddr(1, sin, rc);
     return rc;
 }
 
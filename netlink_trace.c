@@ -1,78 +1,183 @@
 /**
  * netlink_trace.c
  *
+ * The writer of the trace described in netlink_trace.h.  The trace file
+ * is mapped shared, and every record is stored in place before head is
+ * bumped, so that whatever the kernel has written back when babeld dies
+ * can be decoded.
+ *
+ * Starting a trace renames the previous file at the same path to
+ * path.old rather than truncating it, since it is most likely the trace
+ * of the crash that one is restarting after.  The file is then created
+ * exclusively, without following symbolic links.
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "babeld.h"
+#include "kernel.h"
 #include "netlink_trace.h"
 
-#ifdef NETLINK_TRACE
-FILE *iproutefd = NULL;
+const char *trace_file = "/var/run/babeld.trace";
+
+static struct trace_header *trace_ring = NULL;
+static size_t trace_length = 0;
+
+int
+trace_start(const char *path)
+{
+    struct trace_header *ring;
+    size_t length = sizeof(struct trace_header) +
+        TRACE_RECORDS * sizeof(struct trace_record);
+    char old[1024];
+    int fd, rc;
+
+    rc = snprintf(old, sizeof(old), "%s.old", path);
+    if(rc < 0 || rc >= (int)sizeof(old)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    rc = rename(path, old);
+    if(rc < 0 && errno != ENOENT)
+        return -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if(fd < 0)
+        return -1;
+
+    rc = ftruncate(fd, length);
+    if(rc < 0)
+        goto fail;
+
+    ring = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(ring == MAP_FAILED)
+        goto fail;
+    close(fd);
+
+    memcpy(ring->magic, TRACE_MAGIC, sizeof(ring->magic));
+    ring->records = TRACE_RECORDS;
+    ring->record_size = sizeof(struct trace_record);
+    ring->head = 0;
+
+    trace_stop();
+    trace_ring = ring;
+    trace_length = length;
+    return 1;
+
+ fail:
+    close(fd);
+    return -1;
+}
+
+void
+trace_stop(void)
+{
+    if(trace_ring == NULL)
+        return;
+    munmap(trace_ring, trace_length);
+    trace_ring = NULL;
+    trace_length = 0;
+}
+
+int
+trace_running(void)
+{
+    return trace_ring != NULL;
+}
+
+/* There is a single writer; a reader of the file copies records, then
+   checks that head hasn't moved past them in the meantime. */
+
+static struct trace_record *
+trace_next(int type)
+{
+    struct trace_record *record;
+
+    if(trace_ring == NULL)
+        return NULL;
+
+    record = (struct trace_record*)(trace_ring + 1) +
+        (trace_ring->head & (TRACE_RECORDS - 1));
+    memset(record, 0, sizeof(*record));
+    record->sec = now.tv_sec;
+    record->usec = now.tv_usec;
+    record->type = type;
+    return record;
+}
 
-// Now is global. We don't need to get or format it every time
-// and we're trying to recreate hairy race conditions here.
-// Hmm. I wonder if we could do multipath with a /whatever on the newgate
+static void
+trace_commit(void)
+{
+    __atomic_store_n(&trace_ring->head, trace_ring->head + 1,
+                     __ATOMIC_RELEASE);
+}
 
-int replay_iproute(int operation, const unsigned char *src,
-	           const unsigned char *dest,
- 		   unsigned char src_plen, unsigned char dest_plen,
-		   const unsigned char *gate,	int table, int metric, int ifindex,
- 		   const unsigned char *newgate, int newtable, int newmetric, int newifindex)
+void
+trace_route(int operation, const unsigned char *dest, int plen,
+            const unsigned char *src, int src_plen,
+            const unsigned char *gate, int ifindex,
+            int table, int priority, int unreachable, unsigned int seqno)
 {
-	static struct timeval mynow;
-	static int err = 0;
-	static char buf[64];
-
-	if(err != 0) return -1; // Don't try to reopen the file
-	if(iproutefd == NULL) {
-		iproutefd = fopen("/tmp/babel_replay.log","w");
-      		if(iproutefd == NULL) { err++; return -1; }
-	}
-	if(timeval_compare(&mynow, &now) != 0) {
-		mynow = now;
-		snprintf(buf, sizeof buf, "%ld.%.6ld", mynow.tv_sec, mynow.tv_usec);
-// arguably human readable would be easier on me
-//		strftime(tmbuf, sizeof tmbuf, "%Y-%m-%d %H:%M:%S", mynow.tv_sec);
-//              snprintf(buf, sizeof buf, "%s.%06ld", tmbuf, mynow.tv_usec);
-	}
-	char ifname[256];
-	if(v4mapped(dest) && dest_plen > 96) {
-	fprintf(iproutefd, "%s : ip route %s %s "
-            "table %d metric %d dev %s via %s",
-	    buf,
-            operation == ROUTE_ADD ? "add" :
-            operation == ROUTE_FLUSH ? "flush" :
-	    operation == ROUTE_MODIFY ? "replace" : "???",
-            format_prefix(dest, dest_plen),
-		table, metric, if_indextoname(ifindex,ifname), format_address(gate));
-	} else {
-	fprintf(iproutefd, "%s : ip route %s %s from %s "
-            "table %d metric %d dev %s via %s",
-	    buf,
-            operation == ROUTE_ADD ? "add" :
-            operation == ROUTE_FLUSH ? "flush" :
-	    operation == ROUTE_MODIFY ? "replace" : "???",
-            format_prefix(dest, dest_plen), format_prefix(src, src_plen),
-		table, metric, if_indextoname(ifindex,ifname), format_address(gate));
-	}
-	return 0;
+    struct trace_record *record = trace_next(TRACE_ROUTE);
+    if(record == NULL)
+        return;
+    record->op = operation;
+    record->plen = plen;
+    record->src_plen = src_plen;
+    record->u.route.table = table;
+    record->u.route.priority = priority;
+    record->u.route.ifindex = ifindex;
+    record->u.route.unreachable = unreachable;
+    record->u.route.seqno = seqno;
+    memcpy(record->u.route.dest, dest, 16);
+    if(src)
+        memcpy(record->u.route.src, src, 16);
+    if(gate)
+        memcpy(record->u.route.gate, gate, 16);
+    trace_commit();
+}
 
+void
+trace_route_status(unsigned int seqno, int rc, int error)
+{
+    struct trace_record *record = trace_next(TRACE_ROUTE_STATUS);
+    if(record == NULL)
+        return;
+    record->u.status.rc = rc;
+    record->u.status.error = error;
+    record->u.status.seqno = seqno;
+    trace_commit();
 }
 
-int replay_iproute_status(int rc, int errv) {
-	static int err = 0;
-	int errno_safe = errno;
-	if(err != 0) return -1; // Don't try to reopen the file
-	if(iproutefd == NULL) {
-		iproutefd = fopen("/tmp/babel_replay.log","w");
-      		if(iproutefd == NULL) { err++; return -1; }
-	}
-	if(errno == 0) {
-		fprintf(iproutefd, " # OK\n");
-	} else {
-		fprintf(iproutefd, " # rc=%d errno=%d\n", rc, errv);
-	}
-        errno = errno_safe;
-	return rc;
+void
+trace_packet(int out, int ifindex, const unsigned char *address, int len)
+{
+    struct trace_record *record =
+        trace_next(out ? TRACE_PACKET_OUT : TRACE_PACKET_IN);
+    if(record == NULL)
+        return;
+    record->u.packet.ifindex = ifindex;
+    record->u.packet.len = len;
+    memcpy(record->u.packet.address, address, 16);
+    trace_commit();
 }
 
-#endif
+void
+trace_timer(int kind, int ifindex)
+{
+    struct trace_record *record = trace_next(TRACE_TIMER);
+    if(record == NULL)
+        return;
+    record->op = kind;
+    record->u.timer.ifindex = ifindex;
+    trace_commit();
+}
@@ -1,30 +1,96 @@
 /**
  * netlink_trace.h
+ *
+ * A binary trace of the routes we program into the kernel, of the packets
+ * we send and receive and of the timers that fire.  Records go into a
+ * ring of fixed size mapped from a file, so that the trace survives a
+ * crash; babeltrace decodes it into a replayable list of ip route
+ * commands.
  */
 
 #ifndef NETLINK_TRACE_H
 #define NETLINK_TRACE_H
 
-#ifdef NETLINK_TRACE
+#include <stdint.h>
 
-extern FILE *iproutefd;
+#define TRACE_MAGIC "BABTRAC2"
 
-extern int replay_iproute_status(int rc, int errv);
-int replay_iproute(int operation, const unsigned char *src,
-	           const unsigned char *dest,
- 		   unsigned char src_plen, unsigned char dest_plen,
-		   const unsigned char *gate,	int table, int metric, int ifindex,
- 		   const unsigned char *newgate, int newtable, int newmetric, int newifindex)
+#ifndef TRACE_RECORDS
+#define TRACE_RECORDS 16384     /* a power of two */
+#endif
+
+#define TRACE_ROUTE 1
+#define TRACE_ROUTE_STATUS 2
+#define TRACE_PACKET_IN 3
+#define TRACE_PACKET_OUT 4
+#define TRACE_TIMER 5
+
+#define TRACE_TIMER_NEIGHBOURS 1
+#define TRACE_TIMER_INTERFACES 2
+#define TRACE_TIMER_EXPIRY 3
+#define TRACE_TIMER_SOURCES 4
+#define TRACE_TIMER_HELLO 5
+#define TRACE_TIMER_UPDATE 6
+#define TRACE_TIMER_FLUSH 7
+#define TRACE_TIMER_UNICAST_HELLO 8
+#define TRACE_TIMER_RESEND 9
+#define TRACE_TIMER_KERNEL_DUMP 10
+
+struct trace_header {
+    char magic[8];
+    uint32_t records;
+    uint32_t record_size;
+    /* The number of records ever written; the writer bumps it once a
+       record is complete. */
+    uint64_t head;
+};
+
+struct trace_record {
+    uint32_t sec, usec;
+    uint8_t type;
+    uint8_t op;                 /* ROUTE_* or TRACE_TIMER_* */
+    uint8_t plen, src_plen;
+    union {
+        struct {
+            int32_t table, priority, ifindex, unreachable;
+            unsigned char dest[16], src[16], gate[16];
+            uint32_t seqno;     /* 0 if the request wasn't sent */
+        } route;
+        struct {
+            /* The status of the request seqno, traced once its ACK has
+               been processed: rc is 0 if the request was applied, -1 if
+               it failed and 2 if the ACK was lost.  A request that was
+               elided gets rc 1 and seqno 0 straight away. */
+            int32_t rc, error;
+            uint32_t seqno;
+        } status;
+        struct {
+            int32_t ifindex, len;
+            unsigned char address[16];
+        } packet;
+        struct {
+            int32_t ifindex;
+        } timer;
+    } u;
+};
+
+#ifndef TRACE_DECODER
+
+extern const char *trace_file;
 
-#else
-static inline int replay_iproute_status(int rc, int errv) { return 0; }
+int trace_start(const char *path);
+void trace_stop(void);
+int trace_running(void);
 
-static inline int replay_iproute(int operation, const unsigned char *src, const unsigned char *dest,
- 		   const unsigned char src_plen, const unsigned char dest_plen,
-		   const unsigned char *gate,	int table, int metric, int ifindex,
-		const unsigned char *newgate, int newtable, int newmetric, int newifindex) {
-   	return 0;
-}
+void trace_route(int operation, const unsigned char *dest, int plen,
+                 const unsigned char *src, int src_plen,
+                 const unsigned char *gate, int ifindex,
+                 int table, int priority, int unreachable,
+                 unsigned int seqno);
+void trace_route_status(unsigned int seqno, int rc, int error);
+void trace_packet(int out, int ifindex, const unsigned char *address,
+                  int len);
+void trace_timer(int kind, int ifindex);
 
 #endif
 #endif
@@ -45,6 +45,9 @@ THE SOFTWARE.
 struct babel_route **routes = NULL;
 static int route_slots = 0, max_route_slots = 0;
 int kernel_metric = 0, reflect_kernel_metric = 0;
+int fast_reroute = 0;
+int multipath_max = 1, multipath_tolerance = 10; /* in percent */
+int kernel_expiry = 0;
 int allow_duplicates = -1;
 int diversity_kind = DIVERSITY_NONE;
 int diversity_factor = 256;     /* in units of 1/256 */
@@ -200,6 +203,209 @@ installed_routes_estimate(void)
     return route_slots;
 }
 
+/* The installed routes, sorted by destination then source, and by source
+   then destination.  Disambiguation looks up the routes that share a
+   destination or a source with a zone instead of walking the RIB. */
+
+static struct babel_route **installed_by_dst = NULL, **installed_by_src = NULL;
+static int installed_count = 0, max_installed_count = 0;
+
+static int
+key_compare(const unsigned char *prefix, unsigned char plen,
+            const unsigned char *prefix1, unsigned char plen1)
+{
+    int i = memcmp(prefix, prefix1, 16);
+    if(i != 0)
+        return i;
+    return (int)plen - (int)plen1;
+}
+
+static int
+dst_compare(const struct babel_route *route, const struct babel_route *route1)
+{
+    int i = key_compare(route->src->prefix, route->src->plen,
+                        route1->src->prefix, route1->src->plen);
+    if(i != 0)
+        return i;
+    return key_compare(route->src->src_prefix, route->src->src_plen,
+                       route1->src->src_prefix, route1->src->src_plen);
+}
+
+static int
+src_compare(const struct babel_route *route, const struct babel_route *route1)
+{
+    int i = key_compare(route->src->src_prefix, route->src->src_plen,
+                        route1->src->src_prefix, route1->src->src_plen);
+    if(i != 0)
+        return i;
+    return key_compare(route->src->prefix, route->src->plen,
+                       route1->src->prefix, route1->src->plen);
+}
+
+/* The first position in index at which route doesn't sort before. */
+static int
+index_position(struct babel_route **index,
+               int (*compare)(const struct babel_route *,
+                              const struct babel_route *),
+               const struct babel_route *route)
+{
+    int p = 0, g = installed_count;
+    while(p < g) {
+        int m = (p + g) / 2;
+        if(compare(index[m], route) < 0)
+            p = m + 1;
+        else
+            g = m;
+    }
+    return p;
+}
+
+static void
+index_insert(struct babel_route **index,
+             int (*compare)(const struct babel_route *,
+                            const struct babel_route *),
+             struct babel_route *route)
+{
+    int i = index_position(index, compare, route);
+    if(i < installed_count)
+        memmove(index + i + 1, index + i,
+                (installed_count - i) * sizeof(struct babel_route*));
+    index[i] = route;
+}
+
+static void
+index_remove(struct babel_route **index,
+             int (*compare)(const struct babel_route *,
+                            const struct babel_route *),
+             struct babel_route *route)
+{
+    int i = index_position(index, compare, route);
+    assert(i < installed_count && index[i] == route);
+    if(i < installed_count - 1)
+        memmove(index + i, index + i + 1,
+                (installed_count - i - 1) * sizeof(struct babel_route*));
+}
+
+/* Make room for one more installed route. */
+static int
+index_reserve(void)
+{
+    int n;
+    struct babel_route **new_dst, **new_src;
+
+    if(installed_count < max_installed_count)
+        return 1;
+
+    n = max_installed_count < 1 ? 8 : 2 * max_installed_count;
+    new_dst = realloc(installed_by_dst, n * sizeof(struct babel_route*));
+    if(new_dst == NULL)
+        return -1;
+    installed_by_dst = new_dst;
+    new_src = realloc(installed_by_src, n * sizeof(struct babel_route*));
+    if(new_src == NULL)
+        return -1;
+    installed_by_src = new_src;
+    max_installed_count = n;
+    return 1;
+}
+
+static void
+index_route(struct babel_route *route)
+{
+    assert(installed_count < max_installed_count);
+    index_insert(installed_by_dst, dst_compare, route);
+    index_insert(installed_by_src, src_compare, route);
+    installed_count++;
+}
+
+static void
+unindex_route(struct babel_route *route)
+{
+    index_remove(installed_by_dst, dst_compare, route);
+    index_remove(installed_by_src, src_compare, route);
+    installed_count--;
+}
+
+/* The keys of route in the index sorted by destination, or by source. */
+static void
+index_keys(const struct babel_route *route, int dst,
+           const unsigned char **first, unsigned char *first_plen,
+           const unsigned char **second, unsigned char *second_plen)
+{
+    const struct source *src = route->src;
+    *first = dst ? src->prefix : src->src_prefix;
+    *first_plen = dst ? src->plen : src->src_plen;
+    *second = dst ? src->src_prefix : src->prefix;
+    *second_plen = dst ? src->src_plen : src->plen;
+}
+
+/* The routes of an index whose first key is prefix/plen and whose second
+   key is strictly more specific than within/within_plen.  Since keys are
+   sorted by address then length, these are contiguous: they start right
+   after within itself, and end with the last address inside it. */
+static int
+index_range(struct babel_route **index, int dst,
+            const unsigned char *prefix, unsigned char plen,
+            const unsigned char *within, unsigned char within_plen,
+            struct babel_route ***routes_return)
+{
+    const unsigned char *k1, *k2;
+    unsigned char l1, l2, last[16];
+    int p = 0, g = installed_count, i;
+
+    *routes_return = index;
+    if(within_plen >= 128)
+        return 0;
+
+    memcpy(last, within, 16);
+    for(i = within_plen; i < 128; i++)
+        last[i / 8] |= 0x80 >> (i % 8);
+
+    while(p < g) {
+        int m = (p + g) / 2;
+        int c;
+        index_keys(index[m], dst, &k1, &l1, &k2, &l2);
+        c = key_compare(k1, l1, prefix, plen);
+        if(c == 0)
+            c = key_compare(k2, l2, within, within_plen + 1);
+        if(c < 0)
+            p = m + 1;
+        else
+            g = m;
+    }
+    for(i = p; i < installed_count; i++) {
+        index_keys(index[i], dst, &k1, &l1, &k2, &l2);
+        if(key_compare(k1, l1, prefix, plen) != 0 || memcmp(k2, last, 16) > 0)
+            break;
+    }
+
+    *routes_return = index + p;
+    return i - p;
+}
+
+/* Sets *routes_return to the installed routes to prefix/plen from a source
+   strictly inside src_prefix/src_plen, and returns their number.  The
+   array is only valid until a route is installed or uninstalled. */
+int
+installed_routes_to(const unsigned char *prefix, unsigned char plen,
+                    const unsigned char *src_prefix, unsigned char src_plen,
+                    struct babel_route ***routes_return)
+{
+    return index_range(installed_by_dst, 1, prefix, plen,
+                       src_prefix, src_plen, routes_return);
+}
+
+/* Likewise for the installed routes from src_prefix/src_plen to a
+   destination strictly inside prefix/plen. */
+int
+installed_routes_from(const unsigned char *src_prefix, unsigned char src_plen,
+                      const unsigned char *prefix, unsigned char plen,
+                      struct babel_route ***routes_return)
+{
+    return index_range(installed_by_src, 0, src_prefix, src_plen,
+                       prefix, plen, routes_return);
+}
+
 static int
 resize_route_table(int new_slots)
 {
@@ -260,16 +466,210 @@ static void
 destroy_route(struct babel_route *route)
 {
     free(route->channels);
+    free(route->multipath);
     free(route);
 }
 
+/* The best feasible route through another neighbour, which the kernel
+   can fall back to as soon as the neighbour of route goes away.  Since
+   every feasible route is loop-free, this is a loop-free alternate. */
+static struct babel_route *
+backup_route(struct babel_route *route)
+{
+    struct babel_route *backup;
+
+    if(!fast_reroute || !has_kernel_nexthops)
+        return NULL;
+
+    backup = find_best_route(route->src->prefix, route->src->plen,
+                             route->src->src_prefix, route->src->src_plen,
+                             1, route->neigh);
+    if(backup == NULL || route_metric(backup) >= INFINITY)
+        return NULL;
+    return backup;
+}
+
+static int route_acceptable(struct babel_route *route, int feasible,
+                            struct neighbour *exclude);
+
+/* Fill paths with the next hops of the feasible routes whose smoothed
+   metric is within multipath_tolerance percent of that of route, route
+   first and then best first, weighted in inverse proportion to their
+   smoothed metric.  Returns the number of paths, or 0 if route is alone.
+   Feasible routes are loop-free, so this cannot create a loop either. */
+static int
+multipath_routes(struct babel_route *route, struct kernel_multipath *paths)
+{
+    struct babel_route *best[KERNEL_MAX_MULTIPATH];
+    struct babel_route *r;
+    int i, j, n, max, limit, least;
+
+    max = MIN(multipath_max, KERNEL_MAX_MULTIPATH);
+    if(max <= 1 || route_metric(route) >= INFINITY)
+        return 0;
+
+    i = find_route_slot(route->src->prefix, route->src->plen,
+                        route->src->src_prefix, route->src->src_plen, NULL);
+    if(i < 0)
+        return 0;
+
+    best[0] = route;
+    n = 1;
+    limit = route_smoothed_metric(route) * (100 + multipath_tolerance) / 100;
+    for(r = routes[i]; r; r = r->next) {
+        int sm;
+        if(r == route || !route_acceptable(r, 1, NULL) ||
+           route_metric(r) >= INFINITY)
+            continue;
+        sm = route_smoothed_metric(r);
+        if(sm > limit)
+            continue;
+        /* The kernel wants distinct next hops. */
+        for(j = 0; j < n; j++) {
+            if(best[j]->neigh->ifp == r->neigh->ifp &&
+               v6_equal(best[j]->nexthop, r->nexthop))
+                break;
+        }
+        if(j < n)
+            continue;
+        if(n >= max) {
+            if(sm >= route_smoothed_metric(best[n - 1]))
+                continue;
+            n--;
+        }
+        j = n;
+        while(j > 1 && route_smoothed_metric(best[j - 1]) > sm) {
+            best[j] = best[j - 1];
+            j--;
+        }
+        best[j] = r;
+        n++;
+    }
+
+    if(n <= 1)
+        return 0;
+
+    least = route_smoothed_metric(best[0]);
+    for(j = 1; j < n; j++)
+        least = MIN(least, route_smoothed_metric(best[j]));
+
+    for(j = 0; j < n; j++) {
+        int sm = route_smoothed_metric(best[j]);
+        memcpy(paths[j].gate, best[j]->nexthop, 16);
+        paths[j].ifindex = best[j]->neigh->ifp->ifindex;
+        /* Coarse weights, so that small variations of the smoothed
+           metric don't cause churn. */
+        paths[j].weight = MAX(1, (16 * (least + 1) + sm / 2) / (sm + 1));
+    }
+    return n;
+}
+
+static void
+clear_alternates(struct babel_route *route)
+{
+    route->backup = NULL;
+    free(route->multipath);
+    route->multipath = NULL;
+    route->multipath_len = 0;
+}
+
+/* Recompute the backup and the multipath next hops of route, which is
+   being installed.  Returns 1 if they changed. */
+static int
+update_alternates(struct babel_route *route)
+{
+    struct kernel_multipath paths[KERNEL_MAX_MULTIPATH];
+    struct babel_route *backup;
+    int n, changed = 0;
+
+    backup = backup_route(route);
+    if(backup != route->backup) {
+        route->backup = backup;
+        changed = 1;
+    }
+
+    n = multipath_routes(route, paths);
+    if(n != route->multipath_len ||
+       (n > 0 && memcmp(paths, route->multipath,
+                        n * sizeof(struct kernel_multipath)) != 0)) {
+        struct kernel_multipath *new = NULL;
+        if(n > 0) {
+            new = malloc(n * sizeof(struct kernel_multipath));
+            if(new == NULL) {
+                perror("malloc(multipath)");
+                n = 0;
+            } else {
+                memcpy(new, paths, n * sizeof(struct kernel_multipath));
+            }
+        }
+        free(route->multipath);
+        route->multipath = new;
+        route->multipath_len = n;
+        changed = 1;
+    }
+    return changed;
+}
+
+/* The lifetime of the kernel route of route, 0 if it doesn't expire.  It
+   is twice the hold time, so that the kernel never drops a route before
+   we do as long as it is renewed within a hold time of each update. */
+int
+route_kernel_lifetime(const struct babel_route *route)
+{
+    if(!kernel_expiry || v4mapped(route->nexthop))
+        return 0;
+    return 2 * route->hold_time;
+}
+
+/* The kernel route of route was just programmed. */
+static void
+note_kernel_expiry(struct babel_route *route)
+{
+    int lifetime = route_kernel_lifetime(route);
+    route->kernel_expires = lifetime > 0 ? now.tv_sec + lifetime : 0;
+}
+
+/* Route was just updated; renew its kernel lifetime if it would run out
+   before the route itself expires. */
+static void
+refresh_kernel_expiry(struct babel_route *route)
+{
+    if(!route->installed || route->kernel_expires == 0)
+        return;
+    if(route->kernel_expires - now.tv_sec >= route->hold_time)
+        return;
+    if(krefresh_route(route) >= 0)
+        note_kernel_expiry(route);
+}
+
+/* The routes to src changed, but not the installed one; reprogram it if
+   its backup or its multipath next hops changed. */
+static void
+refresh_alternates(struct source *src, int force)
+{
+    struct babel_route *installed;
+
+    if((!fast_reroute || !has_kernel_nexthops) && multipath_max <= 1)
+        return;
+
+    installed = find_installed_route(src->prefix, src->plen,
+                                     src->src_prefix, src->src_plen);
+    if(installed == NULL)
+        return;
+
+    if(!update_alternates(installed) && !force)
+        return;
+    if(kswitch_routes(installed, installed) >= 0)
+        note_kernel_expiry(installed);
+}
+
 void
 flush_route(struct babel_route *route)
 {
     int i;
     struct source *src;
     unsigned oldmetric;
-    int lost = 0;
+    int lost = 0, was_backup = 0;
 
     oldmetric = route_metric(route);
     src = route->src;
@@ -277,6 +677,14 @@ flush_route(struct babel_route *route)
     if(route->installed) {
         uninstall_route(route);
         lost = 1;
+    } else if(fast_reroute) {
+        struct babel_route *installed =
+            find_installed_route(src->prefix, src->plen,
+                                 src->src_prefix, src->src_plen);
+        if(installed && installed->backup == route) {
+            installed->backup = NULL;
+            was_backup = 1;
+        }
     }
 
     i = find_route_slot(route->src->prefix, route->src->plen,
@@ -314,6 +722,8 @@ flush_route(struct babel_route *route)
 
     if(lost)
         route_lost(src, oldmetric);
+    else
+        refresh_alternates(src, was_backup);
 
     release_source(src);
 }
@@ -338,11 +748,68 @@ flush_all_routes()
     check_sources_released();
 }
 
+/* Call f once for each gateway of the routes through neigh, which is
+   usually just its address. */
+static void
+neighbour_nexthops(struct neighbour *neigh,
+                   int (*f)(const unsigned char *gate, int ifindex))
+{
+    unsigned char (*gates)[16] = NULL;
+    int numgates = 0, maxgates = 0;
+    int i, j;
+
+    for(i = 0; i < route_slots; i++) {
+        struct babel_route *r;
+        for(r = routes[i]; r; r = r->next) {
+            if(r->neigh != neigh)
+                continue;
+            for(j = 0; j < numgates; j++) {
+                if(v6_equal(gates[j], r->nexthop))
+                    break;
+            }
+            if(j < numgates)
+                continue;
+            if(numgates >= maxgates) {
+                unsigned char (*new_gates)[16];
+                int n = maxgates < 1 ? 8 : 2 * maxgates;
+                new_gates = realloc(gates, n * 16);
+                if(new_gates == NULL) {
+                    f(r->nexthop, neigh->ifp->ifindex);
+                    continue;
+                }
+                gates = new_gates;
+                maxgates = n;
+            }
+            memcpy(gates[numgates++], r->nexthop, 16);
+        }
+    }
+
+    for(j = 0; j < numgates; j++)
+        f(gates[j], neigh->ifp->ifindex);
+    free(gates);
+}
+
+/* Neigh was just found to be unreachable: have the kernel fail over the
+   routes through it to their backups without waiting for the protocol. */
+void
+failover_neighbour_routes(struct neighbour *neigh)
+{
+    if(has_kernel_nexthops)
+        neighbour_nexthops(neigh, kernel_failover_nexthop);
+}
+
 void
 flush_neighbour_routes(struct neighbour *neigh)
 {
     int i;
 
+    /* Removing the nexthop objects first takes all the routes through
+       this neighbour out of the kernel at once, or fails them over to
+       their backups if that hasn't happened yet; flush_route below only
+       has to install the alternatives. */
+    if(has_kernel_nexthops)
+        neighbour_nexthops(neigh, kernel_flush_nexthop);
+
     i = 0;
     while(i < route_slots) {
         struct babel_route *r;
@@ -365,6 +832,9 @@ flush_interface_routes(struct interface *ifp, int v4only)
 {
     int i;
 
+    if(has_kernel_nexthops && !v4only)
+        kernel_flush_nexthop(NULL, ifp->ifindex);
+
     i = 0;
     while(i < route_slots) {
         struct babel_route *r;
@@ -516,11 +986,21 @@ install_route(struct babel_route *route)
         return;
     }
 
+    if(index_reserve() < 0) {
+        perror("malloc(installed routes)");
+        return;
+    }
+
+    update_alternates(route);
     rc = kinstall_route(route);
-    if(rc < 0 && errno != EEXIST)
+    if(rc < 0 && errno != EEXIST) {
+        clear_alternates(route);
         return;
+    }
 
     route->installed = 1;
+    index_route(route);
+    note_kernel_expiry(route);
     move_installed_route(route, i);
 
     local_notify_route(route, LOCAL_CHANGE);
@@ -533,12 +1013,32 @@ uninstall_route(struct babel_route *route)
         return;
 
     route->installed = 0;
+    route->kernel_expires = 0;
+    unindex_route(route);
+    clear_alternates(route);
 
     kuninstall_route(route);
 
     local_notify_route(route, LOCAL_CHANGE);
 }
 
+/* The kernel refused route, which we believed installed; forget about it
+   without touching the kernel. */
+void
+forget_installed_route(struct babel_route *route)
+{
+    if(!route->installed)
+        return;
+
+    route->installed = 0;
+    route->kernel_expires = 0;
+    unindex_route(route);
+    kforget_route(route);
+    clear_alternates(route);
+
+    local_notify_route(route, LOCAL_CHANGE);
+}
+
 /* This is equivalent to uninstall_route followed with install_route,
    but without the race condition.  The destination of both routes
    must be the same. */
@@ -560,12 +1060,20 @@ switch_routes(struct babel_route *old, struct babel_route *new)
         fprintf(stderr, "WARNING: switching to unfeasible route "
                 "(this shouldn't happen).");
 
+    update_alternates(new);
     rc = kswitch_routes(old, new);
-    if(rc < 0)
+    if(rc < 0) {
+        clear_alternates(new);
         return;
+    }
 
     old->installed = 0;
+    old->kernel_expires = 0;
+    unindex_route(old);
+    clear_alternates(old);
     new->installed = 1;
+    index_route(new);
+    note_kernel_expiry(new);
     move_installed_route(new, find_route_slot(new->src->prefix, new->src->plen,
                                               new->src->src_prefix,
                                               new->src->src_plen,
@@ -589,6 +1097,7 @@ change_route_metric(struct babel_route *route,
         rc = kchange_route_metric(route, refmetric, cost, add);
         if(rc < 0)
             return;
+        note_kernel_expiry(route);
     }
 
     /* Update route->smoothed_metric using the old metric. */
@@ -972,6 +1481,7 @@ update_route(const unsigned char *id,
         route->hold_time = hold_time;
 
         route_changed(route, oldsrc, oldmetric);
+        refresh_kernel_expiry(route);
         if(lost)
             route_lost(oldsrc, oldmetric);
 
@@ -1070,12 +1580,12 @@ consider_route(struct babel_route *route)
         return;
 
     if(!route_feasible(route))
-        return;
+        goto done;
 
     xroute = find_xroute(route->src->prefix, route->src->plen,
                          route->src->src_prefix, route->src->src_plen);
     if(xroute && (allow_duplicates < 0 || xroute->metric >= allow_duplicates))
-        return;
+        goto done;
 
     installed = find_installed_route(route->src->prefix, route->src->plen,
                                      route->src->src_prefix,
@@ -1085,7 +1595,7 @@ consider_route(struct babel_route *route)
         goto install;
 
     if(route_metric(route) >= INFINITY)
-        return;
+        goto done;
 
     if(route_metric(installed) >= INFINITY)
         goto install;
@@ -1094,6 +1604,10 @@ consider_route(struct babel_route *route)
        route_smoothed_metric(installed) > route_smoothed_metric(route))
         goto install;
 
+ done:
+    /* We're not switching, but route may now be a better backup, or
+       share the traffic of the installed route. */
+    refresh_alternates(route->src, 0);
     return;
 
  install:
@@ -1201,6 +1715,7 @@ route_changed(struct babel_route *route,
 
     if(route->installed) {
         /* We didn't change routes after all. */
+        refresh_alternates(route->src, 0);
         send_triggered_update(route, oldsrc, oldmetric);
     } else {
         /* Reconsider routes even when their metric didn't decrease,
@@ -43,15 +43,26 @@ struct babel_route {
     short installed;
     short channels_len;
     unsigned char *channels;
+    /* For an installed route, the feasible alternative that the kernel
+       fails over to (fast reroute). */
+    struct babel_route *backup;
+    /* For an installed route, the next hops that share its traffic, its
+       own first (multipath); multipath_len is 0 if it has only one. */
+    struct kernel_multipath *multipath;
+    int multipath_len;
+    /* When the kernel drops an installed route by itself, 0 for never. */
+    time_t kernel_expires;
 } CACHELINE_ALIGN;
 
 #define ROUTE_ALL 0
 #define ROUTE_INSTALLED 1
 #define ROUTE_SS_INSTALLED 2
 struct route_stream;
+struct kernel_multipath;
 
 extern struct babel_route **routes;
 extern int kernel_metric, allow_duplicates, reflect_kernel_metric;
+extern int fast_reroute, multipath_max, multipath_tolerance, kernel_expiry;
 extern int diversity_kind, diversity_factor;
 extern int keep_unfeasible;
 
@@ -82,6 +93,7 @@ struct babel_route *find_installed_route(const unsigned char *prefix,
 int installed_routes_estimate(void);
 void flush_route(struct babel_route *route);
 void flush_all_routes(void);
+void failover_neighbour_routes(struct neighbour *neigh);
 void flush_neighbour_routes(struct neighbour *neigh);
 void flush_interface_routes(struct interface *ifp, int v4only);
 struct route_stream *route_stream(int which);
@@ -90,8 +102,18 @@ void route_stream_done(struct route_stream *stream);
 int metric_to_kernel(int metric);
 void install_route(struct babel_route *route);
 void uninstall_route(struct babel_route *route);
+void forget_installed_route(struct babel_route *route);
+int installed_routes_to(const unsigned char *prefix, unsigned char plen,
+                        const unsigned char *src_prefix,
+                        unsigned char src_plen,
+                        struct babel_route ***routes_return);
+int installed_routes_from(const unsigned char *src_prefix,
+                          unsigned char src_plen,
+                          const unsigned char *prefix, unsigned char plen,
+                          struct babel_route ***routes_return);
 int route_feasible(struct babel_route *route);
 int route_old(struct babel_route *route);
+int route_kernel_lifetime(const struct babel_route *route);
 int route_expired(struct babel_route *route);
 int route_interferes(struct babel_route *route, struct interface *ifp);
 int update_feasible(struct source *src,
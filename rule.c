@@ -35,6 +35,7 @@ THE SOFTWARE.
 
 int src_table_idx = 10;
 int src_table_prio = 100;
+int src_table_num = SRC_TABLE_NUM;
 
 /* The table used for non-specific routes is "export_table", therefore, we can
    take the convention of plen == 0 <=> empty table. */
@@ -42,21 +43,67 @@ struct rule {
     unsigned char src[16];
     unsigned char plen;
     unsigned char table;
+    int priority;
 };
 
-/* rules contains informations about the rules we installed. It is an array
-   indexed by: <table priority> - src_table_prio.
-   (First entries are the most specific, since they have priority.) */
-static struct rule rules[SRC_TABLE_NUM];
+/* rules contains informations about the rules we installed, sorted by
+   priority.  (First entries are the most specific, since they have
+   priority.)  Priorities are spread out over the range we own, so that a
+   new rule can usually go between its neighbours without moving them. */
+static struct rule *rules = NULL;
+static int numrules = 0, maxrules = 0;
 /* used tables is indexed by: <table number> - src_table_idx
    used_tables[i] == 1 <=> the table number (i + src_table_idx) is used */
-static char used_tables[SRC_TABLE_NUM] = {0};
+static char used_tables[256] = {0};
+
+static int
+rule_priority_end(void)
+{
+    return src_table_prio + src_table_num * RULE_PRIORITY_GAP;
+}
+
+int
+own_rule_priority(unsigned int priority)
+{
+    return priority >= src_table_prio && priority < rule_priority_end();
+}
+
+static int
+src_table(int table)
+{
+    return table >= src_table_idx && table < src_table_idx + src_table_num;
+}
+
+int
+own_table(int table)
+{
+    return table == export_table || src_table(table);
+}
+
+static int
+find_rule_priority(unsigned int priority)
+{
+    int p, m, g;
+
+    p = 0;
+    g = numrules - 1;
+    while(p <= g) {
+        m = (p + g) / 2;
+        if(rules[m].priority == priority)
+            return m;
+        else if(rules[m].priority > priority)
+            g = m - 1;
+        else
+            p = m + 1;
+    }
+    return -1;
+}
 
 static int
 get_free_table(void)
 {
     int i;
-    for(i = 0; i < SRC_TABLE_NUM; i++)
+    for(i = 0; i < src_table_num; i++)
         if(!used_tables[i]) {
             used_tables[i] = 1;
             return i + src_table_idx;
@@ -70,48 +117,82 @@ release_table(int i)
     used_tables[i - src_table_idx] = 0;
 }
 
+/* Spread the priorities of all rules evenly, leaving a hole at idx, and
+   move the rules in the kernel in one batch. */
 static int
-find_hole_around(int i)
+renumber_rules(int idx)
 {
-    int j;
-    for(j = i; j < SRC_TABLE_NUM; j++)
-        if(rules[j].plen == 0)
-            return j;
-    for(j = i - 1; j >= 0; j--)
-        if(rules[j].plen == 0)
-            return j;
-    return -1;
+    struct kernel_rule *old, *new;
+    int step = (rule_priority_end() - src_table_prio) / (numrules + 1);
+    int i, n = 0, rc;
+
+    old = malloc(2 * numrules * sizeof(struct kernel_rule));
+    if(old == NULL)
+        return -1;
+    new = old + numrules;
+
+    for(i = 0; i < numrules; i++) {
+        int priority =
+            src_table_prio + (i < idx ? i : i + 1) * step + step / 2;
+        if(priority == rules[i].priority)
+            continue;
+        memcpy(old[n].src, rules[i].src, 16);
+        old[n].src_plen = rules[i].plen;
+        old[n].table = rules[i].table;
+        old[n].priority = rules[i].priority;
+        new[n] = old[n];
+        new[n].priority = priority;
+        n++;
+    }
+
+    kdebugf("Renumbering %d rules.\n", n);
+    rc = change_rules(old, new, n);
+    free(old);
+
+    for(i = 0; i < numrules; i++)
+        rules[i].priority =
+            src_table_prio + (i < idx ? i : i + 1) * step + step / 2;
+
+    if(rc < 0) {
+        /* Some of the rules may have moved and others not, and some may
+           be at both priorities or at neither.  Since rules now says
+           where they should be, bring the kernel in line with it. */
+        perror("change_rules");
+        rc = check_rules();
+        if(rc < 0)
+            return -1;
+    }
+    return 0;
 }
 
+/* Return the priority for a new rule at index [idx] of rules: between
+   those of its neighbours if there is room, otherwise after renumbering. */
 static int
-shift_rule(int from, int to)
+rule_priority(int idx)
 {
-    int dec = (from < to) ? 1 /* right */ : -1 /* left */;
+    int lo = idx > 0 ? rules[idx - 1].priority : src_table_prio - 1;
+    int hi = idx < numrules ? rules[idx].priority : rule_priority_end();
     int rc;
-    while(to != from) {
-        to -= dec;
-        rc = change_rule(to + dec + src_table_prio, to + src_table_prio,
-                         rules[to].src, rules[to].plen, rules[to].table);
-        if(rc < 0) {
-            perror("change_table_priority");
+
+    if(hi - lo < 2) {
+        rc = renumber_rules(idx);
+        if(rc < 0)
             return -1;
-        }
-        rules[to+dec] = rules[to];
-        rules[to].plen = 0;
+        lo = idx > 0 ? rules[idx - 1].priority : src_table_prio - 1;
+        hi = idx < numrules ? rules[idx].priority : rule_priority_end();
     }
-    return 0;
+    return lo + (hi - lo) / 2;
 }
 
-/* Return a new table at index [idx] of rules.  If cell at that index is not
-   free, we need to shift cells (and rules).  If it's full, return NULL. */
+/* Return a new table at index [idx] of rules.  If it's full, return NULL. */
 static struct rule *
 insert_table(const unsigned char *src, unsigned short src_plen, int idx)
 {
     int table;
     int rc;
-    int hole;
+    int priority;
 
-    if(idx < 0 || idx >= SRC_TABLE_NUM) {
+    if(idx < 0 || idx > numrules) {
         fprintf(stderr, "Incorrect table number %d\n", idx);
         return NULL;
     }
@@ -122,23 +203,34 @@ insert_table(const unsigned char *src, unsigned short src_plen, int idx)
         return NULL;
     }
 
-    hole = find_hole_around(idx);
-    if(hole < 0) {
-        fprintf(stderr, "Have free table but not free rule.\n");
-        goto fail;
+    if(numrules >= maxrules) {
+        int n = maxrules < 1 ? 8 : 2 * maxrules;
+        struct rule *new_rules = realloc(rules, n * sizeof(struct rule));
+        if(new_rules == NULL) {
+            perror("malloc(rule)");
+            goto fail;
+        }
+        rules = new_rules;
+        maxrules = n;
     }
-    rc = shift_rule(idx, hole);
-    if(rc < 0)
+
+    priority = rule_priority(idx);
+    if(priority < 0)
         goto fail;
 
-    rc = add_rule(idx + src_table_prio, src, src_plen, table);
+    rc = add_rule(priority, src, src_plen, table);
     if(rc < 0) {
         perror("add rule");
         goto fail;
     }
+    if(idx < numrules)
+        memmove(rules + idx + 1, rules + idx,
+                (numrules - idx) * sizeof(struct rule));
+    numrules++;
     memcpy(rules[idx].src, src, 16);
     rules[idx].plen = src_plen;
     rules[idx].table = table;
+    rules[idx].priority = priority;
 
     return &rules[idx];
  fail:
@@ -156,10 +248,8 @@ find_table_slot(const unsigned char *src, unsigned short src_plen, int *found)
     int i;
     *found = 0;
 
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
+    for(i = 0; i < numrules; i++) {
         kr = &rules[i];
-        if(kr->plen == 0)
-            return i;
         switch(prefix_cmp(src, src_plen, kr->src, kr->plen)) {
         case PST_LESS_SPECIFIC:
         case PST_DISJOINT:
@@ -172,7 +262,7 @@ find_table_slot(const unsigned char *src, unsigned short src_plen, int *found)
         }
     }
 
-    return -1;
+    return numrules < src_table_num ? numrules : -1;
 }
 
 int
@@ -201,76 +291,99 @@ find_table(const unsigned char *dest, unsigned short plen,
     return kr == NULL ? -1 : kr->table;
 }
 
-void
-release_tables(void)
+/* The source prefix that our rules send to table, if table is one of
+   our source tables. */
+int
+table_source(int table, unsigned char *src_return,
+             unsigned char *src_plen_return)
 {
     int i;
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
-        if(rules[i].plen != 0) {
-            flush_rule(i + src_table_prio,
-                       v4mapped(rules[i].src) ? AF_INET : AF_INET6);
-            rules[i].plen = 0;
+
+    for(i = 0; i < numrules; i++) {
+        if(rules[i].table == table) {
+            memcpy(src_return, rules[i].src, 16);
+            *src_plen_return = rules[i].plen;
+            return 1;
         }
-        used_tables[i] = 0;
     }
+    return 0;
 }
 
+void
+release_tables(void)
+{
+    int i;
+    for(i = 0; i < numrules; i++)
+        flush_rule(rules[i].priority, rules[i].src, rules[i].plen,
+                   rules[i].table);
+    numrules = 0;
+    memset(used_tables, 0, sizeof(used_tables));
+}
+
+/* What a dump of the kernel's rules found: for each of our rules, whether
+   it is installed (1) or not (0), per family; and the other rules at
+   priorities that we own that point at our tables, duplicates included.
+   Rules that point at other tables belong to the administrator. */
+struct rule_check {
+    char (*exists)[2];          /* v4, v6 */
+    struct kernel_rule *stray;
+    int numstray, maxstray;
+};
+
 static int
 filter_rule(struct kernel_rule *rule, void *data)
 {
     int i;
-    char (*rule_exists)[2][SRC_TABLE_NUM] = data;
+    struct rule_check *check = data;
     int is_v4 = v4mapped(rule->src);
     int r = is_v4 ? 0 : 1;
 
     if(martian_prefix(rule->src, rule->src_plen))
         return 0;
 
-    i = rule->priority - src_table_prio;
-
-    if(i < 0 || SRC_TABLE_NUM <= i)
+    if(!own_rule_priority(rule->priority) || !src_table(rule->table))
         return 0;
 
-    if(prefix_cmp(rule->src, rule->src_plen,
+    i = find_rule_priority(rule->priority);
+    if(i >= 0 &&
+       prefix_cmp(rule->src, rule->src_plen,
                   rules[i].src, rules[i].plen) == PST_EQUALS &&
        rule->table == rules[i].table &&
-       (*rule_exists)[r][i] == 0)
-        (*rule_exists)[r][i] = 1;
-    else
-        (*rule_exists)[r][i] = -1;
+       check->exists[i][r] == 0) {
+        check->exists[i][r] = 1;
+    } else {
+        if(check->numstray >= check->maxstray) {
+            int n = check->maxstray < 1 ? 8 : 2 * check->maxstray;
+            struct kernel_rule *new_stray =
+                realloc(check->stray, n * sizeof(struct kernel_rule));
+            if(new_stray == NULL)
+                return 1;
+            check->stray = new_stray;
+            check->maxstray = n;
+        }
+        check->stray[check->numstray++] = *rule;
+    }
 
     return 1;
 }
 
-/* This functions should be executed wrt the code just bellow: [rule_exists]
-   contains is a boolean array telling whether the rules we should have
-   installed in the kernel are installed or not.  If they aren't, then reinstall
-   them (this can append when rules are modified by third parties). */
+/* This functions should be executed wrt the code just bellow: [exists]
+   tells whether the rules we should have installed in the kernel are
+   installed or not.  If they aren't, then reinstall them (this can append
+   when rules are modified by third parties). */
 
 static void
-install_missing_rules(char rule_exists[SRC_TABLE_NUM], int v4)
+install_missing_rules(struct rule_check *check, int v4)
 {
     int i, rc;
-    for(i = 0; i < SRC_TABLE_NUM; i++) {
-        int priority = i + src_table_prio;
-        if(rule_exists[i] == 1)
+    int r = v4 ? 0 : 1;
+    for(i = 0; i < numrules; i++) {
+        int priority = rules[i].priority;
+        if(check->exists[i][r] == 1)
             continue;
 
-        if(rule_exists[i] != 0) {
-            int rc;
-            do {
-                rc = flush_rule(priority, v4 ? AF_INET : AF_INET6);
-            } while(rc >= 0);
-            if(errno != ENOENT && errno != EEXIST)
-                fprintf(stderr,
-                        "Cannot remove rule %d: from %s table %d (%s)\n",
-                        priority,
-                        format_prefix(rules[i].src, rules[i].plen),
-                        rules[i].table, strerror(errno));
-        }
-
         /* Be wise, our priority are both for v4 and v6 (does not overlap). */
-        if(!!v4mapped(rules[i].src) == !!v4 && rules[i].plen != 0) {
+        if(!!v4mapped(rules[i].src) == !!v4) {
             rc = add_rule(priority, rules[i].src,
                           rules[i].plen, rules[i].table);
             if(rc < 0)
@@ -286,18 +399,37 @@ install_missing_rules(char rule_exists[SRC_TABLE_NUM], int v4)
 int
 check_rules(void)
 {
-    int rc;
-    char rule_exists[2][SRC_TABLE_NUM]; /* v4, v6 */
+    int i, rc;
+    struct rule_check check = {0};
     struct kernel_filter filter = {0};
+
+    if(numrules > 0) {
+        check.exists = calloc(numrules, sizeof(*check.exists));
+        if(check.exists == NULL)
+            return -1;
+    }
     filter.rule = filter_rule;
-    filter.rule_closure = (void*) rule_exists;
-    memset(rule_exists, 0, sizeof(rule_exists));
+    filter.rule_closure = (void*) &check;
 
     rc = kernel_dump(CHANGE_RULE, &filter);
     if(rc < 0)
-        return -1;
-    install_missing_rules(rule_exists[0], 1);
-    install_missing_rules(rule_exists[1], 0);
-
-    return 0;
+        goto done;
+    for(i = 0; i < check.numstray; i++) {
+        struct kernel_rule *stray = &check.stray[i];
+        rc = flush_rule(stray->priority, stray->src, stray->src_plen,
+                        stray->table);
+        if(rc < 0 && errno != ENOENT)
+            fprintf(stderr, "Cannot remove rule %d: from %s table %d (%s)\n",
+                    stray->priority,
+                    format_prefix(stray->src, stray->src_plen),
+                    stray->table, strerror(errno));
+    }
+    install_missing_rules(&check, 1);
+    install_missing_rules(&check, 0);
+    rc = 0;
+
+ done:
+    free(check.exists);
+    free(check.stray);
+    return rc;
 }
@@ -21,15 +21,23 @@ THE SOFTWARE.
 */
 #ifndef _BABEL_RULE
 #define _BABEL_RULE
-#define SRC_TABLE_NUM 10
+#define SRC_TABLE_NUM 10        /* default number of tables */
+#define RULE_PRIORITY_GAP 16    /* priorities reserved per table */
 
 extern int src_table_idx; /* number of the first table */
 extern int src_table_prio; /* first prio range */
+extern int src_table_num; /* maximum number of tables */
 
 /* Return the number of the table using src_plen, allocate the table in the
    kernel if necessary. */
 int find_table(const unsigned char *dest, unsigned short plen,
                const unsigned char *src, unsigned short src_plen);
+int table_source(int table, unsigned char *src_return,
+                 unsigned char *src_plen_return);
 void release_tables(void);
+/* Whether priority is in the range used by our rules. */
+int own_rule_priority(unsigned int priority);
+/* Whether table is one that we install routes into. */
+int own_table(int table);
 int check_rules(void);
 #endif
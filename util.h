@@ -343,9 +343,9 @@ prefix_cmp(const unsigned char *p1, unsigned char plen1,
         return PST_DISJOINT;
 
     if(plen % 8 != 0) {
-        int i = plen / 8 + 1;
-	// FIXME - does the shift differ for endianness?
-        unsigned char mask = (0xFF << (plen % 8)) & 0xFF;
+        /* The first plen % 8 bits of the next byte. */
+        int i = plen / 8;
+        unsigned char mask = (0xFF << (8 - plen % 8)) & 0xFF;
         if((p1[i] & mask) != (p2[i] & mask))
             return PST_DISJOINT;
     }
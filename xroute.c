@@ -287,6 +287,7 @@ kernel_addresses(int ifindex, int ll, struct kernel_route *routes,
     struct kernel_filter filter = {0};
     filter.addr = filter_address;
     filter.addr_closure = data;
+    filter.ifindex = ifindex;
 
     kernel_dump(CHANGE_ADDR, &filter);
 